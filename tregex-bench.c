@@ -0,0 +1,392 @@
+#define _POSIX_C_SOURCE 200809L
+#include "tregex.h"
+#include <regex.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+ * Usage: tregex-bench [-t SECONDS] [FILTER]
+ * Runs every workload whose name or pattern contains FILTER on a corpus
+ * generated from a fixed seed, for tregex, its JIT and glibc <regex.h>, then
+ * the matching scan workloads over one large corpus with growing thread counts.
+ */
+
+#define BENCH_SEED        20240601u
+#define BENCH_WARMUP      3
+#define BENCH_MAX_SAMPLES 100000
+#define BENCH_SAMPLE_NS   2000
+#define BENCH_TIMEOUT     10
+#define BENCH_SCAN_SIZE   (256u << 20)
+#define BENCH_SCAN_RUNS   3
+
+typedef struct {
+  const char *name;
+  const char *re;
+  const char *needle;
+  int pathological;
+} bench_workload;
+
+static const bench_workload workloads[] = {
+  { "literal",     "FATAL disk quota exceeded",                "FATAL disk quota exceeded", 0 },
+  { "literal",     "session [0-9a-f]+ expired",                "session 3fa9c0 expired", 0 },
+  { "class",       "[a-z]+@[a-z]+\\.(com|org)",                "root@example.org", 0 },
+  { "class",       "[A-Z][a-z]+ [0-9]{4}-[0-9]{2}-[0-9]{2}",   "Deadline 2026-10-18", 0 },
+  { "alternation", "(FATAL|PANIC|ABORT|CRASH): (disk|net|cpu)", "PANIC: net", 0 },
+  { "alternation", "(Sherlock|Watson|Holmes|Moriarty|Lestrade)", "Lestrade", 0 },
+  { "redos",       "^(a|a)*b$",                                NULL, 1 },
+  { "redos",       "^(a*)*b$",                                 NULL, 1 },
+  { "redos",       "^(a|aa)+$",                                NULL, 1 },
+};
+
+/* Whole-input validations for tregex_match_parallel, which reports its scaling over threads. */
+static const bench_workload scans[] = {
+  { "scan",        "([a-z0-9]+[^a-z0-9])*",                    NULL, 0 },
+  { "scan",        "([a-z]+ |[0-9]+[^a-z0-9])*",               NULL, 0 },
+};
+
+static const size_t sizes[] = { 64, 4096, 1 << 20 };
+static const size_t pathological_sizes[] = { 16, 256, 4096 };
+
+typedef struct {
+  const char *name;
+  void *(*create)(const char *re);
+  int (*run)(void *engine, const char *str, size_t len);
+  void (*destroy)(void *engine);
+} bench_engine;
+
+typedef struct {
+  tregex_byte_code_list *compiled;
+  tregex_matcher *matcher;
+  tregex_jit *jit;
+  tregex_packed *packed, *threaded;
+} bench_tregex;
+
+#ifdef __GLIBC__
+/* Every allocation in the process, glibc's regex included, goes through these. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+static size_t allocs;
+
+void *malloc(size_t size) {
+  allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  allocs++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  allocs++;
+  return __libc_realloc(p, size);
+}
+#define BENCH_ALLOCS() allocs
+#else
+#define BENCH_ALLOCS() ((size_t)0)
+#endif
+
+static uint64_t bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t bench_rand(uint32_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+/* Log-like text of lowercase words, numbers and punctuation, with `needle` at the very end. */
+static char *bench_corpus(size_t size, const char *needle, int pathological) {
+  static const char *words[] = { "get", "post", "user", "cache", "miss", "hit", "ok", "request", "id", "latency", "ms", "from", "to", "node" };
+  uint32_t seed = BENCH_SEED ^ (uint32_t)size;
+  char *buf = malloc(size + 1);
+  size_t len = 0, tail = needle ? strlen(needle) : 1;
+
+  if (!buf) return NULL;
+  if (pathological) {
+    memset(buf, 'a', size);
+    buf[size - 1] = '!';
+    buf[size] = 0;
+    return buf;
+  }
+  while (len + tail < size) {
+    uint32_t r = bench_rand(&seed);
+    const char *word = words[r % (sizeof(words) / sizeof(*words))];
+    char token[32];
+    int n = (r >> 8) % 4 ? snprintf(token, sizeof(token), "%s ", word) : snprintf(token, sizeof(token), "%u%c", (r >> 12) % 10000, (r >> 4) % 8 ? ' ' : '\n');
+    if (len + n + tail > size)
+      n = (int)(size - tail - len);
+    memcpy(buf + len, token, n);
+    len += n;
+  }
+  memcpy(buf + size - tail, needle ? needle : "\n", tail);
+  buf[size] = 0;
+  return buf;
+}
+
+static void *bench_tregex_create(const char *re) {
+  bench_tregex *t = calloc(1, sizeof(bench_tregex));
+  if (!t || !(t->compiled = tregex_compile(re)) || !(t->matcher = tregex_matcher_create()) || !(t->jit = tregex_jit_create(t->compiled)) ||
+      !(t->packed = tregex_pack(t->compiled, 0)) || !(t->threaded = tregex_pack(t->compiled, 1))) {
+    if (t) {
+      tregex_jit_destroy(t->jit);
+      free(t->packed);
+      tregex_matcher_destroy(t->matcher);
+      free(t->compiled);
+    }
+    free(t);
+    return NULL;
+  }
+  return t;
+}
+
+static int bench_tregex_run(void *engine, const char *str, size_t len) {
+  int match_start = -1;
+  return tregex_matcher_search(((bench_tregex *)engine)->matcher, ((bench_tregex *)engine)->compiled, str, len, &match_start) >= 0 ? match_start : -1;
+}
+
+static int bench_jit_run(void *engine, const char *str, size_t len) {
+  int match_start = -1;
+  return tregex_jit_search_n(((bench_tregex *)engine)->jit, str, len, &match_start) >= 0 ? match_start : -1;
+}
+
+static int bench_packed_run(void *engine, const char *str, size_t len) {
+  int match_start = -1;
+  return tregex_packed_search_n(((bench_tregex *)engine)->matcher, ((bench_tregex *)engine)->packed, str, len, &match_start) >= 0 ? match_start : -1;
+}
+
+static int bench_threaded_run(void *engine, const char *str, size_t len) {
+  int match_start = -1;
+  return tregex_packed_search_n(((bench_tregex *)engine)->matcher, ((bench_tregex *)engine)->threaded, str, len, &match_start) >= 0 ? match_start : -1;
+}
+
+static void bench_tregex_destroy(void *engine) {
+  bench_tregex *t = engine;
+  free(t->threaded);
+  free(t->packed);
+  tregex_jit_destroy(t->jit);
+  tregex_matcher_destroy(t->matcher);
+  free(t->compiled);
+  free(t);
+}
+
+static void *bench_posix_create(const char *re) {
+  regex_t *preg = malloc(sizeof(regex_t));
+  if (preg && regcomp(preg, re, REG_EXTENDED)) {
+    free(preg);
+    return NULL;
+  }
+  return preg;
+}
+
+static int bench_posix_run(void *engine, const char *str, size_t len) {
+  regmatch_t m[1];
+  (void)len;
+  return regexec(engine, str, 1, m, 0) ? -1 : (int)m[0].rm_so;
+}
+
+static void bench_posix_destroy(void *engine) {
+  regfree(engine);
+  free(engine);
+}
+
+static const bench_engine engines[] = {
+  { "tregex", bench_tregex_create, bench_tregex_run, bench_tregex_destroy },
+  { "packed", bench_tregex_create, bench_packed_run, bench_tregex_destroy },
+  { "thread", bench_tregex_create, bench_threaded_run, bench_tregex_destroy },
+  { "jit", bench_tregex_create, bench_jit_run, bench_tregex_destroy },
+  { "glibc", bench_posix_create, bench_posix_run, bench_posix_destroy },
+};
+
+static int bench_cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void bench_time(char *out, size_t size, double ns) {
+  if (ns < 1e3) snprintf(out, size, "%.0fns", ns);
+  else if (ns < 1e6) snprintf(out, size, "%.1fus", ns / 1e3);
+  else if (ns < 1e9) snprintf(out, size, "%.2fms", ns / 1e6);
+  else snprintf(out, size, "%.2fs", ns / 1e9);
+}
+
+/*
+ * Times `engine` on one input until `budget` seconds have passed. Calls are
+ * grouped so that each latency sample spans at least BENCH_SAMPLE_NS, which
+ * keeps clock overhead out of small inputs. A first call slower than the
+ * whole budget is reported alone and sets `*slow`, so exponential cases end.
+ */
+static int bench_case(const bench_engine *engine, void *e, const char *str, size_t len, double budget, double *samples, int *slow) {
+  int reps = 1, nsamples = 0, result;
+  size_t allocs0 = BENCH_ALLOCS(), calls = 1;
+  uint64_t start = bench_now(), deadline = start + (uint64_t)(budget * 1e9), now;
+
+  result = engine->run(e, str, len);
+  now = bench_now();
+  *slow = now > deadline;
+  if (*slow)
+    samples[nsamples++] = (double)(now - start);
+  else {
+    if (now - start < BENCH_SAMPLE_NS)
+      reps = (int)(BENCH_SAMPLE_NS / (now - start ? now - start : 1));
+    for (int i = 0; i < BENCH_WARMUP; i++)
+      engine->run(e, str, len);
+    allocs0 = BENCH_ALLOCS();
+    calls = 0;
+    start = now = bench_now();
+    deadline = start + (uint64_t)(budget * 1e9);
+    while (nsamples < BENCH_MAX_SAMPLES && (now < deadline || nsamples < 5)) {
+      for (int i = 0; i < reps; i++)
+        engine->run(e, str, len);
+      uint64_t t = bench_now();
+      samples[nsamples++] = (double)(t - now) / reps;
+      calls += reps;
+      now = t;
+    }
+  }
+  size_t allocs1 = BENCH_ALLOCS();
+
+  qsort(samples, nsamples, sizeof(double), bench_cmp);
+  char median[16], p99[16];
+  bench_time(median, sizeof(median), samples[nsamples / 2]);
+  bench_time(p99, sizeof(p99), samples[nsamples * 99 / 100]);
+  printf(" %-7s %10.1f %9s %9s %7.2f", engine->name, (double)len * calls / ((now - start) / 1e9) / 1e6, median, p99,
+         (double)(allocs1 - allocs0) / calls);
+#ifndef __GLIBC__
+  printf(" (untracked)");
+#endif
+  printf("%s%s\n", result < 0 ? " nomatch" : "", *slow ? " slow" : "");
+  return result;
+}
+
+/*
+ * Runs bench_case in a child killed after BENCH_TIMEOUT seconds, since a
+ * backtracking call cannot be interrupted. Returns -2 and sets `*slow` on
+ * timeout.
+ */
+static int bench_fork(const bench_engine *engine, const char *re, const char *str, size_t len, double budget, double *samples, int *slow) {
+  int fds[2], out[2] = { -2, 1 }, status;
+  fflush(stdout);
+  if (pipe(fds))
+    return -2;
+  pid_t pid = fork();
+  if (pid == 0) {
+    void *e = engine->create(re);
+    close(fds[0]);
+    alarm(BENCH_TIMEOUT);
+    out[1] = 0;
+    if (!e)
+      printf(" %-7s unsupported\n", engine->name);
+    else {
+      out[0] = bench_case(engine, e, str, len, budget, samples, &out[1]);
+      engine->destroy(e);
+    }
+    fflush(stdout);
+    _exit(write(fds[1], out, sizeof(out)) != sizeof(out));
+  }
+  close(fds[1]);
+  if (pid < 0 || read(fds[0], out, sizeof(out)) != sizeof(out))
+    out[0] = -2, out[1] = 1;
+  close(fds[0]);
+  if (pid > 0)
+    waitpid(pid, &status, 0);
+  if (pid > 0 && WIFSIGNALED(status))
+    printf(" %-7s timeout\n", engine->name);
+  *slow = out[1];
+  return out[0];
+}
+
+/* Best of BENCH_SCAN_RUNS parallel matches of the whole corpus per thread count, doubling up to the online cores. */
+static void bench_scan(const bench_workload *wl, const char *str, size_t len) {
+  tregex_byte_code_list *compiled = tregex_compile(wl->re);
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  double base = 0;
+  if (!compiled) return;
+  for (int threads = 1; threads == 1 || threads <= ncpu; threads *= 2) {
+    double best = 0;
+    int64_t result = 0;
+    for (int i = 0; i < BENCH_SCAN_RUNS; i++) {
+      uint64_t start = bench_now();
+      result = tregex_match_parallel(compiled, str, len, threads);
+      double ns = (double)(bench_now() - start);
+      if (!i || ns < best)
+        best = ns;
+    }
+    if (threads == 1)
+      base = best;
+    char median[16];
+    bench_time(median, sizeof(median), best);
+    printf("%-12s %-42s %9zu %-7d %10.1f %9s %8.2fx%s\n", wl->name, wl->re, len, threads, len / (best / 1e9) / 1e6, median, base / best,
+           result < 0 ? " nomatch" : "");
+  }
+  free(compiled);
+}
+
+int main(int argc, char **argv) {
+  double budget = 0.25;
+  const char *filter = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-t") && i + 1 < argc)
+      budget = atof(argv[++i]);
+    else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: %s [-t SECONDS] [FILTER]\n", argv[0]);
+      return 2;
+    }
+    else
+      filter = argv[i];
+  }
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  double *samples = malloc(BENCH_MAX_SAMPLES * sizeof(double));
+  if (!samples) return 1;
+  printf("%-12s %-42s %8s %-7s %10s %9s %9s %7s\n", "workload", "pattern", "size", "engine", "MB/s", "median", "p99", "allocs");
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(*workloads); w++) {
+    const bench_workload *wl = &workloads[w];
+    const size_t *sz = wl->pathological ? pathological_sizes : sizes;
+    if (filter && !strstr(wl->name, filter) && !strstr(wl->re, filter))
+      continue;
+    int slow[sizeof(engines) / sizeof(*engines)] = { 0 };
+    for (int s = 0; s < 3; s++) {
+      char *str = bench_corpus(sz[s], wl->needle, wl->pathological);
+      int expect = -2;
+      if (!str) return 1;
+      for (size_t k = 0; k < sizeof(engines) / sizeof(*engines); k++) {
+        printf("%-12s %-42s %8zu", wl->name, wl->re, sz[s]);
+        if (slow[k]) {
+          printf(" %-7s skipped\n", engines[k].name);
+          continue;
+        }
+        int result = bench_fork(&engines[k], wl->re, str, sz[s], budget, samples, &slow[k]);
+        if (result == -2)
+          continue;
+        if (expect != -2 && result != expect)
+          fprintf(stderr, "%s disagrees on %s: match at %d, expected %d\n", engines[k].name, wl->re, result, expect);
+        expect = result;
+      }
+      free(str);
+    }
+  }
+  free(samples);
+
+  char *corpus = NULL;
+  for (size_t w = 0; w < sizeof(scans) / sizeof(*scans); w++) {
+    if (filter && !strstr(scans[w].name, filter) && !strstr(scans[w].re, filter))
+      continue;
+    if (!corpus) {
+      if (!(corpus = bench_corpus(BENCH_SCAN_SIZE, NULL, 0)))
+        return 1;
+      printf("\n%-12s %-42s %9s %-7s %10s %9s %9s\n", "workload", "pattern", "size", "threads", "MB/s", "best", "speedup");
+    }
+    bench_scan(&scans[w], corpus, BENCH_SCAN_SIZE);
+  }
+  free(corpus);
+  return 0;
+}
@@ -0,0 +1,488 @@
+#include "tregex.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Usage: tregex-check [-n PATTERNS] [-s SEED]
+ * Generates random small patterns over a three-letter alphabet and matches
+ * each against every short subject, comparing what the backtracker returns
+ * with the Pike VM, lazy DFA, stream, packed and JIT engines, and the
+ * groups it captures with the one-pass engine's where it applies. The match
+ * iterator, split and tokenize are checked against anchored matches at every
+ * offset, random sets of patterns against each pattern alone, and threaded
+ * batches against matching one subject at a time. Some of the patterns are
+ * also matched against a subject too long for the visited bitmap, so the
+ * backtracker and native code run without it there, and long enough for
+ * tregex_match_parallel to split it. Step budgets and cycle deadlines must
+ * stop an exponential match with their errors.
+ * Prints each disagreement and exits with status 1 if there was any.
+ */
+
+#define CHECK_SEED         20240601u
+#define CHECK_PATTERNS     1000
+#define CHECK_SUBJECT_LEN  4
+#define CHECK_SUBJECTS     121  /* over {a, b, c}, up to CHECK_SUBJECT_LEN long */
+#define CHECK_MAX_REPORTS  20
+#define CHECK_ANY          -2
+#define CHECK_CASE_STEPS   (1 << 20)
+#define CHECK_LONG_EVERY   20
+#define CHECK_LONG_LEN     ((size_t)MAX_BITSTATE_SIZE * 8 + 64)
+#define CHECK_LONG_STEPS   (1 << 16)
+#define CHECK_MAX_MATCHES  (2 * CHECK_SUBJECT_LEN + 2)
+#define CHECK_SETS         100
+#define CHECK_SET_MAX      80
+#define CHECK_BATCH_COPIES 3
+#define CHECK_BATCH_SPANS  (CHECK_BATCH_COPIES * CHECK_SUBJECTS)
+#define CHECK_LIMIT_STEPS  64
+
+/*
+ * Cases once mishandled by some engine, checked against a known answer. They
+ * run under a CHECK_CASE_STEPS budget, so one that goes exponential again is
+ * reported instead of only being slow.
+ */
+static const struct {
+  const char *re, *str;
+  int expect;
+} check_cases[] = {
+  { "(^|.){2,3}b", "abb", 2 },
+  { "c{0,1}^", "c", 0 },
+  { "c{0,}^", "cca", 0 },
+  { "((c|b)[ab].|(a){0,2})^", "a", 0 },
+  { "[ab]+b", "ab", 2 },
+  { "[0-9]+0", "100", 3 },
+  { "a+a", "aa", 2 },
+  { "((a+)+){1,2}[bc]", "aaaaaaaaaaaaaaaaaaaaaaaaaa", -1 },
+  { "((a+)+){1,2}[bc]", "aaaaaaaaaaaaaaaaaaaaaaaaab", 26 },
+  { "(a*a*a*){2}[bc]", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", -1 },
+  { "(a*a*a*){2,}[bc]", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", -1 },
+  { "(a|aa){3,5}b", "aaaaaaab", 8 },
+};
+
+static uint32_t check_rand(uint32_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static size_t check_gen(char *re, size_t n, size_t size, uint32_t *seed, int depth);
+
+static size_t check_atom(char *re, size_t n, size_t size, uint32_t *seed, int depth) {
+  static const char *atoms[] = { "a", "b", "c", ".", "[ab]", "[^a]", "[b-c]", "^", "$" };
+  uint32_t r = check_rand(seed);
+  if (depth < 3 && r % 5 == 0) {
+    if (n + 1 < size) re[n++] = '(';
+    n = check_gen(re, n, size, seed, depth + 1);
+    if (n + 1 < size) re[n++] = ')';
+  }
+  else
+    n += snprintf(re + n, size - n, "%s", atoms[(r >> 4) % (sizeof(atoms) / sizeof(*atoms))]);
+  if (n >= size) return size - 1;
+  if (re[n - 1] == '^' || re[n - 1] == '$')
+    return n;
+  switch ((r >> 12) % 10) {
+  case 0: n += snprintf(re + n, size - n, "*"); break;
+  case 1: n += snprintf(re + n, size - n, "+"); break;
+  case 2: n += snprintf(re + n, size - n, "?"); break;
+  case 3: n += snprintf(re + n, size - n, "{%u,%u}", (r >> 16) % 3, (r >> 16) % 3 + (r >> 20) % 3); break;
+  case 4: n += snprintf(re + n, size - n, "{%u,}", (r >> 16) % 3); break;
+  case 5: n += snprintf(re + n, size - n, "*?"); break;
+  case 6: n += snprintf(re + n, size - n, "??"); break;
+  }
+  return n < size ? n : size - 1;
+}
+
+/* An alternation of one to three concatenations of one to three atoms. */
+static size_t check_gen(char *re, size_t n, size_t size, uint32_t *seed, int depth) {
+  int alts = 1 + check_rand(seed) % (depth ? 3 : 2);
+  for (int i = 0; i < alts; i++) {
+    if (i && n + 1 < size) re[n++] = '|';
+    for (int k = 1 + check_rand(seed) % 3; k > 0; k--)
+      n = check_atom(re, n, size, seed, depth);
+  }
+  re[n] = 0;
+  return n;
+}
+
+/* Stores the `i`th subject over {a, b, c} up to CHECK_SUBJECT_LEN long in `str`; 0 past the last. */
+static int check_subject_at(char *str, int i) {
+  int len = 0, total = 1;
+  for (; i >= total; i -= total, total *= 3)
+    if (++len > CHECK_SUBJECT_LEN)
+      return 0;
+  for (int k = 0; k < len; k++, i /= 3)
+    str[k] = (char)('a' + i % 3);
+  str[len] = 0;
+  return 1;
+}
+
+static int check_report(const char *re, const char *str, const char *engine, int64_t got, int expect, int *reports) {
+  if ((*reports)++ < CHECK_MAX_REPORTS)
+    printf("%-7s /%s/ on \"%.40s%s\": %lld, expected %d\n", engine, re, str, strlen(str) > 40 ? "..." : "", (long long)got, expect);
+  return 1;
+}
+
+typedef struct {
+  const char *re;
+  tregex_byte_code_list *compiled;
+  tregex_byte_code_list *unbegun;
+  tregex_byte_code_list *grouped;
+  tregex_onepass *onepass;
+  tregex_dfa *dfa;
+  tregex_stream *stream;
+  tregex_packed *packed;
+  tregex_jit *jit;
+} check_program;
+
+/*
+ * Also compiles `re` with every `^` outside a set turned into a set no
+ * subject byte is in: a match anchored past offset 0 never sees offset 0.
+ */
+static void check_program_init(check_program *prog, const char *re, tregex_byte_code_list *compiled) {
+  char unbegun[1024];
+  size_t n = 0;
+  for (size_t i = 0; re[i] && n + 8 < sizeof(unbegun); i++)
+    n += re[i] == '^' && (!i || re[i - 1] != '[') ? (size_t)sprintf(unbegun + n, "[^abc]") : (unbegun[n] = re[i], 1);
+  unbegun[n] = 0;
+  prog->re = re;
+  prog->compiled = compiled;
+  prog->unbegun = tregex_compile(unbegun);
+  prog->grouped = tregex_compile_groups(re);
+  prog->onepass = prog->grouped ? tregex_onepass_create(prog->grouped) : NULL;
+  prog->dfa = tregex_dfa_create(compiled);
+  prog->stream = tregex_stream_create(compiled);
+  prog->packed = tregex_pack(compiled, 0);
+  prog->jit = tregex_jit_create(compiled);
+}
+
+static void check_program_destroy(check_program *prog) {
+  tregex_jit_destroy(prog->jit);
+  free(prog->packed);
+  tregex_stream_destroy(prog->stream);
+  tregex_dfa_destroy(prog->dfa);
+  tregex_onepass_destroy(prog->onepass);
+  free(prog->grouped);
+  free(prog->unbegun);
+  free(prog->compiled);
+}
+
+/* Runs every engine on `str`; with CHECK_ANY the backtracker's answer is the expected one. */
+static int check_subject(check_program *prog, tregex_matcher *matcher, const char *str, int expect, int *reports) {
+  const char *re = prog->re;
+  size_t len = strlen(str);
+  int64_t got = tregex_matcher_match(matcher, prog->compiled, str, len);
+  int bad = 0;
+  if (expect == CHECK_ANY)
+    expect = (int)got;
+  else if (got != expect)
+    bad |= check_report(re, str, "backtracker", got, expect, reports);
+  if ((got = tregex_pike_match_n(NULL, str, len, prog->compiled)) != expect)
+    bad |= check_report(re, str, "pike", got, expect, reports);
+  if (prog->dfa && (got = tregex_dfa_match_n(prog->dfa, str, len)) != expect)
+    bad |= check_report(re, str, "dfa", got, expect, reports);
+  if (prog->stream) {
+    tregex_stream_reset(prog->stream);
+    tregex_stream_feed(prog->stream, str, len);
+    if ((got = tregex_stream_finish(prog->stream)) != expect)
+      bad |= check_report(re, str, "stream", got, expect, reports);
+  }
+  if (prog->packed && (got = tregex_packed_match_n(matcher, prog->packed, str, len)) != expect)
+    bad |= check_report(re, str, "packed", got, expect, reports);
+  if (prog->jit && (got = tregex_jit_match_n(prog->jit, str, len)) != expect)
+    bad |= check_report(re, str, "jit", got, expect, reports);
+  return bad;
+}
+
+/* Compares the backtracker's match end and groups with the one-pass engine's. */
+static int check_groups(check_program *prog, tregex_matcher *matcher, const char *str, int *reports) {
+  tregex_capture expect[MAX_ONEPASS_GROUPS + 1], got[MAX_ONEPASS_GROUPS + 1];
+  int ngroups = prog->grouped->groups + 1, end, expect_end;
+  char engine[32];
+  if (!prog->onepass)
+    return 0;
+  expect_end = tregex_matcher_match_groups(matcher, prog->grouped, str, strlen(str), expect, ngroups);
+  if ((end = tregex_onepass_match_n(prog->onepass, str, strlen(str), got, ngroups)) != expect_end)
+    return check_report(prog->re, str, "onepass", end, expect_end, reports);
+  for (int i = 0; end >= 0 && i < ngroups; i++) {
+    snprintf(engine, sizeof(engine), "group %d", i);
+    if (got[i].start != expect[i].start)
+      return check_report(prog->re, str, engine, got[i].start, expect[i].start, reports);
+    if (got[i].end != expect[i].end)
+      return check_report(prog->re, str, engine, got[i].end, expect[i].end, reports);
+  }
+  return 0;
+}
+
+/*
+ * Walks the matches of `str` with the iterator, split and tokenize and
+ * compares them with the leftmost anchored match at or after each resume
+ * point: the match end after a match, one past it after an empty one.
+ */
+static int check_iter(check_program *prog, tregex_matcher *matcher, const char *str, int *reports) {
+  int len = (int)strlen(str), ends[CHECK_SUBJECT_LEN + 1], starts[CHECK_MAX_MATCHES], stops[CHECK_MAX_MATCHES];
+  int count = 0, bad = 0, got, n, k;
+  tregex_slice match, slices[CHECK_MAX_MATCHES + 1];
+  tregex_iter it;
+  if (!prog->unbegun)
+    return 0;
+  for (int s = 0; s <= len; s++) {
+    got = tregex_matcher_match(matcher, s ? prog->unbegun : prog->compiled, str + s, (size_t)(len - s));
+    ends[s] = got < 0 ? TREGEX_NOMATCH : s + got;
+  }
+  for (int pos = 0, s; pos <= len && count < CHECK_MAX_MATCHES; pos = stops[count - 1] + (stops[count - 1] == starts[count - 1])) {
+    for (s = pos; s <= len && ends[s] < 0; s++)
+      ;
+    if (s > len)
+      break;
+    starts[count] = s;
+    stops[count++] = ends[s];
+  }
+
+  tregex_iter_init(&it, matcher, prog->compiled, str, (size_t)len);
+  for (k = 0; k <= count; k++) {
+    int expect = k < count ? stops[k] : TREGEX_NOMATCH;
+    if ((got = tregex_iter_next(&it, &match)) != expect)
+      return check_report(prog->re, str, "iter", got, expect, reports);
+    if (got >= 0 && match.str - str != starts[k])
+      return check_report(prog->re, str, "iter start", match.str - str, starts[k], reports);
+  }
+  for (int max = 0; max <= count + 1; max++) {
+    if ((got = tregex_tokenize(matcher, prog->compiled, str, (size_t)len, slices, max)) != count)
+      bad |= check_report(prog->re, str, "tokenize", got, count, reports);
+    for (k = 0; got == count && k < max && k < count; k++)
+      if (slices[k].str - str != starts[k] || (int)slices[k].len != stops[k] - starts[k])
+        bad |= check_report(prog->re, str, "tokenize start", slices[k].str - str, starts[k], reports);
+    /* The first max - 1 matches split the subject and the last field is the rest. */
+    n = max < count + 1 ? max : count + 1;
+    if ((got = tregex_split(matcher, prog->compiled, str, (size_t)len, slices, max)) != n)
+      bad |= check_report(prog->re, str, "split", got, n, reports);
+    for (k = 0; got == n && k < n; k++) {
+      int from = k ? stops[k - 1] : 0, to = k < n - 1 ? starts[k] : len;
+      if (slices[k].str - str != from || (int)slices[k].len != to - from)
+        bad |= check_report(prog->re, str, "split field", slices[k].str - str, from, reports);
+    }
+  }
+  return bad;
+}
+
+/*
+ * Matches CHECK_BATCH_COPIES copies of every subject, packed back to back in
+ * one buffer, with tregex_match_batch_threads on `nthreads` threads and
+ * compares each result with the backtracker on that span alone.
+ */
+static int check_batch(check_program *prog, tregex_matcher *matcher, int nthreads, int *reports) {
+  static char buf[CHECK_BATCH_SPANS * CHECK_SUBJECT_LEN];
+  tregex_slice spans[CHECK_BATCH_SPANS];
+  int results[CHECK_BATCH_SPANS], n = 0, expect = 0, got, bad = 0;
+  char str[CHECK_SUBJECT_LEN + 1], *p = buf;
+  for (int copy = 0; copy < CHECK_BATCH_COPIES; copy++)
+    for (int i = 0; check_subject_at(str, i) && n < CHECK_BATCH_SPANS; i++) {
+      spans[n].str = memcpy(p, str, strlen(str));
+      spans[n++].len = strlen(str);
+      p += strlen(str);
+    }
+  if ((got = tregex_match_batch_threads(prog->compiled, spans, n, results, nthreads)) < 0)
+    return check_report(prog->re, "", "batch", got, 0, reports);
+  for (int i = 0; i < n; i++) {
+    int alone = tregex_matcher_match(matcher, prog->compiled, spans[i].str, spans[i].len);
+    memcpy(str, spans[i].str, spans[i].len);
+    str[spans[i].len] = 0;
+    expect += alone >= 0;
+    if (results[i] != alone)
+      bad |= check_report(prog->re, str, "batch", results[i], alone, reports);
+  }
+  if (got != expect)
+    bad |= check_report(prog->re, "", "batch count", got, expect, reports);
+  return bad;
+}
+
+/*
+ * Compiles one to CHECK_SET_MAX random patterns as a set and checks, for
+ * every subject, that the set reports exactly the patterns that match alone.
+ * A subject on which some pattern alone runs out of steps is skipped.
+ */
+static int check_set(tregex_matcher *matcher, uint32_t *seed, long *cases, int *reports) {
+  static char res[CHECK_SET_MAX][256];
+  const char *names[CHECK_SET_MAX];
+  tregex_byte_code_list *compiled[CHECK_SET_MAX];
+  uint64_t matched[(CHECK_SET_MAX + 63) / 64];
+  char str[CHECK_SUBJECT_LEN + 1];
+  int count = 1 + check_rand(seed) % CHECK_SET_MAX, n = 0, bad = 0;
+  for (int k = 0; k < count; k++) {
+    check_gen(res[n], 0, sizeof(res[n]), seed, 0);
+    if ((compiled[n] = tregex_compile(res[n])))
+      names[n] = res[n], n++;
+  }
+  tregex_set *set = n ? tregex_set_compile(names, n) : NULL;
+  tregex_matcher_set_budget(matcher, CHECK_LONG_STEPS, 0);
+  for (int i = 0; set && check_subject_at(str, i); i++) {
+    int got = tregex_set_match_n(set, str, strlen(str), matched), expect = 0, alone[CHECK_SET_MAX], k;
+    for (k = 0; k < n && (alone[k] = tregex_matcher_match(matcher, compiled[k], str, strlen(str))) >= TREGEX_NOMATCH; k++)
+      expect += alone[k] >= 0;
+    if (k < n)
+      continue;
+    (*cases)++;
+    for (k = 0; k < n; k++)
+      if ((alone[k] >= 0) != (int)(matched[k / 64] >> (k % 64) & 1))
+        bad |= check_report(res[k], str, "set", alone[k] < 0, alone[k] >= 0, reports);
+    if (got != expect)
+      bad |= check_report(names[0], str, "set count", got, expect, reports);
+  }
+  tregex_matcher_set_budget(matcher, 0, 0);
+  tregex_set_destroy(set);
+  while (n > 0)
+    free(compiled[--n]);
+  return bad;
+}
+
+/*
+ * Fills `str` with a short random period and matches it with a step budget:
+ * past the bitmap's reach patterns may backtrack exponentially, and those
+ * that run out of steps or stack are skipped. tregex_match_parallel, on two
+ * to four threads, must agree with the stream, which has no budget.
+ */
+static int check_long(check_program *prog, tregex_matcher *matcher, char *str, uint32_t *seed, long *cases, int *reports) {
+  char period[8];
+  int n = 1 + check_rand(seed) % (int)sizeof(period), bad = 0;
+  for (int k = 0; k < n; k++)
+    period[k] = (char)('a' + check_rand(seed) % 3);
+  for (size_t i = 0; i < CHECK_LONG_LEN; i++)
+    str[i] = period[i % n];
+  str[CHECK_LONG_LEN] = 0;
+
+  tregex_matcher_set_budget(matcher, CHECK_LONG_STEPS, 0);
+  if (prog->jit)
+    tregex_jit_set_budget(prog->jit, CHECK_LONG_STEPS, 0);
+  if (tregex_matcher_match(matcher, prog->compiled, str, CHECK_LONG_LEN) >= TREGEX_NOMATCH) {
+    (*cases)++;
+    bad = check_subject(prog, matcher, str, CHECK_ANY, reports);
+  }
+  tregex_matcher_set_budget(matcher, 0, 0);
+  if (prog->jit)
+    tregex_jit_set_budget(prog->jit, 0, 0);
+
+  /* Starred, the pattern tends to run over the whole period and across chunk boundaries. */
+  char starred[300];
+  snprintf(starred, sizeof(starred), "(%s)*", prog->re);
+  for (int form = 0; form < 2; form++) {
+    tregex_byte_code_list *compiled = form ? tregex_compile(starred) : prog->compiled;
+    tregex_stream *stream = compiled ? tregex_stream_create(compiled) : NULL;
+    int64_t expect, got;
+    if (stream) {
+      tregex_stream_feed(stream, str, CHECK_LONG_LEN);
+      expect = tregex_stream_finish(stream);
+      (*cases)++;
+      if ((got = tregex_match_parallel(compiled, str, CHECK_LONG_LEN, 2 + n % 3)) != expect)
+        bad |= check_report(form ? starred : prog->re, str, "parallel", got, (int)expect, reports);
+    }
+    tregex_stream_destroy(stream);
+    if (form)
+      free(compiled);
+  }
+  return bad;
+}
+
+/*
+ * Matches and searches an exponential pattern under a CHECK_LIMIT_STEPS
+ * budget and then under a one-cycle deadline, on the matcher and the JIT.
+ * Each must stop with TREGEX_ERROR_BUDGET or TREGEX_ERROR_TIMEOUT, and the
+ * limits must be gone once reset.
+ */
+static int check_limits(tregex_matcher *matcher, long *cases, int *reports) {
+  /* The trailing b gets past the required literal check, so the backtracker runs. */
+  static const char re[] = "((a|a)+)+b", str[] = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaacb";
+  static const struct {
+    uint64_t steps, cycles;
+    int expect;
+  } limits[] = {
+    { CHECK_LIMIT_STEPS, 0, TREGEX_ERROR_BUDGET },
+    { 0, 1, TREGEX_ERROR_TIMEOUT },
+    { 0, 0, TREGEX_NOMATCH },
+  };
+  tregex_byte_code_list *compiled = tregex_compile(re);
+  tregex_jit *jit = compiled ? tregex_jit_create(compiled) : NULL;
+  int bad = 0, start;
+  if (!compiled)
+    return check_report(re, str, "compile", 0, 1, reports);
+  for (size_t i = 0; i < sizeof(limits) / sizeof(*limits); i++) {
+    int expect = limits[i].expect, got;
+    tregex_matcher_set_budget(matcher, limits[i].steps, limits[i].cycles);
+    *cases += 2;
+    if ((got = tregex_matcher_match(matcher, compiled, str, strlen(str))) != expect)
+      bad |= check_report(re, str, "budget", got, expect, reports);
+    if ((got = tregex_matcher_search(matcher, compiled, str, strlen(str), &start)) != expect)
+      bad |= check_report(re, str, "budget search", got, expect, reports);
+    if (jit) {
+      tregex_jit_set_budget(jit, limits[i].steps, limits[i].cycles);
+      *cases += 2;
+      if ((got = tregex_jit_match_n(jit, str, strlen(str))) != expect)
+        bad |= check_report(re, str, "jit budget", got, expect, reports);
+      if ((got = tregex_jit_search_n(jit, str, strlen(str), &start)) != expect)
+        bad |= check_report(re, str, "jit budget search", got, expect, reports);
+    }
+  }
+  tregex_jit_destroy(jit);
+  free(compiled);
+  return bad;
+}
+
+int main(int argc, char **argv) {
+  uint32_t seed = CHECK_SEED;
+  long patterns = CHECK_PATTERNS, cases = 0;
+  int bad = 0, reports = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      patterns = atol(argv[++i]);
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      seed = (uint32_t)strtoul(argv[++i], NULL, 10) | 1;
+    else {
+      fprintf(stderr, "usage: %s [-n PATTERNS] [-s SEED]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  tregex_matcher *matcher = tregex_matcher_create();
+  char *long_str = malloc(CHECK_LONG_LEN + 1);
+  if (!matcher || !long_str) return 1;
+  tregex_matcher_set_budget(matcher, CHECK_CASE_STEPS, 0);
+  for (size_t i = 0; i < sizeof(check_cases) / sizeof(*check_cases); i++) {
+    tregex_byte_code_list *compiled = tregex_compile(check_cases[i].re);
+    if (!compiled)
+      continue;
+    check_program engines;
+    check_program_init(&engines, check_cases[i].re, compiled);
+    if (engines.jit)
+      tregex_jit_set_budget(engines.jit, CHECK_CASE_STEPS, 0);
+    cases++;
+    bad |= check_subject(&engines, matcher, check_cases[i].str, check_cases[i].expect, &reports);
+    check_program_destroy(&engines);
+  }
+  tregex_matcher_set_budget(matcher, 0, 0);
+  bad |= check_limits(matcher, &cases, &reports);
+  for (long p = 0; p < patterns; p++) {
+    char re[256], str[CHECK_SUBJECT_LEN + 1];
+    check_gen(re, 0, sizeof(re), &seed, 0);
+    tregex_byte_code_list *compiled = tregex_compile(re);
+    if (!compiled)
+      continue;
+    check_program engines;
+    check_program_init(&engines, re, compiled);
+
+    for (int i = 0; check_subject_at(str, i); i++) {
+      cases++;
+      bad |= check_subject(&engines, matcher, str, CHECK_ANY, &reports);
+      bad |= check_groups(&engines, matcher, str, &reports);
+      bad |= check_iter(&engines, matcher, str, &reports);
+    }
+    bad |= check_batch(&engines, matcher, 1 + (int)(p % 6), &reports);
+    if (p % CHECK_LONG_EVERY == 0)
+      bad |= check_long(&engines, matcher, long_str, &seed, &cases, &reports);
+    check_program_destroy(&engines);
+  }
+  for (int i = 0; i < CHECK_SETS; i++)
+    bad |= check_set(matcher, &seed, &cases, &reports);
+  tregex_matcher_destroy(matcher);
+  free(long_str);
+  printf("%ld cases, %d disagreements\n", cases, reports);
+  return bad;
+}
@@ -0,0 +1,83 @@
+#include "tregex.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Compiles one pattern per line of stdin into a library file. */
+static int gen_library(const char *prog, const char *path) {
+  tregex_byte_code_list **programs = NULL;
+  char **res = NULL, line[65536];
+  int count = 0, cap = 0, ret = 1;
+  FILE *out = NULL;
+
+  while (fgets(line, sizeof(line), stdin)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (count == cap) {
+      cap = cap ? cap * 2 : 64;
+      void *p = realloc(programs, cap * sizeof(*programs)), *r = p ? realloc(res, cap * sizeof(*res)) : NULL;
+      if (p) programs = p;
+      if (r) res = r;
+      if (!p || !r) goto nomem;
+    }
+    size_t len = strlen(line) + 1;
+    if (!(res[count] = malloc(len)) || !(programs[count] = tregex_compile(memcpy(res[count], line, len)))) {
+      free(res[count]);
+      goto nomem;
+    }
+    if (FETCH_OPCODE(programs[count]->code) == HALT)
+      fprintf(stderr, "%s: line %d: invalid regex\n", prog, count + 1);
+    count++;
+  }
+  if (!(out = fopen(path, "wb")) || tregex_library_write(out, programs, (const char *const *)res, count))
+    fprintf(stderr, "%s: cannot write %s\n", prog, path);
+  else
+    ret = 0;
+  goto done;
+nomem:
+  fprintf(stderr, "%s: out of memory\n", prog);
+done:
+  if (out && fclose(out))
+    ret = 1;
+  while (count--) {
+    free(programs[count]);
+    free(res[count]);
+  }
+  free(programs);
+  free(res);
+  return ret;
+}
+
+/* Usage: tregex-gen NAME REGEX > name.c, or tregex-gen -l LIBRARY < patterns.txt */
+int main(int argc, char **argv) {
+  if (argc == 3 && !strcmp(argv[1], "-l"))
+    return gen_library(argv[0], argv[2]);
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s NAME REGEX\n       %s -l LIBRARY < PATTERNS\n", argv[0], argv[0]);
+    return 2;
+  }
+  tregex_byte_code_list *compiled = tregex_compile(argv[2]);
+  if (!compiled) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+  if (FETCH_OPCODE(compiled->code) == HALT) {
+    fprintf(stderr, "%s: invalid regex\n", argv[0]);
+    free(compiled);
+    return 1;
+  }
+
+  printf("/* generated by tregex-gen from: ");
+  for (const char *p = argv[2]; *p; p++) {
+    if ((*p == '/' && p > argv[2] && p[-1] == '*') || (*p == '?' && p > argv[2] && p[-1] == '?'))
+      printf("\\%c", *p);
+    else if (isprint((unsigned char)*p))
+      putchar(*p);
+    else
+      printf("\\x%02x", (unsigned char)*p);
+  }
+  printf(" */\n#include <stddef.h>\n\n");
+  int ret = tregex_codegen(compiled, argv[1], stdout);
+  if (ret)
+    fprintf(stderr, "%s: the DFA does not fit in DFA_CACHE_SIZE\n", argv[0]);
+  free(compiled);
+  return ret ? 1 : 0;
+}
@@ -1,144 +1,345 @@
+/* The JIT's MAP_ANONYMOUS is hidden from glibc's sys/mman.h under -std=c99. */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
 #include "tregex.h"
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 
+#if defined(__GNUC__) && defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)) && !defined(TREGEX_NO_JIT)
+#define TREGEX_JIT
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TREGEX_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 enum {
   EXPR,
   TERM,
   FACTOR,
 };
 
+static const int op_len[OP_NUM] = {
+#undef OP_DEFINE_IMPL
+#define OP_DEFINE_IMPL(op) OP_##op##_LEN,
+  ALL_OP_DEFINE
+};
+
+/* LOOP, LOOP_SET and LOOP_CLASS end with the fewest and most bytes they take, -1 for no limit. */
+#define LOOP_MIN(inst)            ((inst)[op_len[FETCH_OPCODE(inst)] - 2])
+#define LOOP_MAX(inst)            ((inst)[op_len[FETCH_OPCODE(inst)] - 1])
+
+/* Whether the consuming instruction at `inst` accepts byte `c`. */
+static int tregex_inst_match(const tregex_byte_code *inst, int c) {
+  switch (FETCH_OPCODE(inst)) {
+  case LOOP:
+  case MATCH:
+    return (char)c == (char)FETCH_OPARG_A(inst);
+  case LOOP_SET:
+  case MATCH_SET:
+    return (char)c >= (char)FETCH_OPARG_A(inst) && (char)c <= (char)FETCH_OPARG_B(inst);
+  case LOOP_CLASS:
+  case MATCH_CLASS:
+    return CLASS_HAS(FETCH_CLASS(inst), c);
+  case ANY:
+    return 1;
+  }
+  return 0;
+}
+
+static int tregex_span_char_scalar(const char *str, int idx, int len, char c) {
+  while (idx < len && str[idx] == c)
+    idx++;
+  return idx;
+}
+
+static int tregex_span_range_scalar(const char *str, int idx, int len, char left, char right) {
+  while (idx < len && str[idx] >= left && str[idx] <= right)
+    idx++;
+  return idx;
+}
+
+static int tregex_span_class_scalar(const char *str, int idx, int len, const uint8_t *cls) {
+  while (idx < len && CLASS_HAS(cls, (unsigned char)str[idx]))
+    idx++;
+  return idx;
+}
+
+/* Offset of the first `needle[0, n)` in str[idx, len), or -1. */
+static int tregex_find_str_scalar(const char *str, int idx, int len, const char *needle, int n) {
+  const char *p = str + idx, *end = str + len;
+  for (; end - p >= n && (p = memchr(p, needle[0], end - p - n + 1)); p++)
+    if (!memcmp(p, needle, n))
+      return (int)(p - str);
+  return -1;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define TREGEX_SIMD
+
+static int tregex_span_char_sse2(const char *str, int idx, int len, char c) {
+  __m128i v = _mm_set1_epi8(c);
+  for (; idx + 16 <= len; idx += 16) {
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(str + idx)), v)) ^ 0xffffu;
+    if (mask) return idx + ctzll(mask);
+  }
+  return tregex_span_char_scalar(str, idx, len, c);
+}
+
+static int tregex_span_range_sse2(const char *str, int idx, int len, char left, char right) {
+  __m128i lo = _mm_set1_epi8(left), hi = _mm_set1_epi8(right);
+  for (; idx + 16 <= len; idx += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(str + idx));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(x, lo), _mm_cmpgt_epi8(x, hi)));
+    if (mask) return idx + ctzll(mask);
+  }
+  return tregex_span_range_scalar(str, idx, len, left, right);
+}
+
+/*
+ * memchr skips to the next first byte; from there the first and last needle
+ * bytes are compared at 64 offsets per round and only offsets where both agree
+ * are memcmp'd, so a common first byte costs little either.
+ */
+static int tregex_find_str_sse2(const char *str, int idx, int len, const char *needle, int n) {
+  __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[n - 1]);
+  while (idx + n - 1 + 64 <= len) {
+    const char *p = memchr(str + idx, needle[0], len - n + 1 - idx);
+    if (!p) return -1;
+    if ((idx = (int)(p - str)) + n - 1 + 64 > len) break;
+    uint64_t mask = 0;
+    for (int k = 0; k < 64; k += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(str + idx + k));
+      __m128i b = _mm_loadu_si128((const __m128i *)(str + idx + k + n - 1));
+      mask |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last))) << k;
+    }
+    for (; mask; mask &= mask - 1)
+      if (!memcmp(str + idx + ctzll(mask), needle, n))
+        return idx + ctzll(mask);
+    idx += 64;
+  }
+  return tregex_find_str_scalar(str, idx, len, needle, n);
+}
+
+__attribute__((target("ssse3")))
+static int tregex_span_class_ssse3(const char *str, int idx, int len, const uint8_t *cls) {
+  __m128i lo = _mm_loadu_si128((const __m128i *)cls), hi = _mm_loadu_si128((const __m128i *)(cls + 16));
+  __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  __m128i top = _mm_set1_epi8(-128), low3 = _mm_set1_epi8(7);
+  for (; idx + 16 <= len; idx += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(str + idx));
+    __m128i row = _mm_or_si128(_mm_shuffle_epi8(lo, x), _mm_shuffle_epi8(hi, _mm_xor_si128(x, top)));
+    __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(x, 4), low3));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, bit), bit)) ^ 0xffffu;
+    if (mask) return idx + ctzll(mask);
+  }
+  return tregex_span_class_scalar(str, idx, len, cls);
+}
+
+__attribute__((target("avx2")))
+static int tregex_span_char_avx2(const char *str, int idx, int len, char c) {
+  __m256i v = _mm256_set1_epi8(c);
+  for (; idx + 32 <= len; idx += 32) {
+    unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(str + idx)), v));
+    if (mask) return idx + ctzll(mask);
+  }
+  return tregex_span_char_sse2(str, idx, len, c);
+}
+
+__attribute__((target("avx2")))
+static int tregex_span_range_avx2(const char *str, int idx, int len, char left, char right) {
+  __m256i lo = _mm256_set1_epi8(left), hi = _mm256_set1_epi8(right);
+  for (; idx + 32 <= len; idx += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(str + idx));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(lo, x), _mm256_cmpgt_epi8(x, hi)));
+    if (mask) return idx + ctzll(mask);
+  }
+  return tregex_span_range_sse2(str, idx, len, left, right);
+}
+
+__attribute__((target("avx2")))
+static int tregex_find_str_avx2(const char *str, int idx, int len, const char *needle, int n) {
+  __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[n - 1]);
+  while (idx + n - 1 + 64 <= len) {
+    const char *p = memchr(str + idx, needle[0], len - n + 1 - idx);
+    if (!p) return -1;
+    if ((idx = (int)(p - str)) + n - 1 + 64 > len) break;
+    uint64_t mask = 0;
+    for (int k = 0; k < 64; k += 32) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)(str + idx + k));
+      __m256i b = _mm256_loadu_si256((const __m256i *)(str + idx + k + n - 1));
+      mask |= (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last))) << k;
+    }
+    for (; mask; mask &= mask - 1)
+      if (!memcmp(str + idx + ctzll(mask), needle, n))
+        return idx + ctzll(mask);
+    idx += 64;
+  }
+  return tregex_find_str_scalar(str, idx, len, needle, n);
+}
+
+__attribute__((target("avx2")))
+static int tregex_span_class_avx2(const char *str, int idx, int len, const uint8_t *cls) {
+  __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cls));
+  __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(cls + 16)));
+  __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+    1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  __m256i top = _mm256_set1_epi8(-128), low3 = _mm256_set1_epi8(7);
+  for (; idx + 32 <= len; idx += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(str + idx));
+    __m256i row = _mm256_or_si256(_mm256_shuffle_epi8(lo, x), _mm256_shuffle_epi8(hi, _mm256_xor_si256(x, top)));
+    __m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(x, 4), low3));
+    unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit));
+    if (mask) return idx + ctzll(mask);
+  }
+  return tregex_span_class_ssse3(str, idx, len, cls);
+}
+#endif
+
+static struct {
+  int (*span_char)(const char *str, int idx, int len, char c);
+  int (*span_range)(const char *str, int idx, int len, char left, char right);
+  int (*span_class)(const char *str, int idx, int len, const uint8_t *cls);
+  int (*find_str)(const char *str, int idx, int len, const char *needle, int n);
+} tregex_span = { tregex_span_char_scalar, tregex_span_range_scalar, tregex_span_class_scalar, tregex_find_str_scalar };
+
+#ifdef TREGEX_SIMD
+/* Runs before main so matchers on different threads never race on the table. */
+__attribute__((constructor))
+static void tregex_span_init(void) {
+  __builtin_cpu_init();
+  tregex_span.span_char = tregex_span_char_sse2;
+  tregex_span.span_range = tregex_span_range_sse2;
+  tregex_span.find_str = tregex_find_str_sse2;
+  if (__builtin_cpu_supports("ssse3"))
+    tregex_span.span_class = tregex_span_class_ssse3;
+  if (__builtin_cpu_supports("avx2")) {
+    tregex_span.span_char = tregex_span_char_avx2;
+    tregex_span.span_range = tregex_span_range_avx2;
+    tregex_span.span_class = tregex_span_class_avx2;
+    tregex_span.find_str = tregex_find_str_avx2;
+  }
+}
+#endif
+
+/*
+ * The backtracker keeps its state in flat slots and an undo log, so nothing
+ * uses the pool any more. These stay for source compatibility: create returns
+ * a handle to pass around, and alloc always fails.
+ */
 tregex_pool_ctx *tregex_pool_create() {
-  tregex_pool_ctx *pool = malloc(sizeof(tregex_pool_ctx));
-  if (!pool) exit(-1);
-  pool->raw = calloc(sizeof(pool->bitmap) * 8, POOL_BLOCK_SIZE);
-  if (!pool->raw) exit(-1);
-  memset(&pool->bitmap, -1, sizeof(pool->bitmap));
-  return pool;
+  return calloc(1, sizeof(tregex_pool_ctx));
 }
 
 void tregex_pool_clean(tregex_pool_ctx *pool) {
-  memset(&pool->bitmap, -1, sizeof(pool->bitmap));
+  (void)pool;
 }
 
 void tregex_pool_destroy(tregex_pool_ctx *pool) {
-  free(pool->raw);
   free(pool);
 }
 
 void *tregex_pool_alloc(tregex_pool_ctx *pool) {
-  for (int i = 0; i < (int)(sizeof(pool->bitmap) / sizeof(pool->bitmap[0])); i++) {
-    if (pool->bitmap[i]) {
-      int offset = ctzll(pool->bitmap[i]);
-      pool->bitmap[i] &= ~(1ull << offset);
-      return (void *)((char *)pool->raw + (intptr_t)(offset + i * (sizeof(pool->bitmap[0]) * 8)) * POOL_BLOCK_SIZE);
-    }
-  }
-  exit(2);
+  (void)pool;
+  return NULL;
 }
 
 void tregex_pool_free(tregex_pool_ctx *pool, void *p) {
-  char *tmp = p, *start = pool->raw;
-  ptrdiff_t offset = (tmp - start) / POOL_BLOCK_SIZE;
-  pool->bitmap[offset / (sizeof(pool->bitmap[0]) * 8)] |= 1ull << (offset % (sizeof(pool->bitmap[0]) * 8));
-}
-
-static tregex_internal_stack_node *tregex_internal_stack_node_alloc(tregex_pool_ctx *mem) {
-  void *p = tregex_pool_alloc(mem);
-  return p;
-}
-
-static tregex_internal_stack *tregex_internal_stack_alloc(tregex_pool_ctx *mem) {
-  void *p = tregex_pool_alloc(mem);
-  return p;
-}
-
-static tregex_internal_stack *tregex_internal_stack_create(tregex_pool_ctx *mem) {
-  tregex_internal_stack *stack = tregex_internal_stack_alloc(mem);
-  stack->root = tregex_internal_stack_node_alloc(mem);
-  stack->root->parent = NULL;
-  stack->root->right = NULL;
-  stack->root->left = NULL;
-  stack->root->count = 1;
-  stack->root->idx = -1;
-  stack->top = stack->root;
-  return stack;
-}
-
-static tregex_internal_stack_node *tregex_internal_stack_push(tregex_pool_ctx *mem, tregex_internal_stack *stack, int idx) {
-  tregex_internal_stack_node *top = stack->top;
-  tregex_internal_stack_node *new_node = tregex_internal_stack_node_alloc(mem);
-  new_node->idx = idx;
-  new_node->count = 1;
-  new_node->parent = top;
-  new_node->left = NULL;
-  new_node->right = NULL;
-  if (!top->left)
-    top->left = new_node;
-  else {
-    tregex_internal_stack_node *child = top->left;
-    for (; child->right; child = child->right);
-    child->right = new_node;
-  }
-  stack->top = new_node;
-  return new_node;
+  (void)pool;
+  (void)p;
 }
 
-static int tregex_internal_stack_pop(tregex_pool_ctx *mem, tregex_internal_stack *stack) {
-  tregex_internal_stack_node *top = stack->top, *parent = top->parent;
-  int idx = top->idx;
-  if (top == stack->root)
-    return -1;
-  if (top->count == 1) {
-    tregex_internal_stack_node *p = parent->left, *q = p->right;
-    if (p == top)
-      parent->left = top->right;
-    else
-      for (; q; p = q, q = q->right)
-        if (q == top) {
-          p->right = top->right;
-          break;
-        }
-    tregex_pool_free(mem, top);
-    stack->top = parent;
-    return idx;
-  }
-  top->count--;
-  parent->count++;
-  stack->top = parent;
-  return idx;
+static int tregex_loop_op(int op) {
+  return op == MATCH ? LOOP : op == MATCH_SET ? LOOP_SET : LOOP_CLASS;
 }
 
-static int tregex_internal_stack_top(tregex_internal_stack *stack) {
-  return stack->top->idx;
+static int tregex_is_loop(int op) {
+  return op == LOOP || op == LOOP_SET || op == LOOP_CLASS;
 }
 
-static tregex_internal_stack *tregex_internal_stack_copy(tregex_pool_ctx *mem, tregex_internal_stack *stack) {
-  tregex_internal_stack *new_stack = tregex_internal_stack_alloc(mem);
-  new_stack->root = stack->root;
-  new_stack->top = stack->top;
-  new_stack->top->count++;
-  return new_stack;
+/* Turns the MATCH, MATCH_SET or MATCH_CLASS at `inst` into its LOOP form, which is two units longer. */
+static int tregex_make_loop(tregex_byte_code *inst, int min, int max) {
+  SET_OPCODE(inst, tregex_loop_op(FETCH_OPCODE(inst)));
+  LOOP_MIN(inst) = min;
+  LOOP_MAX(inst) = max;
+  return op_len[FETCH_OPCODE(inst)];
 }
 
-static void tregex_internal_stack_destroy(tregex_pool_ctx *mem, tregex_internal_stack *stack) {
-  while (stack->top != stack->root)
-    tregex_internal_stack_pop(mem, stack);
-  if (stack->root->count == 1)
-    tregex_pool_free(mem, stack->root);
-  else
-    stack->root->count--;
-  tregex_pool_free(mem, stack);
+/* Reads a `{n}`, `{n,}` or `{n,m}` at ctx->idx and returns its length, 0 if there is none. */
+static size_t tregex_parse_braces(const tregex_parse_ctx *ctx, int *min, int *max) {
+  size_t i = ctx->idx + 1;
+  int n = 0, m;
+  if (i >= ctx->len || !isdigit((unsigned char)ctx->re[i]))
+    return 0;
+  while (i < ctx->len && isdigit((unsigned char)ctx->re[i]))
+    n = n > MAX_REPEAT ? n : n * 10 + ctx->re[i++] - '0';
+  m = n;
+  if (i < ctx->len && ctx->re[i] == ',') {
+    m = -1;
+    if (++i < ctx->len && isdigit((unsigned char)ctx->re[i]))
+      for (m = 0; i < ctx->len && isdigit((unsigned char)ctx->re[i]);)
+        m = m > MAX_REPEAT ? m : m * 10 + ctx->re[i++] - '0';
+  }
+  if (i >= ctx->len || ctx->re[i] != '}')
+    return 0;
+  if (min) *min = n;
+  if (max) *max = m;
+  return i + 1 - ctx->idx;
 }
 
-static int is_match_single_char(tregex_byte_code *begin, tregex_byte_code *end) {
-  return FETCH_OPCODE(begin) == MATCH && (end - begin == OP_MATCH_LEN);
+static int tregex_parse_class_char(tregex_parse_ctx *ctx, size_t *i) {
+  if (ctx->re[*i] == '\\' && ++*i >= ctx->len)
+    return -1;
+  return (unsigned char)ctx->re[(*i)++];
 }
 
-static int is_match_single_charset(tregex_byte_code *begin, tregex_byte_code *end) {
-  return FETCH_OPCODE(begin) == MATCH_SET && (end - begin == OP_MATCH_SET_LEN);
+static int tregex_parse_class(tregex_parse_ctx *ctx) {
+  uint8_t cls[CLASS_SIZE] = { 0 };
+  size_t i = ctx->idx + 1;
+  int negate = 0, ranges = 0, first_lo = 0, first_hi = 0;
+  if (i < ctx->len && ctx->re[i] == '^')
+    negate = 1, i++;
+  while (i < ctx->len && ctx->re[i] != ']') {
+    int lo = tregex_parse_class_char(ctx, &i), hi = lo;
+    if (lo < 0) return 0;
+    if (i + 1 < ctx->len && ctx->re[i] == '-' && ctx->re[i + 1] != ']') {
+      i++;
+      if ((hi = tregex_parse_class_char(ctx, &i)) < lo) return 0;
+    }
+    for (int c = lo; c <= hi; c++)
+      SET_CLASS(cls, c);
+    if (!ranges++)
+      first_lo = lo, first_hi = hi;
+  }
+  if (i >= ctx->len || !ranges)
+    return 0;
+  ctx->idx = i + 1;
+
+  if (!negate && ranges == 1 && first_lo == first_hi) {
+    SET_OP_A(ctx->cur, MATCH, (char)first_lo);
+    STEP_OP_A(ctx->cur);
+  }
+  else if (!negate && ranges == 1 && first_hi < 0x80) {
+    SET_OP_AB(ctx->cur, MATCH_SET, first_lo, first_hi);
+    STEP_OP_AB(ctx->cur);
+  }
+  else {
+    if (negate)
+      for (int k = 0; k < CLASS_SIZE; k++)
+        cls[k] = (uint8_t)~cls[k];
+    SET_OP_Z(ctx->cur, MATCH_CLASS);
+    memcpy((uint8_t *)&ctx->cur[1], cls, CLASS_SIZE);
+    ctx->cur += OP_MATCH_CLASS_LEN;
+  }
+  return 1;
 }
 
 static int tregex_parse(tregex_parse_ctx *ctx, int syntax_level) {
@@ -153,10 +354,10 @@ static int tregex_parse(tregex_parse_ctx *ctx, int syntax_level) {
       STEP_OP_AB(ctx->cur);
       tregex_byte_code *jmp = ctx->cur;
       STEP_OP_A(ctx->cur);
-      SET_OP_AB(split_pos, SPLIT, OP_SPLIT_LEN, (char)(ctx->cur - split_pos));
+      SET_OP_AB(split_pos, SPLIT, OP_SPLIT_LEN, (int)(ctx->cur - split_pos));
       ctx->idx++;
       if (!tregex_parse(ctx, EXPR)) return 0;
-      SET_OP_A(jmp, JMP, (char)(ctx->cur - jmp));
+      SET_OP_A(jmp, JMP, (int)(ctx->cur - jmp));
     }
   }
   case TERM: {
@@ -165,7 +366,7 @@ static int tregex_parse(tregex_parse_ctx *ctx, int syntax_level) {
     while (ctx->idx < ctx->len &&
       ctx->re[ctx->idx] != '?' && ctx->re[ctx->idx] != '*' &&
       ctx->re[ctx->idx] != '+' && ctx->re[ctx->idx] != '|' &&
-      ctx->re[ctx->idx] != ')') {
+      ctx->re[ctx->idx] != ')' && !(ctx->re[ctx->idx] == '{' && tregex_parse_braces(ctx, NULL, NULL))) {
       insert_pos = ctx->cur;
       if (!tregex_parse(ctx, FACTOR)) return 0;
     }
@@ -182,34 +383,38 @@ static int tregex_parse(tregex_parse_ctx *ctx, int syntax_level) {
       case '*':
         ctx->idx++;
         memmove(insert_pos + OP_PUSH_LEN + OP_SPLIT_LEN, insert_pos, sizeof(*insert_pos) * (ctx->cur - insert_pos));
-        STEP_OP_Z(ctx->cur);
-        STEP_OP_AB(ctx->cur);
-        SET_OP_Z(insert_pos, PUSH);
+        ctx->cur += OP_PUSH_LEN + OP_SPLIT_LEN;
+        SET_OP_A(insert_pos, PUSH, ctx->loops);
         L1 = OP_SPLIT_LEN;
-        L2 = OP_PUSH_LEN + (int)(ctx->cur - insert_pos);
+        L2 = (int)(ctx->cur - insert_pos) - OP_PUSH_LEN + OP_REPEAT_LEN;
         SET_OP_AB(insert_pos + OP_PUSH_LEN, SPLIT, L1, L2);
         L1 = OP_PUSH_LEN + (int)(insert_pos - ctx->cur);
-        SET_OP_A(ctx->cur, REPEAT, L1);
-        STEP_OP_A(ctx->cur);
+        SET_OP_AB(ctx->cur, REPEAT, L1, ctx->loops++);
+        ctx->cur += OP_REPEAT_LEN;
         goto loop;
       case '+':
         ctx->idx++;
-        if (is_match_single_char(insert_pos, ctx->cur)) {
-          SET_OPCODE(insert_pos, LOOP);
-          goto loop;
-        }
-        if (is_match_single_charset(insert_pos, ctx->cur)) {
-          SET_OPCODE(insert_pos, LOOP_SET);
-          goto loop;
-        }
         memmove(insert_pos + OP_PUSH_LEN, insert_pos, sizeof(*insert_pos) * (ctx->cur - insert_pos));
-        STEP_OP_Z(ctx->cur);
-        SET_OP_Z(insert_pos, PUSH);
+        ctx->cur += OP_PUSH_LEN;
+        SET_OP_A(insert_pos, PUSH, ctx->loops);
         L1 = OP_PUSH_LEN + (int)(insert_pos - ctx->cur);
-        SET_OP_A(ctx->cur, REPEAT, L1);
+        SET_OP_AB(ctx->cur, REPEAT, L1, ctx->loops++);
+        ctx->cur += OP_REPEAT_LEN;
+        goto loop;
+      case '{': {
+        int min, max;
+        ctx->idx += tregex_parse_braces(ctx, &min, &max);
+        if (min > MAX_REPEAT || max > MAX_REPEAT || (max >= 0 && max < min))
+          return 0;
+        memmove(insert_pos + OP_COUNT_LEN, insert_pos, sizeof(*insert_pos) * (ctx->cur - insert_pos));
+        ctx->cur += OP_COUNT_LEN;
+        SET_OP_A(ctx->cur, COUNT_NEXT, (int)(insert_pos - ctx->cur));
         STEP_OP_A(ctx->cur);
+        SET_OP_ABCD(insert_pos, COUNT, ctx->loops, (int)(ctx->cur - insert_pos), min, max);
+        ctx->loops += 2;
         goto loop;
       }
+      }
   }
   case FACTOR:
     if (ctx->idx >= ctx->len) return 1;
@@ -237,25 +442,24 @@ static int tregex_parse(tregex_parse_ctx *ctx, int syntax_level) {
       ctx->idx += 2;
       return 1;
     case '[':
-      if (ctx->idx + 4 >= ctx->len)
-        return 0;
-      if (ctx->re[ctx->idx + 2] != '-')
-        return 0;
-      if (ctx->re[ctx->idx + 4] != ']')
-        return 0;
-      SET_OP_AB(ctx->cur, MATCH_SET,
-        (tregex_byte_code)ctx->re[ctx->idx + 1],
-        (tregex_byte_code)ctx->re[ctx->idx + 3]);
-      STEP_OP_AB(ctx->cur);
-      ctx->idx += 5;
-      return 1;
-    case '(':
+      return tregex_parse_class(ctx);
+    case '(': {
+      int group = ctx->capture ? ++ctx->groups : 0;
       ctx->idx++;
+      if (group) {
+        SET_OP_A(ctx->cur, SAVE, 2 * group);
+        STEP_OP_A(ctx->cur);
+      }
       tregex_parse(ctx, EXPR);
       if (ctx->idx >= ctx->len || ctx->re[ctx->idx] != ')')
         return 0;
       ctx->idx++;
+      if (group) {
+        SET_OP_A(ctx->cur, SAVE, 2 * group + 1);
+        STEP_OP_A(ctx->cur);
+      }
       return 1;
+    }
     case '|': case ')':
       return 1;
     default:
@@ -267,60 +471,906 @@ static int tregex_parse(tregex_parse_ctx *ctx, int syntax_level) {
   return 1;
 }
 
-tregex_byte_code_list *tregex_compile(const char *re) {
-  tregex_byte_code_list *bcl = calloc(1, sizeof(tregex_byte_code_list) + sizeof(tregex_byte_code) * (MAX_BYTE_CODE_SIZE - 1));
+/* Drops the instructions flagged in `removed` and relocates every jump. */
+static size_t tregex_compact(tregex_opt_ctx *opt, tregex_byte_code *code, size_t len) {
+  int *map = opt->map, pc, n = 0;
+  for (pc = 0; pc < (int)len; pc += op_len[FETCH_OPCODE(&code[pc])]) {
+    map[pc] = n;
+    if (!opt->removed[pc])
+      n += op_len[FETCH_OPCODE(&code[pc])];
+  }
+  map[len] = n;
+  for (pc = 0; pc < (int)len; pc += op_len[FETCH_OPCODE(&code[pc])]) {
+    tregex_byte_code *p = &code[pc];
+    switch (FETCH_OPCODE(p)) {
+    case SPLIT:
+    case COUNT:
+      SET_OPARG_B(p, map[pc + FETCH_OPARG_B(p)] - map[pc]);
+      if (FETCH_OPCODE(p) == COUNT)
+        break;
+    case JMP:
+    case REPEAT:
+    case COUNT_NEXT:
+      SET_OPARG_A(p, map[pc + FETCH_OPARG_A(p)] - map[pc]);
+    }
+  }
+  for (pc = 0; pc < (int)len;) {
+    int l = op_len[FETCH_OPCODE(&code[pc])];
+    if (!opt->removed[pc])
+      memmove(&code[map[pc]], &code[pc], l * sizeof(*code));
+    pc += l;
+  }
+  memset(opt->removed, 0, len);
+  return (size_t)n;
+}
+
+/* Replaces [pc, end) by the `l` units at `inst` and pads the rest with removable filler. */
+static void tregex_rewrite_n(tregex_opt_ctx *opt, tregex_byte_code *code, int pc, int end, const tregex_byte_code *inst, int l) {
+  memcpy(&code[pc], inst, l * sizeof(*code));
+  for (pc += l; pc < end; pc++) {
+    SET_OP_Z(&code[pc], HALT);
+    opt->removed[pc] = 1;
+  }
+}
+
+static void tregex_rewrite(tregex_opt_ctx *opt, tregex_byte_code *code, int pc, int end, const tregex_byte_code *inst) {
+  tregex_rewrite_n(opt, code, pc, end, inst, op_len[FETCH_OPCODE(inst)]);
+}
+
+/*
+ * Collects into `set` (if given) every byte the program can consume first from
+ * `pc`, and reports whether `until` is reachable without consuming anything.
+ */
+static int tregex_first_set(tregex_opt_ctx *opt, const tregex_byte_code *code, size_t len, int pc, int until, uint8_t *set) {
+  int *sp = opt->stack, reached = 0;
+  memset(opt->visited, 0, len);
+  *sp++ = pc;
+  while (sp > opt->stack) {
+    pc = *--sp;
+    if (opt->visited[pc]) continue;
+    opt->visited[pc] = 1;
+    if (pc == until) {
+      reached = 1;
+      continue;
+    }
+    const tregex_byte_code *p = &code[pc];
+    switch (FETCH_OPCODE(p)) {
+    case HALT:
+    case ACCEPT:
+      break;
+    case SPLIT:
+      *sp++ = pc + FETCH_OPARG_B(p);
+    case JMP:
+      *sp++ = pc + FETCH_OPARG_A(p);
+      break;
+    case REPEAT:
+      *sp++ = pc + FETCH_OPARG_A(p);
+      *sp++ = pc + OP_REPEAT_LEN;
+      break;
+    case PUSH:
+    case BEGIN:
+    case END:
+    case SAVE:
+      *sp++ = pc + op_len[FETCH_OPCODE(p)];
+      break;
+    case COUNT_NEXT:
+      p += FETCH_OPARG_A(p);
+    case COUNT:
+      *sp++ = (int)(p - code) + FETCH_OPARG_B(p);
+      *sp++ = (int)(p - code) + OP_COUNT_LEN;
+      break;
+    default:
+      for (int c = 0; set && c < 256; c++)
+        if (tregex_inst_match(p, c))
+          set[c] = 1;
+      if (tregex_is_loop(FETCH_OPCODE(p)) && !LOOP_MIN(p))
+        *sp++ = pc + op_len[FETCH_OPCODE(p)];
+      break;
+    }
+  }
+  return reached;
+}
+
+static int tregex_is_single(const tregex_byte_code *inst) {
+  int op = FETCH_OPCODE(inst);
+  return op == MATCH || op == MATCH_SET || op == MATCH_CLASS || op == ANY;
+}
+
+/* Builds the cheapest instruction consuming exactly the bytes in `member`. */
+static void tregex_make_class(tregex_byte_code *inst, const uint8_t *member) {
+  int lo = 0, hi = 255, n = 0;
+  while (!member[lo] && lo < 255) lo++;
+  while (!member[hi] && hi > 0) hi--;
+  for (int c = 0; c < 256; c++)
+    n += member[c];
+  if (n == 256)
+    SET_OP_Z(inst, ANY);
+  else if (n == 1)
+    SET_OP_A(inst, MATCH, (char)lo);
+  else if (n == hi - lo + 1 && hi < 0x80)
+    SET_OP_AB(inst, MATCH_SET, lo, hi);
+  else {
+    uint8_t cls[CLASS_SIZE] = { 0 };
+    for (int c = 0; c < 256; c++)
+      if (member[c])
+        SET_CLASS(cls, c);
+    SET_OP_Z(inst, MATCH_CLASS);
+    memcpy((uint8_t *)&inst[1], cls, CLASS_SIZE);
+  }
+}
+
+/*
+ * An alternation whose branches each consume exactly one byte and rejoin at
+ * the same place is equivalent to a single class, whatever the branch order.
+ */
+static size_t tregex_merge_alternations(tregex_opt_ctx *opt, tregex_byte_code *code, size_t len) {
+  int changed;
+  do {
+    changed = 0;
+    for (int pc = 0; pc < (int)len; pc += op_len[FETCH_OPCODE(&code[pc])]) {
+      uint8_t member[256] = { 0 };
+      int p = pc, end = -1, branches = 0;
+      while (FETCH_OPCODE(&code[p]) == SPLIT && FETCH_OPARG_A(&code[p]) == OP_SPLIT_LEN && tregex_is_single(&code[p + OP_SPLIT_LEN])) {
+        const tregex_byte_code *single = &code[p + OP_SPLIT_LEN], *jmp = single + op_len[FETCH_OPCODE(single)];
+        int target = (int)(jmp - code) + FETCH_OPARG_A(jmp);
+        if (FETCH_OPCODE(jmp) != JMP || (end >= 0 && target != end))
+          break;
+        end = target;
+        for (int c = 0; c < 256; c++)
+          member[c] |= (uint8_t)tregex_inst_match(single, c);
+        branches++;
+        p += FETCH_OPARG_B(&code[p]);
+      }
+      if (!branches || !tregex_is_single(&code[p]) || p + op_len[FETCH_OPCODE(&code[p])] != end)
+        continue;
+      for (int c = 0; c < 256; c++)
+        member[c] |= (uint8_t)tregex_inst_match(&code[p], c);
+
+      tregex_byte_code inst[OP_MATCH_CLASS_LEN];
+      tregex_make_class(inst, member);
+      if (op_len[FETCH_OPCODE(inst)] > end - pc)
+        continue;
+      tregex_rewrite(opt, code, pc, end, inst);
+      changed = 1;
+    }
+    if (changed)
+      len = tregex_compact(opt, code, len);
+  } while (changed);
+  return len;
+}
+
+/*
+ * Turns `x*`, `x+` and `x{n,m}` over a single byte matcher into LOOP when
+ * nothing that can follow starts with x, so no match depends on giving bytes
+ * back. An exact `x{n}` never gives bytes back and always qualifies.
+ */
+static size_t tregex_possessify(tregex_opt_ctx *opt, tregex_byte_code *code, size_t len) {
+  uint8_t set[256];
+  int changed = 0;
+  for (int pc = 0; pc < (int)len; pc += op_len[FETCH_OPCODE(&code[pc])]) {
+    tregex_byte_code *head = &code[pc], *split = head + OP_PUSH_LEN, *body = split, *tail;
+    int star = 0, count = FETCH_OPCODE(head) == COUNT, next;
+    if (count) {
+      body = head + OP_COUNT_LEN;
+    } else if (FETCH_OPCODE(head) == PUSH) {
+      star = FETCH_OPCODE(split) == SPLIT && FETCH_OPARG_A(split) == OP_SPLIT_LEN;
+      if (star)
+        body = split + OP_SPLIT_LEN;
+    } else {
+      continue;
+    }
+    int op = FETCH_OPCODE(body);
+    if (op != MATCH && op != MATCH_SET && op != MATCH_CLASS && op != ANY)
+      continue;
+    tail = body + op_len[op];
+    if (count) {
+      next = (int)(tail - code) + OP_COUNT_NEXT_LEN;
+      if (FETCH_OPCODE(tail) != COUNT_NEXT || tail + FETCH_OPARG_A(tail) != head)
+        continue;
+    } else {
+      next = (int)(tail - code) + OP_REPEAT_LEN;
+      if (FETCH_OPCODE(tail) != REPEAT || tail + FETCH_OPARG_A(tail) != split || (star && split + FETCH_OPARG_B(split) != code + next))
+        continue;
+    }
+    if (!count || FETCH_OPARG_C(head) != FETCH_OPARG_D(head)) {
+      memset(set, 0, sizeof(set));
+      tregex_first_set(opt, code, len, next, -1, set);
+      int c = 0;
+      while (c < 256 && !(set[c] && tregex_inst_match(body, c)))
+        c++;
+      if (c < 256)
+        continue;
+    }
+
+    /* A loop that may run zero times keeps that path open, as `^` may only match there. */
+    if (count && FETCH_OPARG_D(head) == 0)
+      continue;
+    if (count && FETCH_OPARG_C(head) == 0)
+      star = 1;
+    tregex_byte_code inst[OP_SPLIT_LEN + OP_LOOP_CLASS_LEN], *loop = star ? inst + OP_SPLIT_LEN : inst;
+    if (op == ANY)
+      SET_OP_AB(loop, MATCH_SET, -128, 127);
+    else
+      memcpy(loop, body, op_len[op] * sizeof(*body));
+    int l = count ? tregex_make_loop(loop, FETCH_OPARG_C(head) ? FETCH_OPARG_C(head) : 1, FETCH_OPARG_D(head)) : tregex_make_loop(loop, 1, -1);
+    if (star)
+      SET_OP_AB(inst, SPLIT, OP_SPLIT_LEN, OP_SPLIT_LEN + l);
+    tregex_rewrite_n(opt, code, pc, next, inst, (int)(loop - inst) + l);
+    changed = 1;
+  }
+  return changed ? tregex_compact(opt, code, len) : len;
+}
+
+#if OP_REPEAT_LEN != OP_SPLIT_LEN
+#error "tregex_drop_progress_checks rewrites REPEAT into SPLIT in place"
+#endif
+
+/*
+ * A loop body that always consumes input can never run an empty iteration, so
+ * its PUSH is dropped and its REPEAT becomes a plain SPLIT back into the body.
+ */
+static size_t tregex_drop_progress_checks(tregex_opt_ctx *opt, tregex_byte_code *code, size_t len) {
+  int changed = 0;
+  for (int pc = 0; pc < (int)len; pc += op_len[FETCH_OPCODE(&code[pc])]) {
+    tregex_byte_code *repeat = &code[pc];
+    if (FETCH_OPCODE(repeat) != REPEAT)
+      continue;
+    int body = pc + FETCH_OPARG_A(repeat);
+    if (tregex_first_set(opt, code, len, body, pc, NULL))
+      continue;
+    opt->removed[body - OP_PUSH_LEN] = 1;
+    SET_OP_AB(repeat, SPLIT, FETCH_OPARG_A(repeat), OP_SPLIT_LEN);
+    changed = 1;
+  }
+  return changed ? tregex_compact(opt, code, len) : len;
+}
+
+static int tregex_thread_target(const tregex_byte_code *code, size_t len, int target) {
+  for (size_t steps = 0; FETCH_OPCODE(&code[target]) == JMP && steps < len; steps++)
+    target += FETCH_OPARG_A(&code[target]);
+  return target;
+}
+
+/* Points SPLIT/JMP at the end of any JMP chain, then drops jumps to the next instruction. */
+static size_t tregex_thread_jumps(tregex_opt_ctx *opt, tregex_byte_code *code, size_t len) {
+  int changed = 0;
+  for (int pc = 0; pc < (int)len; pc += op_len[FETCH_OPCODE(&code[pc])]) {
+    tregex_byte_code *p = &code[pc];
+    switch (FETCH_OPCODE(p)) {
+    case SPLIT:
+      SET_OPARG_B(p, tregex_thread_target(code, len, pc + FETCH_OPARG_B(p)) - pc);
+      SET_OPARG_A(p, tregex_thread_target(code, len, pc + FETCH_OPARG_A(p)) - pc);
+      if (FETCH_OPARG_A(p) == FETCH_OPARG_B(p)) {
+        tregex_byte_code jmp[OP_JMP_LEN];
+        SET_OP_A(jmp, JMP, FETCH_OPARG_A(p));
+        tregex_rewrite(opt, code, pc, pc + OP_SPLIT_LEN, jmp);
+        changed = 1;
+      }
+      break;
+    case JMP:
+      SET_OPARG_A(p, tregex_thread_target(code, len, pc + FETCH_OPARG_A(p)) - pc);
+      break;
+    }
+    if (FETCH_OPCODE(p) == JMP && FETCH_OPARG_A(p) == OP_JMP_LEN)
+      opt->removed[pc] = changed = 1;
+  }
+  return changed ? tregex_compact(opt, code, len) : len;
+}
+
+static tregex_byte_code_list *tregex_alloc_program(size_t len, size_t literals) {
+  tregex_byte_code_list *bcl = calloc(1, TREGEX_PROGRAM_SIZE(len, literals));
+  if (!bcl) return NULL;
+  bcl->len = len;
+  bcl->literals = literals;
+  return bcl;
+}
+
+/* Memo keys a SPLIT/REPEAT in the body of the COUNT at `head` takes, one per counter value it can tell apart. */
+static int tregex_count_keys(const tregex_byte_code *head) {
+  int keys = FETCH_OPARG_D(head) >= 0 ? FETCH_OPARG_D(head) : FETCH_OPARG_C(head) + 1;
+  return keys > 0 ? keys : 1;
+}
+
+/*
+ * Numbers the SPLIT/REPEAT pcs for the visited bitmap and records the
+ * innermost loop around each: an inner loop ends before any loop around it,
+ * so the first loop to claim a pc wins. Inside counted loops the outcome also
+ * depends on the counters, so such a pc takes a key per combination of their
+ * values, up to MAX_MEMO_COUNT, and memo[pc + 2] names the innermost COUNT;
+ * at a COUNT, memo[pc] names the COUNT around it.
+ */
+static void tregex_build_memo(tregex_byte_code_list *bcl) {
+  tregex_byte_code *memo = TREGEX_MEMO(bcl);
+  int len = (int)bcl->len, pc;
+  bcl->memo_keys = 0;
+  for (pc = 0; pc < len; pc++)
+    memo[pc] = -1;
+  for (int c = 0; c < len; c += op_len[FETCH_OPCODE(&bcl->code[c])]) {
+    const tregex_byte_code *p = &bcl->code[c];
+    if (FETCH_OPCODE(p) != COUNT)
+      continue;
+    for (pc = c + OP_COUNT_LEN; pc < c + FETCH_OPARG_B(p); pc += op_len[FETCH_OPCODE(&bcl->code[pc])]) {
+      if (FETCH_OPCODE(&bcl->code[pc]) == COUNT)
+        memo[pc] = c;
+      else if (FETCH_OPCODE(&bcl->code[pc]) == SPLIT || FETCH_OPCODE(&bcl->code[pc]) == REPEAT)
+        memo[pc + 2] = c;
+    }
+  }
+  for (pc = 0; pc < len; pc += op_len[FETCH_OPCODE(&bcl->code[pc])]) {
+    if (FETCH_OPCODE(&bcl->code[pc]) != SPLIT && FETCH_OPCODE(&bcl->code[pc]) != REPEAT)
+      continue;
+    int keys = 1;
+    for (int c = memo[pc + 2]; c >= 0 && keys <= MAX_MEMO_COUNT; c = memo[c])
+      keys *= tregex_count_keys(&bcl->code[c]);
+    if (keys > MAX_MEMO_COUNT) {
+      memo[pc + 2] = -1;
+      continue;
+    }
+    memo[pc] = bcl->memo_keys;
+    bcl->memo_keys += keys;
+  }
+  for (int r = 0; r < len; r += op_len[FETCH_OPCODE(&bcl->code[r])]) {
+    const tregex_byte_code *p = &bcl->code[r];
+    int head, slot;
+    if (FETCH_OPCODE(p) == REPEAT)
+      head = r + FETCH_OPARG_A(p), slot = FETCH_OPARG_B(p);
+    else if (FETCH_OPCODE(p) == COUNT_NEXT)
+      head = r + FETCH_OPARG_A(p), slot = FETCH_OPARG_A(&bcl->code[head]) + 1;
+    else
+      continue;
+    for (pc = head; pc <= r; pc += op_len[FETCH_OPCODE(&bcl->code[pc])])
+      if ((FETCH_OPCODE(&bcl->code[pc]) == SPLIT || FETCH_OPCODE(&bcl->code[pc]) == REPEAT) && memo[pc] >= 0 && memo[pc + 1] < 0)
+        memo[pc + 1] = slot;
+  }
+}
+
+/*
+ * Copies the optimized program into its final allocation, putting a MATCH_STR
+ * in front of every run of at least MIN_MATCH_STR_SIZE MATCHes. The backtracker
+ * compares the run with one memcmp against the literal pool stored after the
+ * code and skips the MATCHes; the other engines step through them one by one.
+ */
+static int tregex_match_run(const tregex_byte_code *code, int pc) {
+  int end = pc;
+  while (FETCH_OPCODE(&code[end]) == MATCH)
+    end += OP_MATCH_LEN;
+  return (end - pc) / OP_MATCH_LEN;
+}
+
+static tregex_byte_code_list *tregex_emit(tregex_opt_ctx *opt, const tregex_byte_code *code, size_t len, int loops) {
+  int *map = opt->map, n = 0, run = 0, pc;
+  size_t literals = 0;
+  for (pc = 0; pc < (int)len; pc += op_len[FETCH_OPCODE(&code[pc])]) {
+    map[pc] = n;
+    if (FETCH_OPCODE(&code[pc]) != MATCH)
+      run = 0;
+    else if (!run++ && tregex_match_run(code, pc) >= MIN_MATCH_STR_SIZE) {
+      n += OP_MATCH_STR_LEN;
+      literals += tregex_match_run(code, pc);
+    }
+    n += op_len[FETCH_OPCODE(&code[pc])];
+  }
+  map[len] = n;
+
+  tregex_byte_code_list *bcl = tregex_alloc_program((size_t)n, literals);
   if (!bcl) return NULL;
+  bcl->loops = loops;
+  char *lit = TREGEX_LITERALS(bcl);
+  run = 0;
+  literals = 0;
+  for (pc = 0; pc < (int)len; pc += op_len[FETCH_OPCODE(&code[pc])]) {
+    const tregex_byte_code *p = &code[pc];
+    tregex_byte_code *q = &bcl->code[map[pc]];
+    if (FETCH_OPCODE(p) != MATCH)
+      run = 0;
+    else if (!run++ && tregex_match_run(code, pc) >= MIN_MATCH_STR_SIZE) {
+      int count = tregex_match_run(code, pc);
+      SET_OP_AB(q, MATCH_STR, count, (int)literals);
+      for (int i = 0; i < count; i++)
+        lit[literals++] = (char)FETCH_OPARG_A(&p[i * OP_MATCH_LEN]);
+      q += OP_MATCH_STR_LEN;
+    }
+    memcpy(q, p, op_len[FETCH_OPCODE(p)] * sizeof(*q));
+    switch (FETCH_OPCODE(p)) {
+    case SPLIT:
+    case COUNT:
+      SET_OPARG_B(q, map[pc + FETCH_OPARG_B(p)] - (int)(q - bcl->code));
+      if (FETCH_OPCODE(p) == COUNT)
+        break;
+    case JMP:
+    case REPEAT:
+    case COUNT_NEXT:
+      SET_OPARG_A(q, map[pc + FETCH_OPARG_A(p)] - (int)(q - bcl->code));
+    }
+  }
+  return bcl;
+}
+
+/* Where control can go after `pc`; ACCEPT leads to the virtual exit at `len`. */
+static int tregex_successors(const tregex_byte_code *code, int len, int pc, int *succ) {
+  const tregex_byte_code *p = &code[pc];
+  switch (FETCH_OPCODE(p)) {
+  case HALT:
+    return 0;
+  case ACCEPT:
+    succ[0] = len;
+    return 1;
+  case SPLIT:
+    succ[0] = pc + FETCH_OPARG_A(p);
+    succ[1] = pc + FETCH_OPARG_B(p);
+    return 2;
+  case JMP:
+  case COUNT_NEXT:
+    succ[0] = pc + FETCH_OPARG_A(p);
+    return 1;
+  case REPEAT:
+    succ[0] = pc + FETCH_OPARG_A(p);
+    succ[1] = pc + OP_REPEAT_LEN;
+    return 2;
+  case COUNT:
+    succ[0] = pc + FETCH_OPARG_B(p);
+    succ[1] = pc + OP_COUNT_LEN;
+    return 2;
+  }
+  succ[0] = pc + op_len[FETCH_OPCODE(p)];
+  return 1;
+}
+
+/* Whether every match that runs through `pc` goes on to END without consuming. */
+static int tregex_reaches_end(const tregex_byte_code *code, int len, int pc) {
+  for (int steps = 0; pc < len && steps < len; steps++) {
+    switch (FETCH_OPCODE(&code[pc])) {
+    case END:
+      return 1;
+    case JMP:
+      pc += FETCH_OPARG_A(&code[pc]);
+      break;
+    case SAVE:
+      pc += OP_SAVE_LEN;
+      break;
+    default:
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Pulls out literals every match must contain. A MATCH that dominates the
+ * exit is on every accepting path, and two such MATCHes side by side match
+ * adjacent bytes since a MATCH only falls through. Dominators come from the
+ * iterative Cooper-Harvey-Kennedy scheme over a postorder of the program.
+ * The longest run other than the prefix becomes `required`; the longest one
+ * followed only by END becomes `suffix`, checked against the subject's tail.
+ */
+static void tregex_find_required(tregex_byte_code_list *bcl) {
+  const tregex_byte_code *code = bcl->code;
+  int len = (int)bcl->len, n = 0, succ[2], pc, k, changed = 1;
+  int *buf = malloc((size_t)(len + 2) * 10 * sizeof(int));
+  if (!buf) return;
+  int *po = buf, *order = po + len + 1, *idom = order + len + 1, *start = idom + len + 1;
+  int *preds = start + len + 2, *stack = preds + 2 * (len + 1), *sp = stack;
+
+  for (pc = 0; pc <= len; pc++)
+    po[pc] = idom[pc] = -1, start[pc] = 0;
+  start[len + 1] = 0;
+  *sp++ = 0;
+  while (sp > stack) {
+    pc = *--sp;
+    if (pc < 0) {
+      order[n] = ~pc;
+      po[~pc] = n++;
+      continue;
+    }
+    if (po[pc] != -1) continue;
+    po[pc] = -2;
+    *sp++ = ~pc;
+    if (pc < len)
+      for (int i = tregex_successors(code, len, pc, succ); i--; )
+        if (po[succ[i]] == -1)
+          *sp++ = succ[i];
+  }
+  if (po[len] < 0) {
+    free(buf);
+    return;
+  }
+
+  int *fill = stack;
+  for (k = 0; k < n; k++)
+    if (order[k] < len)
+      for (int i = tregex_successors(code, len, order[k], succ); i--; )
+        start[succ[i] + 1]++;
+  for (pc = 0; pc <= len; pc++)
+    fill[pc] = start[pc + 1] += start[pc];
+  for (k = 0; k < n; k++)
+    if (order[k] < len)
+      for (int i = tregex_successors(code, len, order[k], succ); i--; )
+        preds[--fill[succ[i]]] = order[k];
+
+  idom[0] = 0;
+  while (changed) {
+    changed = 0;
+    for (k = n - 1; k >= 0; k--) {
+      int b = order[k], dom = -1;
+      if (!b) continue;
+      for (int i = start[b]; i < start[b + 1]; i++) {
+        int a = preds[i];
+        if (idom[a] < 0) continue;
+        if (dom < 0) {
+          dom = a;
+          continue;
+        }
+        while (a != dom) {
+          while (po[a] < po[dom]) a = idom[a];
+          while (po[dom] < po[a]) dom = idom[dom];
+        }
+      }
+      if (idom[b] != dom)
+        idom[b] = dom, changed = 1;
+    }
+  }
 
+  char *on_path = (char *)stack;
+  memset(on_path, 0, len + 1);
+  for (pc = len; ; pc = idom[pc]) {
+    on_path[pc] = 1;
+    if (!pc) break;
+  }
+  int first = FETCH_OPCODE(code) == MATCH_STR ? OP_MATCH_STR_LEN : 0;
+  int best = 0, best_end = 0, run = 0, run_start = 0;
+  for (pc = 0; pc <= len; pc += pc < len ? op_len[FETCH_OPCODE(&code[pc])] : 1) {
+    if (pc < len && FETCH_OPCODE(&code[pc]) == MATCH && on_path[pc]) {
+      if (!run++) run_start = pc;
+      continue;
+    }
+    if (run && !(bcl->prefix_len && run_start == first) && run > best) {
+      best = run;
+      for (k = 0; k < run && k < MAX_REQUIRED_SIZE; k++)
+        bcl->required[k] = (char)FETCH_OPARG_A(&code[run_start + k * OP_MATCH_LEN]);
+      bcl->required_len = k;
+    }
+    if (run > best_end && tregex_reaches_end(code, len, pc)) {
+      best_end = run;
+      int skip = run > MAX_REQUIRED_SIZE ? run - MAX_REQUIRED_SIZE : 0;
+      for (k = skip; k < run; k++)
+        bcl->suffix[k - skip] = (char)FETCH_OPARG_A(&code[run_start + k * OP_MATCH_LEN]);
+      bcl->suffix_len = run - skip;
+    }
+    run = 0;
+  }
+  if (bcl->required_len && bcl->suffix_len &&
+      tregex_find_str_scalar(bcl->suffix, 0, bcl->suffix_len, bcl->required, bcl->required_len) >= 0)
+    bcl->required_len = 0;
+  free(buf);
+}
+
+/*
+ * The parser writes at most one `*` loop (PUSH + SPLIT + REPEAT) per pattern
+ * byte, which bounds the scratch program; everything else is smaller per byte.
+ */
+#define TREGEX_PARSE_BOUND(n)     ((n) * (OP_PUSH_LEN + OP_SPLIT_LEN + OP_REPEAT_LEN) + OP_ACCEPT_LEN)
+
+static tregex_byte_code_list *tregex_compile_impl(const char *re, int capture) {
   tregex_parse_ctx parse_ctx = { 0 };
+  tregex_opt_ctx opt = { 0 };
+  tregex_byte_code_list *bcl = NULL;
+  size_t cap = TREGEX_PARSE_BOUND(strlen(re)), len;
+
+  tregex_byte_code *code = malloc(cap * sizeof(*code));
+  opt.removed = calloc(2 * cap, 1);
+  opt.visited = opt.removed + cap;
+  opt.stack = malloc(2 * cap * sizeof(int));
+  opt.map = malloc((cap + 1) * sizeof(int));
+  if (!code || !opt.removed || !opt.stack || !opt.map)
+    goto done;
+
   parse_ctx.re = re;
   parse_ctx.len = strlen(re);
-  parse_ctx.code = bcl->code;
-  parse_ctx.cur = bcl->code;
+  parse_ctx.code = code;
+  parse_ctx.cur = code;
+  parse_ctx.capture = capture;
 
   if (tregex_parse(&parse_ctx, EXPR) && parse_ctx.idx == parse_ctx.len) {
-    SET_OP_Z(parse_ctx.cur, ACCEPT);
-    STEP_OP_Z(parse_ctx.cur);
-    bcl->len = parse_ctx.cur - bcl->code;
+    SET_OP_A(parse_ctx.cur, ACCEPT, 0);
+    STEP_OP_A(parse_ctx.cur);
+    assert((size_t)(parse_ctx.cur - code) <= cap);
+    len = parse_ctx.cur - code;
+    len = tregex_merge_alternations(&opt, code, len);
+    len = tregex_possessify(&opt, code, len);
+    len = tregex_drop_progress_checks(&opt, code, len);
+    len = tregex_thread_jumps(&opt, code, len);
+    if (!(bcl = tregex_emit(&opt, code, len, parse_ctx.loops)))
+      goto done;
+    bcl->groups = parse_ctx.groups;
+    const tregex_byte_code *p = bcl->code;
+    if (FETCH_OPCODE(p) == MATCH_STR)
+      p += OP_MATCH_STR_LEN;
+    for (; FETCH_OPCODE(p) == MATCH && bcl->prefix_len < MAX_PREFIX_SIZE; STEP_OP_A(p))
+      bcl->prefix[bcl->prefix_len++] = (char)FETCH_OPARG_A(p);
+    tregex_find_required(bcl);
   }
-  else {
+  else if ((bcl = tregex_alloc_program(1, 0)))
     SET_OP_Z(bcl->code, HALT);
-    bcl->len = 1;
-  }
+  if (bcl)
+    tregex_build_memo(bcl);
 
+done:
+  free(code);
+  free(opt.removed);
+  free(opt.stack);
+  free(opt.map);
   return bcl;
 }
 
+tregex_byte_code_list *tregex_compile(const char *re) {
+  return tregex_compile_impl(re, 0);
+}
+
+/* Like tregex_compile, but every `(...)` records where it matched. */
+tregex_byte_code_list *tregex_compile_groups(const char *re) {
+  return tregex_compile_impl(re, 1);
+}
+
+#ifdef TREGEX_STATS
+static void tregex_stats_op(tregex_stats *stats, const tregex_byte_code *pcode, int pc) {
+  stats->ops[FETCH_OPCODE(&pcode[pc])]++;
+  if (stats->hits)
+    stats->hits[pc]++;
+}
+
+static void tregex_stats_reset(tregex_match_ctx *ctx, const tregex_byte_code_list *bcl) {
+  tregex_stats *stats = ctx->stats;
+  uint64_t *hits = stats->hits;
+  memset(stats, 0, sizeof(*stats));
+  if ((stats->hits = hits))
+    memset(hits, 0, bcl->len * sizeof(*hits));
+}
+
+static void tregex_stats_push(tregex_match_ctx *ctx) {
+  tregex_stats *stats = ctx->stats;
+  if (!stats) return;
+  stats->pushes++;
+  if (ctx->top - ctx->stack > stats->stack_peak)
+    stats->stack_peak = (int)(ctx->top - ctx->stack);
+}
+
+/* The first pop of every start position resumes its initial thread rather than backtracking. */
+static void tregex_stats_start(tregex_match_ctx *ctx) {
+  if (ctx->stats)
+    ctx->stats->starts++, ctx->stats->backtracks--;
+}
+
+#define tregex_stats_pop(ctx)    ((ctx)->stats ? (void)(ctx)->stats->backtracks++ : (void)0)
+#define tregex_stats_grow(ctx)   ((ctx)->stats ? (void)(ctx)->stats->stack_grows++ : (void)0)
+#define tregex_stats_undo(ctx)   ((ctx)->stats && (ctx)->undo_len > (ctx)->stats->undo_peak ? (void)((ctx)->stats->undo_peak = (ctx)->undo_len) : (void)0)
+#else
+#define tregex_stats_push(ctx)   ((void)0)
+#define tregex_stats_start(ctx)  ((void)0)
+#define tregex_stats_pop(ctx)    ((void)0)
+#define tregex_stats_grow(ctx)   ((void)0)
+#define tregex_stats_undo(ctx)   ((void)0)
+#endif
+
 static int tregex_extend_stack(tregex_match_ctx *ctx) {
-  int stack_used = ctx->stack_size, new_size = ctx->stack_size + ctx->stack_size / 2;
+  int new_size = ctx->stack_size + ctx->stack_size / 2;
   if (new_size > MAX_STACK_SIZE)
     return 0;
-  void *p = realloc(ctx->stack, new_size * sizeof(*ctx->stack));
-  if (!p) exit(-1);
-  ctx->stack = (tregex_match_thread *)p;
-  ctx->top = ctx->stack + stack_used;
+  tregex_match_thread *p = malloc(new_size * sizeof(*ctx->stack));
+  if (!p) return 0;
+  memcpy(p, ctx->stack, ctx->stack_size * sizeof(*ctx->stack));
+  ctx->top = p + (ctx->top - ctx->stack);
+  free(ctx->stack);
+  ctx->stack = p;
+  memset(ctx->stack + ctx->stack_size, 0, ((size_t)new_size - ctx->stack_size) * sizeof(*ctx->stack));
   ctx->stack_size = new_size;
-  memset(ctx->top, 0, ((size_t)new_size - stack_used) * sizeof(*ctx->stack));
+  tregex_stats_grow(ctx);
   return new_size;
 }
 
-static int tregex_execute(tregex_pool_ctx *mem, tregex_match_ctx *ctx) {
-#ifdef USE_LABELS_AS_VALUES
-  static void *disptab[OP_NUM] = {
-#undef OP_DEFINE_IMPL
-#define OP_DEFINE_IMPL(op) &&L_##op,
+/* Grows the slot table to the program's loop count and the undo log to its initial size. */
+static int tregex_reserve(tregex_match_ctx *ctx, const tregex_byte_code_list *bcl) {
+  if (TREGEX_SLOTS(bcl) > ctx->slots_size) {
+    void *p = realloc(ctx->slots, TREGEX_SLOTS(bcl) * sizeof(*ctx->slots));
+    if (!p) return 0;
+    ctx->slots = (int *)p;
+    memset(ctx->slots + ctx->slots_size, -1, (TREGEX_SLOTS(bcl) - ctx->slots_size) * sizeof(*ctx->slots));
+    ctx->slots_size = TREGEX_SLOTS(bcl);
+  }
+  if (!ctx->undo) {
+    if (!(ctx->undo = malloc(INITIAL_STACK_SIZE * sizeof(*ctx->undo))))
+      return 0;
+    ctx->undo_size = INITIAL_STACK_SIZE;
+  }
+  return 1;
+}
+
+/* Starts a new iteration of loop `slot` at `idx`, logging the old start for backtracking. */
+static int tregex_set_slot(tregex_match_ctx *ctx, int slot, int idx) {
+  if (ctx->slots[slot] == idx)
+    return 1;
+  if (ctx->undo_len == ctx->undo_size) {
+    int new_size = ctx->undo_size + ctx->undo_size / 2;
+    void *p = new_size > MAX_STACK_SIZE ? NULL : realloc(ctx->undo, new_size * sizeof(*ctx->undo));
+    if (!p) return 0;
+    ctx->undo = (tregex_match_undo *)p;
+    ctx->undo_size = new_size;
+  }
+  ctx->undo[ctx->undo_len++] = (tregex_match_undo){ slot, ctx->slots[slot] };
+  ctx->slots[slot] = idx;
+  tregex_stats_undo(ctx);
+  return 1;
+}
+
+/*
+ * Turns on visited-state pruning when the (SPLIT/REPEAT pc, position) bitmap
+ * for this input fits in MAX_BITSTATE_SIZE; a state that was explored once
+ * and failed fails again, so each is tried at most once per call.
+ */
+static void tregex_memo_prepare(tregex_match_ctx *ctx, const tregex_byte_code_list *bcl, size_t len) {
+  ctx->memo = 0;
+  ctx->memo_owner = NULL;
+  if (!bcl->memo_keys || len >= (size_t)MAX_BITSTATE_SIZE * 8)
+    return;
+  size_t bits = (size_t)bcl->memo_keys * (len + 1), words = (bits + 31) / 32;
+  if (bits > (size_t)MAX_BITSTATE_SIZE * 8)
+    return;
+  if (words > ctx->visited_size) {
+    void *p = realloc(ctx->visited, words * sizeof(*ctx->visited));
+    if (!p) return;
+    ctx->visited = (uint32_t *)p;
+    ctx->visited_size = words;
+  }
+  memset(ctx->visited, 0, words * sizeof(*ctx->visited));
+  ctx->memo = 1;
+}
+
+/*
+ * Forgets the states explored at `idx`. Those on the path of a match that
+ * ended there succeeded, and a search resuming at `idx` may reach them again;
+ * every state before `idx` is out of its reach.
+ */
+static void tregex_memo_forget(tregex_match_ctx *ctx, const tregex_byte_code_list *bcl, int idx) {
+  if (!ctx->memo)
+    return;
+  for (int key = 0; key < bcl->memo_keys; key++) {
+    size_t bit = (size_t)key * (ctx->len + 1) + idx;
+    ctx->visited[bit >> 5] &= ~(1u << (bit & 31));
+  }
+}
+
+/*
+ * Whether the state at `pc` was already explored. Only the innermost loop's
+ * progress matters: an outer iteration starting here implies an inner one
+ * did, and states inside such an empty iteration are not recorded.
+ */
+static int tregex_memo_visit(tregex_match_ctx *ctx, int key, int loop, int idx) {
+  if (key < 0 || (loop >= 0 && ctx->slots[loop] == idx))
+    return 0;
+  size_t bit = (size_t)key * (ctx->len + 1) + idx;
+  uint32_t mask = 1u << (bit & 31);
+  if (ctx->visited[bit >> 5] & mask)
+    return 1;
+  ctx->visited[bit >> 5] |= mask;
+  return 0;
+}
+
+/* The value of the counter in `slot` as the memo tells it apart, one of `keys`. */
+static int tregex_memo_counter(const tregex_match_ctx *ctx, int slot, int keys) {
+  unsigned n = (unsigned)ctx->slots[slot];
+  return (int)(n < (unsigned)keys ? n : (unsigned)keys - 1);
+}
+
+static int tregex_memo_seen(tregex_match_ctx *ctx, const tregex_byte_code *memo, int pc, int idx) {
+  int key = memo[pc];
+  if (key >= 0)
+    for (int c = memo[pc + 2], stride = 1; c >= 0; c = memo[c]) {
+      const tregex_byte_code *head = &ctx->code->code[c];
+      key += stride * tregex_memo_counter(ctx, FETCH_OPARG_A(head), tregex_count_keys(head));
+      stride *= tregex_count_keys(head);
+    }
+  return tregex_memo_visit(ctx, key, memo[pc + 1], idx);
+}
+
+/*
+ * Budgets count threads popped off the stack, the one place every backtrack
+ * passes. `steps` counts down to the next call here, which either stops the
+ * match or hands out another slice; with a deadline the slices are
+ * BUDGET_CHECK_INTERVAL long so the clock is read only that often.
+ */
+static int tregex_budget_check(tregex_match_ctx *ctx) {
+  if (ctx->deadline && rdtsc() >= ctx->deadline)
+    return TREGEX_ERROR_TIMEOUT;
+  if (!ctx->steps_left)
+    return TREGEX_ERROR_BUDGET;
+  uint64_t n = ctx->deadline && ctx->steps_left > BUDGET_CHECK_INTERVAL ? BUDGET_CHECK_INTERVAL : ctx->steps_left;
+  ctx->steps_left -= n;
+  ctx->steps = n - 1;
+  return 0;
+}
+
+static void tregex_budget_start(tregex_match_ctx *ctx) {
+  ctx->steps_left = ctx->max_steps ? ctx->max_steps : UINT64_MAX;
+  ctx->deadline = ctx->max_cycles ? rdtsc() + ctx->max_cycles : 0;
+  ctx->steps = 0;
+}
+
+static void tregex_rollback(tregex_match_ctx *ctx, int undo) {
+  while (ctx->undo_len > undo) {
+    tregex_match_undo *u = &ctx->undo[--ctx->undo_len];
+    ctx->slots[u->slot] = u->idx;
+  }
+}
+
+/* Where a bounded LOOP has to stop scanning. */
+static int tregex_loop_end(const tregex_match_ctx *ctx, int idx, const tregex_byte_code *inst) {
+  int max = LOOP_MAX(inst);
+  return max < 0 || max > ctx->len - idx ? ctx->len : idx + max;
+}
+
+/*
+ * Enters a counted loop at its COUNT or ends an iteration at its COUNT_NEXT
+ * and returns where to go on, TREGEX_ERROR_NOMEM if the stack cannot grow.
+ * The COUNT's slot holds the iterations done and the next one the position
+ * the current iteration started at; past the minimum an empty iteration
+ * leaves the loop like REPEAT does. Being slots, both roll back with the
+ * undo log.
+ */
+static int tregex_count(tregex_match_ctx *ctx, int pc, int idx) {
+  const tregex_byte_code *head = &ctx->code->code[pc];
+  int n = 0;
+  if (FETCH_OPCODE(head) == COUNT_NEXT) {
+    head += FETCH_OPARG_A(head);
+    pc = (int)(head - ctx->code->code);
+    n = ctx->slots[FETCH_OPARG_A(head)] + 1;
+    if (n > FETCH_OPARG_C(head) && ctx->slots[FETCH_OPARG_A(head) + 1] == idx)
+      return pc + FETCH_OPARG_B(head);
+  }
+  if (!tregex_set_slot(ctx, FETCH_OPARG_A(head), n))
+    return TREGEX_ERROR_NOMEM;
+  if (FETCH_OPARG_D(head) >= 0 && n >= FETCH_OPARG_D(head))
+    return pc + FETCH_OPARG_B(head);
+  if (n >= FETCH_OPARG_C(head)) {
+    if (ctx->top - ctx->stack >= (ptrdiff_t)ctx->stack_size - 1 && !tregex_extend_stack(ctx))
+      return TREGEX_ERROR_NOMEM;
+    *ctx->top++ = (tregex_match_thread){ pc + FETCH_OPARG_B(head), idx, ctx->undo_len };
+    tregex_stats_push(ctx);
+  }
+  if (!tregex_set_slot(ctx, FETCH_OPARG_A(head) + 1, idx))
+    return TREGEX_ERROR_NOMEM;
+  return pc + OP_COUNT_LEN;
+}
+
+/*
+ * Every loop owns a slot holding the position its current iteration started
+ * at; an iteration that ends where it started leaves the loop. Backtrack
+ * entries remember the undo log height and roll the slots back to it.
+ */
+static int tregex_execute(tregex_match_ctx *ctx, int start) {
+#ifdef USE_LABELS_AS_VALUES
+  static void *disptab[OP_NUM] = {
+#undef OP_DEFINE_IMPL
+#define OP_DEFINE_IMPL(op) &&L_##op,
     ALL_OP_DEFINE
   };
 #endif 
-  tregex_byte_code *pcode = ctx->code->code;
-  tregex_internal_stack *stack0 = tregex_internal_stack_create(mem);
-  *ctx->top++ = (tregex_match_thread){ 0,0, stack0 };
+  const tregex_byte_code *pcode = ctx->code->code;
+  const char *literals = TREGEX_LITERALS(ctx->code);
+  const tregex_byte_code *memo = ctx->memo ? TREGEX_MEMO(ctx->code) : NULL;
+  ctx->undo_len = 0;
+  *ctx->top++ = (tregex_match_thread){ 0, start, 0 };
+  tregex_stats_start(ctx);
 
 fail_loop:;
   while (ctx->top > ctx->stack) {
     --ctx->top;
+    tregex_stats_pop(ctx);
+    if (ctx->steps-- == 0) {
+      int err = tregex_budget_check(ctx);
+      if (err) return err;
+    }
     int pc = ctx->top->pc;
     int idx = ctx->top->idx;
-    tregex_internal_stack *istack = ctx->top->stack;
+    tregex_rollback(ctx, ctx->top->undo);
 #ifndef USE_LABELS_AS_VALUES
     next_loop:;
 #endif
@@ -329,47 +1379,58 @@ fail_loop:;
         return -1;
       }
       vmcase(PUSH) {
-        tregex_internal_stack_push(mem, istack, idx);
-        STEP_OP_Z(pc);
+        if (!tregex_set_slot(ctx, FETCH_OPARG_A(&pcode[pc]), idx))
+          return TREGEX_ERROR_NOMEM;
+        STEP_OP_A(pc);
         vmnext;
       }
       vmcase(REPEAT) {
-        if (tregex_internal_stack_top(istack) == idx) {
-          tregex_internal_stack_pop(mem, istack);
-          STEP_OP_A(pc);
+        if (memo && tregex_memo_seen(ctx, memo, pc, idx))
+          goto fail_loop;
+        if (ctx->slots[FETCH_OPARG_B(&pcode[pc])] == idx) {
+          STEP_OP_AB(pc);
           vmnext;
         }
         if (ctx->top - ctx->stack >= (ptrdiff_t)ctx->stack_size - 1 && !tregex_extend_stack(ctx))
-          exit(-1);
-        *ctx->top++ = (tregex_match_thread){ pc + OP_REPEAT_LEN, idx, tregex_internal_stack_copy(mem, istack) };
+          return TREGEX_ERROR_NOMEM;
+        *ctx->top++ = (tregex_match_thread){ pc + OP_REPEAT_LEN, idx, ctx->undo_len };
+        tregex_stats_push(ctx);
+        if (!tregex_set_slot(ctx, FETCH_OPARG_B(&pcode[pc]), idx))
+          return TREGEX_ERROR_NOMEM;
         pc += FETCH_OPARG_A(&pcode[pc]);
         vmnext;
       }
       vmcase(LOOP) {
-        char tmp = FETCH_OPARG_A(&pcode[pc]);
         int initial_idx = idx;
-        while (idx < ctx->len && ctx->str[idx] == tmp)
-          idx++;
-        if (idx == initial_idx) {
-          tregex_internal_stack_destroy(mem, istack);
+        idx = tregex_span.span_char(ctx->str, idx, tregex_loop_end(ctx, idx, &pcode[pc]), (char)FETCH_OPARG_A(&pcode[pc]));
+        if (idx - initial_idx < LOOP_MIN(&pcode[pc])) {
           goto fail_loop;
         }
-        STEP_OP_A(pc);
+        pc += OP_LOOP_LEN;
         vmnext;
       }
       vmcase(LOOP_SET) {
-        char left = FETCH_OPARG_A(&pcode[pc]);
-        char right = FETCH_OPARG_B(&pcode[pc]);
         int initial_idx = idx;
-        while (idx < ctx->len &&
-          ctx->str[idx] >= left &&
-          ctx->str[idx] <= right)
-          idx++;
-        if (idx == initial_idx) {
-          tregex_internal_stack_destroy(mem, istack);
+        idx = tregex_span.span_range(ctx->str, idx, tregex_loop_end(ctx, idx, &pcode[pc]), (char)FETCH_OPARG_A(&pcode[pc]), (char)FETCH_OPARG_B(&pcode[pc]));
+        if (idx - initial_idx < LOOP_MIN(&pcode[pc])) {
           goto fail_loop;
         }
-        STEP_OP_AB(pc);
+        pc += OP_LOOP_SET_LEN;
+        vmnext;
+      }
+      vmcase(LOOP_CLASS) {
+        int initial_idx = idx;
+        idx = tregex_span.span_class(ctx->str, idx, tregex_loop_end(ctx, idx, &pcode[pc]), FETCH_CLASS(&pcode[pc]));
+        if (idx - initial_idx < LOOP_MIN(&pcode[pc])) {
+          goto fail_loop;
+        }
+        pc += OP_LOOP_CLASS_LEN;
+        vmnext;
+      }
+      vmcase(COUNT)
+      vmcase(COUNT_NEXT) {
+        if ((pc = tregex_count(ctx, pc, idx)) < 0)
+          return TREGEX_ERROR_NOMEM;
         vmnext;
       }
       vmcase(MATCH) {
@@ -378,7 +1439,6 @@ fail_loop:;
           STEP_OP_A(pc);
           vmnext;
         }
-        tregex_internal_stack_destroy(mem, istack);
         goto fail_loop;
       }
       vmcase(MATCH_SET) {
@@ -389,7 +1449,14 @@ fail_loop:;
           STEP_OP_AB(pc);
           vmnext;
         }
-        tregex_internal_stack_destroy(mem, istack);
+        goto fail_loop;
+      }
+      vmcase(MATCH_CLASS) {
+        if (idx < ctx->len && CLASS_HAS(FETCH_CLASS(&pcode[pc]), (unsigned char)ctx->str[idx])) {
+          idx++;
+          pc += OP_MATCH_CLASS_LEN;
+          vmnext;
+        }
         goto fail_loop;
       }
       vmcase(ANY) {
@@ -398,15 +1465,28 @@ fail_loop:;
           STEP_OP_Z(pc);
           vmnext;
         }
-        tregex_internal_stack_destroy(mem, istack);
         goto fail_loop;
       }
+      vmcase(MATCH_STR) {
+        int n = FETCH_OPARG_A(&pcode[pc]);
+        if (ctx->len - idx >= n && !memcmp(ctx->str + idx, literals + FETCH_OPARG_B(&pcode[pc]), n)) {
+          idx += n;
+          pc += OP_MATCH_STR_LEN + n * OP_MATCH_LEN;
+          vmnext;
+        }
+        goto fail_loop;
+      }
+      vmcase(SAVE) {
+        if (!tregex_set_slot(ctx, ctx->code->loops + FETCH_OPARG_A(&pcode[pc]), idx))
+          return TREGEX_ERROR_NOMEM;
+        STEP_OP_A(pc);
+        vmnext;
+      }
       vmcase(BEGIN) {
         if (idx == 0) {
           STEP_OP_Z(pc);
           vmnext;
         }
-        tregex_internal_stack_destroy(mem, istack);
         goto fail_loop;
       }
       vmcase(END) {
@@ -414,13 +1494,15 @@ fail_loop:;
           STEP_OP_Z(pc);
           vmnext;
         }
-        tregex_internal_stack_destroy(mem, istack);
         goto fail_loop;
       }
       vmcase(SPLIT) {
+        if (memo && tregex_memo_seen(ctx, memo, pc, idx))
+          goto fail_loop;
         if (ctx->top - ctx->stack >= (ptrdiff_t)ctx->stack_size - 1 && !tregex_extend_stack(ctx))
-          exit(-1);
-        *ctx->top++ = (tregex_match_thread){ pc + FETCH_OPARG_B(&pcode[pc]),idx, tregex_internal_stack_copy(mem, istack) };
+          return TREGEX_ERROR_NOMEM;
+        *ctx->top++ = (tregex_match_thread){ pc + FETCH_OPARG_B(&pcode[pc]), idx, ctx->undo_len };
+        tregex_stats_push(ctx);
         pc += FETCH_OPARG_A(&pcode[pc]);
         vmnext;
       }
@@ -429,7 +1511,6 @@ fail_loop:;
         vmnext;
       }
       vmcase(ACCEPT) {
-        tregex_internal_stack_destroy(mem, istack);
         return idx;
       }
     }
@@ -438,84 +1519,3614 @@ fail_loop:;
   return -1;
 }
 
-int tregex_match(const char *re, const char *str, tregex_byte_code_list *compiled, tregex_pool_ctx *mem) {
-  tregex_match_ctx ctx = { 0 };
-  tregex_byte_code_list *bcl = compiled ? compiled : tregex_compile(re);
-  tregex_pool_ctx *pool = mem ? mem : tregex_pool_create();
-
-  if (!bcl) return 0;
-
-  ctx.str = str;
-  ctx.len = (int)strlen(str);
-  ctx.pc = 0;
-  ctx.code = bcl;
-  ctx.stack = calloc(1, INITIAL_STACK_SIZE * sizeof(*ctx.stack));
-  if (!ctx.stack) exit(-1);
-  ctx.top = ctx.stack;
-  ctx.stack_size = INITIAL_STACK_SIZE;
-
-  int match_end = tregex_execute(pool, &ctx);
-  free(ctx.stack);
-  if (!compiled)
-    free(bcl);
-  if (!mem)
-    tregex_pool_destroy(pool);
+/*
+ * Packed programs. Operands are LEB128 varints except chars and classes,
+ * jump targets are byte offsets from the start, and SPLIT/REPEAT carry their
+ * memo key and innermost loop (both +1) inline instead of a side table, then
+ * the number of counted loops around them and each one's slot and memo keys,
+ * innermost first.
+ */
+static uint32_t tregex_get_varint(const uint8_t **ip) {
+  const uint8_t *p = *ip;
+  uint32_t v = *p++;
+  if (v & 0x80) {
+    v &= 0x7f;
+    for (int shift = 7; ; shift += 7) {
+      uint32_t b = *p++;
+      v |= (b & 0x7f) << shift;
+      if (!(b & 0x80)) break;
+    }
+  }
+  *ip = p;
+  return v;
+}
 
-  return match_end;
+/* Reads the counters after a packed SPLIT/REPEAT and folds their values into `key`. */
+static int tregex_packed_key(const tregex_match_ctx *ctx, const uint8_t **ip, int key) {
+  int stride = 1;
+  for (int counters = (int)tregex_get_varint(ip); counters > 0; counters--) {
+    int slot = (int)tregex_get_varint(ip), keys = (int)tregex_get_varint(ip);
+    if (key >= 0) key += stride * tregex_memo_counter(ctx, slot, keys);
+    stride *= keys;
+  }
+  return key;
 }
 
-void tregex_dump(const tregex_byte_code_list *byte_code) {
-  const tregex_byte_code *p = byte_code->code, *q = p;
-  static const char *byte_code_name[] = {
+/* tregex_count for packed code; `next` is set when coming from COUNT_NEXT. */
+static int tregex_packed_count(tregex_match_ctx *ctx, int pc, int idx, int next) {
+  const tregex_packed *packed = ctx->packed;
+  const uint8_t *ip = packed->bytes + pc + 1 + packed->threaded;
+  int slot = (int)tregex_get_varint(&ip), exit = (int)tregex_get_varint(&ip);
+  int min = (int)tregex_get_varint(&ip), max = (int)tregex_get_varint(&ip) - 1, n = 0;
+  if (next) {
+    n = ctx->slots[slot] + 1;
+    if (n > min && ctx->slots[slot + 1] == idx)
+      return exit;
+  }
+  if (!tregex_set_slot(ctx, slot, n))
+    return TREGEX_ERROR_NOMEM;
+  if (max >= 0 && n >= max)
+    return exit;
+  if (n >= min) {
+    if (ctx->top - ctx->stack >= (ptrdiff_t)ctx->stack_size - 1 && !tregex_extend_stack(ctx))
+      return TREGEX_ERROR_NOMEM;
+    *ctx->top++ = (tregex_match_thread){ exit, idx, ctx->undo_len };
+  }
+  if (!tregex_set_slot(ctx, slot + 1, idx))
+    return TREGEX_ERROR_NOMEM;
+  return (int)(ip - packed->bytes);
+}
+
+#ifdef USE_LABELS_AS_VALUES
+/* Handler offsets from L_HALT in tregex_packed_execute, what threaded code stores as opcodes. */
+static int16_t tregex_packed_labels[OP_NUM];
+static int tregex_packed_threadable;
+
+#define pknext            goto *(threaded ? (void *)((char *)&&L_HALT + (int16_t)(ip[0] | ip[1] << 8)) : disptab[*ip])
+#define pkdispatch        pknext;
+#else
+#define pkdispatch        switch (*ip)
+#define pknext            goto next_loop
+#endif
+
+/*
+ * tregex_execute over a packed program. Called with a NULL ctx, it records
+ * its handler offsets for tregex_pack instead.
+ */
+static int tregex_packed_execute(tregex_match_ctx *ctx, int start) {
+#ifdef USE_LABELS_AS_VALUES
+  static void *disptab[OP_NUM] = {
 #undef OP_DEFINE_IMPL
-#define OP_DEFINE_IMPL(op) #op,
-  ALL_OP_DEFINE
+#define OP_DEFINE_IMPL(op) &&L_##op,
+    ALL_OP_DEFINE
   };
-  for (size_t i = 0; i < byte_code->len;) {
-    p = &byte_code->code[i];
-    int op = FETCH_OPCODE(p);
-    printf("%d\t ", (int)(p - q));
-    if (op > ACCEPT) continue;
-    printf("%s ", byte_code_name[op]);
-    switch (op) {
-    case LOOP:
-    case MATCH:
-      printf("\t\t%c(\\%d)\n",
-        (char)FETCH_OPARG_A(p), (int)(char)FETCH_OPARG_A(p));
-      STEP_OP_A(i);
-      continue;
-    case LOOP_SET:
-    case MATCH_SET:
-      printf("\t%c(\\%d), %c(\\%d)\n",
-        (char)FETCH_OPARG_A(p), (int)(char)FETCH_OPARG_A(p),
-        (char)FETCH_OPARG_B(p), (int)(char)FETCH_OPARG_B(p));
-      STEP_OP_AB(i);
-      continue;
-    case HALT:
-    case PUSH:
-    case ANY:
-    case BEGIN:
-    case END:
-    case ACCEPT:
-      printf("\n");
-      STEP_OP_Z(i);
-      continue;
-    case SPLIT:
-      printf("\t\t%d, %d\n",
-        (char)FETCH_OPARG_A(p) + (int)(p - q), (char)FETCH_OPARG_B(p) + (int)(p - q));
-      STEP_OP_AB(i);
-      continue;
-    case REPEAT:
-      printf("\t%d\n",
-        (char)FETCH_OPARG_A(p) + (int)(p - q));
-      STEP_OP_A(i);
+  if (!ctx) {
+    tregex_packed_threadable = 1;
+    for (int i = 0; i < OP_NUM; i++) {
+      ptrdiff_t off = (char *)disptab[i] - (char *)&&L_HALT;
+      tregex_packed_labels[i] = (int16_t)off;
+      if (off != tregex_packed_labels[i])
+        tregex_packed_threadable = 0;
+    }
+    return 0;
+  }
+  const int threaded = ctx->packed->threaded;
+#endif
+  const uint8_t *base = ctx->packed->bytes, *ip, *p;
+  const int w = 1 + ctx->packed->threaded;
+  const int memo = ctx->memo;
+  ctx->undo_len = 0;
+  *ctx->top++ = (tregex_match_thread){ 0, start, 0 };
+
+fail_loop:;
+  while (ctx->top > ctx->stack) {
+    --ctx->top;
+    if (ctx->steps-- == 0) {
+      int err = tregex_budget_check(ctx);
+      if (err) return err;
+    }
+    ip = base + ctx->top->pc;
+    int idx = ctx->top->idx;
+    tregex_rollback(ctx, ctx->top->undo);
+#ifndef USE_LABELS_AS_VALUES
+    next_loop:;
+#endif
+    pkdispatch {
+      vmcase(HALT) {
+        return -1;
+      }
+      vmcase(PUSH) {
+        p = ip + w;
+        if (!tregex_set_slot(ctx, (int)tregex_get_varint(&p), idx))
+          return TREGEX_ERROR_NOMEM;
+        ip = p;
+        pknext;
+      }
+      vmcase(REPEAT) {
+        p = ip + w;
+        int target = (int)tregex_get_varint(&p), slot = (int)tregex_get_varint(&p);
+        int key = (int)tregex_get_varint(&p) - 1, loop = (int)tregex_get_varint(&p) - 1;
+        key = tregex_packed_key(ctx, &p, memo ? key : -1);
+        if (memo && tregex_memo_visit(ctx, key, loop, idx))
+          goto fail_loop;
+        if (ctx->slots[slot] == idx) {
+          ip = p;
+          pknext;
+        }
+        if (ctx->top - ctx->stack >= (ptrdiff_t)ctx->stack_size - 1 && !tregex_extend_stack(ctx))
+          return TREGEX_ERROR_NOMEM;
+        *ctx->top++ = (tregex_match_thread){ (int)(p - base), idx, ctx->undo_len };
+        if (!tregex_set_slot(ctx, slot, idx))
+          return TREGEX_ERROR_NOMEM;
+        ip = base + target;
+        pknext;
+      }
+      vmcase(LOOP) {
+        p = ip + w + 1;
+        int initial_idx = idx, min = (int)tregex_get_varint(&p), max = (int)tregex_get_varint(&p) - 1;
+        int end = max < 0 || max > ctx->len - idx ? ctx->len : idx + max;
+        idx = tregex_span.span_char(ctx->str, idx, end, (char)ip[w]);
+        if (idx - initial_idx < min)
+          goto fail_loop;
+        ip = p;
+        pknext;
+      }
+      vmcase(LOOP_SET) {
+        p = ip + w + 2;
+        int initial_idx = idx, min = (int)tregex_get_varint(&p), max = (int)tregex_get_varint(&p) - 1;
+        int end = max < 0 || max > ctx->len - idx ? ctx->len : idx + max;
+        idx = tregex_span.span_range(ctx->str, idx, end, (char)ip[w], (char)ip[w + 1]);
+        if (idx - initial_idx < min)
+          goto fail_loop;
+        ip = p;
+        pknext;
+      }
+      vmcase(LOOP_CLASS) {
+        p = ip + w + CLASS_SIZE;
+        int initial_idx = idx, min = (int)tregex_get_varint(&p), max = (int)tregex_get_varint(&p) - 1;
+        int end = max < 0 || max > ctx->len - idx ? ctx->len : idx + max;
+        idx = tregex_span.span_class(ctx->str, idx, end, ip + w);
+        if (idx - initial_idx < min)
+          goto fail_loop;
+        ip = p;
+        pknext;
+      }
+      vmcase(COUNT) {
+        int pc = tregex_packed_count(ctx, (int)(ip - base), idx, 0);
+        if (pc < 0)
+          return TREGEX_ERROR_NOMEM;
+        ip = base + pc;
+        pknext;
+      }
+      vmcase(COUNT_NEXT) {
+        p = ip + w;
+        int pc = tregex_packed_count(ctx, (int)tregex_get_varint(&p), idx, 1);
+        if (pc < 0)
+          return TREGEX_ERROR_NOMEM;
+        ip = base + pc;
+        pknext;
+      }
+      vmcase(MATCH) {
+        if (idx < ctx->len && ctx->str[idx] == (char)ip[w]) {
+          idx++;
+          ip += w + 1;
+          pknext;
+        }
+        goto fail_loop;
+      }
+      vmcase(MATCH_SET) {
+        if (idx < ctx->len && ctx->str[idx] >= (char)ip[w] && ctx->str[idx] <= (char)ip[w + 1]) {
+          idx++;
+          ip += w + 2;
+          pknext;
+        }
+        goto fail_loop;
+      }
+      vmcase(MATCH_CLASS) {
+        if (idx < ctx->len && CLASS_HAS(ip + w, (unsigned char)ctx->str[idx])) {
+          idx++;
+          ip += w + CLASS_SIZE;
+          pknext;
+        }
+        goto fail_loop;
+      }
+      vmcase(ANY) {
+        if (idx < ctx->len) {
+          idx++;
+          ip += w;
+          pknext;
+        }
+        goto fail_loop;
+      }
+      vmcase(MATCH_STR) {
+        p = ip + w;
+        int n = (int)tregex_get_varint(&p), next = (int)tregex_get_varint(&p);
+        if (ctx->len - idx >= n && !memcmp(ctx->str + idx, p, n)) {
+          idx += n;
+          ip = base + next;
+          pknext;
+        }
+        goto fail_loop;
+      }
+      vmcase(SAVE) {
+        p = ip + w;
+        if (!tregex_set_slot(ctx, (int)tregex_get_varint(&p), idx))
+          return TREGEX_ERROR_NOMEM;
+        ip = p;
+        pknext;
+      }
+      vmcase(BEGIN) {
+        if (idx == 0) {
+          ip += w;
+          pknext;
+        }
+        goto fail_loop;
+      }
+      vmcase(END) {
+        if (idx == ctx->len) {
+          ip += w;
+          pknext;
+        }
+        goto fail_loop;
+      }
+      vmcase(SPLIT) {
+        p = ip + w;
+        int x = (int)tregex_get_varint(&p), y = (int)tregex_get_varint(&p);
+        int key = (int)tregex_get_varint(&p) - 1, loop = (int)tregex_get_varint(&p) - 1;
+        key = tregex_packed_key(ctx, &p, memo ? key : -1);
+        if (memo && tregex_memo_visit(ctx, key, loop, idx))
+          goto fail_loop;
+        if (ctx->top - ctx->stack >= (ptrdiff_t)ctx->stack_size - 1 && !tregex_extend_stack(ctx))
+          return TREGEX_ERROR_NOMEM;
+        *ctx->top++ = (tregex_match_thread){ y, idx, ctx->undo_len };
+        ip = base + x;
+        pknext;
+      }
+      vmcase(JMP) {
+        p = ip + w;
+        ip = base + tregex_get_varint(&p);
+        pknext;
+      }
+      vmcase(ACCEPT) {
+        return idx;
+      }
+    }
+  }
+
+  return -1;
+}
+
+#ifdef USE_LABELS_AS_VALUES
+__attribute__((constructor))
+static void tregex_packed_init(void) {
+  tregex_packed_execute(NULL, 0);
+}
+#endif
+
+static int tregex_ctx_init(tregex_match_ctx *ctx) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->stack = calloc(1, INITIAL_STACK_SIZE * sizeof(*ctx->stack));
+  ctx->stack_size = INITIAL_STACK_SIZE;
+  return ctx->stack != NULL;
+}
+
+static void tregex_ctx_free(tregex_match_ctx *ctx) {
+  free(ctx->stack);
+  free(ctx->slots);
+  free(ctx->undo);
+  free(ctx->visited);
+}
+
+static void tregex_reset_groups(tregex_match_ctx *ctx, const tregex_byte_code_list *bcl) {
+  for (int i = bcl->loops; i < TREGEX_SLOTS(bcl); i++)
+    ctx->slots[i] = -1;
+}
+
+/* Copies group spans out of the capture slots; group 0 is the whole match. */
+static void tregex_copy_groups(const int *slots, int count, int start, int end, tregex_capture *groups, int ngroups) {
+  for (int i = 0; i < ngroups; i++) {
+    int ok = i == 0 || (i <= count && slots[2 * i] >= 0 && slots[2 * i + 1] >= 0);
+    groups[i].start = i == 0 ? start : ok ? slots[2 * i] : -1;
+    groups[i].end = i == 0 ? end : ok ? slots[2 * i + 1] : -1;
+  }
+}
+
+static const char *tregex_find_prefix(const tregex_byte_code_list *bcl, const char *p, const char *end) {
+  int idx = tregex_span.find_str(p, 0, (int)(end - p), bcl->prefix, bcl->prefix_len);
+  return idx < 0 ? NULL : p + idx;
+}
+
+/* Rejects subjects missing a literal that every match contains, before any VM runs. */
+static int tregex_required_found(const tregex_byte_code_list *bcl, const char *str, size_t len) {
+  if (bcl->suffix_len && (len < (size_t)bcl->suffix_len || memcmp(str + len - bcl->suffix_len, bcl->suffix, bcl->suffix_len)))
+    return 0;
+  return !bcl->required_len || tregex_span.find_str(str, 0, (int)len, bcl->required, bcl->required_len) >= 0;
+}
+
+static int tregex_match_ctx_run(tregex_match_ctx *ctx, const tregex_byte_code_list *bcl, const char *str, size_t len) {
+  if (len > INT_MAX)
+    return TREGEX_ERROR_TOOLONG;
+  if (!tregex_reserve(ctx, bcl))
+    return TREGEX_ERROR_NOMEM;
+  ctx->str = str;
+  ctx->len = (int)len;
+  ctx->pc = 0;
+  ctx->code = bcl;
+  ctx->top = ctx->stack;
+  tregex_reset_groups(ctx, bcl);
+  tregex_budget_start(ctx);
+#ifdef TREGEX_STATS
+  if (ctx->stats)
+    tregex_stats_reset(ctx, bcl);
+#endif
+  if (!tregex_required_found(bcl, str, len))
+    return TREGEX_NOMATCH;
+  tregex_memo_prepare(ctx, bcl, len);
+#ifdef TREGEX_STATS
+  if (ctx->stats)
+    return tregex_execute(ctx, 0);
+#endif
+  if (ctx->native)
+    return ctx->native(ctx, 0);
+  return ctx->packed ? tregex_packed_execute(ctx, 0) : tregex_execute(ctx, 0);
+}
+
+/*
+ * Searches `str` for a match starting at `from` or later. With `warm` the memo
+ * table is kept from the previous search of the same subject, which must have
+ * forgotten what it explored at or after `from` on its way to a match.
+ */
+static int tregex_search_ctx_from(tregex_match_ctx *ctx, const tregex_byte_code_list *bcl, const char *str, size_t len, int from, int *match_start, int warm) {
+  int match_end = TREGEX_NOMATCH, anchored = FETCH_OPCODE(bcl->code) == BEGIN;
+  int (*native)(tregex_match_ctx *ctx, int start) = ctx->native;
+  int (*execute)(tregex_match_ctx *ctx, int start) = ctx->packed ? tregex_packed_execute : tregex_execute;
+  if (len > INT_MAX)
+    return TREGEX_ERROR_TOOLONG;
+  if (!tregex_reserve(ctx, bcl))
+    return TREGEX_ERROR_NOMEM;
+  ctx->str = str;
+  ctx->len = (int)len;
+  ctx->pc = 0;
+  ctx->code = bcl;
+  tregex_budget_start(ctx);
+#ifdef TREGEX_STATS
+  if (ctx->stats) {
+    tregex_stats_reset(ctx, bcl);
+    native = NULL;
+    execute = tregex_execute;
+  }
+#endif
+  if (!tregex_required_found(bcl, str + from, len - from))
+    return TREGEX_NOMATCH;
+  if (!warm)
+    tregex_memo_prepare(ctx, bcl, len);
+  for (int start = from; start <= ctx->len; start++) {
+    if (bcl->prefix_len) {
+      const char *p = tregex_find_prefix(bcl, ctx->str + start, ctx->str + ctx->len);
+      if (!p) break;
+      start = (int)(p - ctx->str);
+    }
+    ctx->top = ctx->stack;
+    tregex_reset_groups(ctx, bcl);
+    match_end = native ? native(ctx, start) : execute(ctx, start);
+    if (match_end != TREGEX_NOMATCH) {
+      if (match_end >= 0 && match_start)
+        *match_start = start;
+      break;
+    }
+    if (anchored) break;
+  }
+  return match_end;
+}
+
+static int tregex_search_ctx_run(tregex_match_ctx *ctx, const tregex_byte_code_list *bcl, const char *str, size_t len, int *match_start) {
+  return tregex_search_ctx_from(ctx, bcl, str, len, 0, match_start, 0);
+}
+
+static tregex_cache_shard tregex_cache[CACHE_SHARDS];
+static int tregex_cache_size = PATTERN_CACHE_SIZE;
+static int tregex_cache_count;
+
+#ifdef TREGEX_THREADS
+static pthread_once_t tregex_cache_once = PTHREAD_ONCE_INIT;
+
+static void tregex_cache_init(void) {
+  for (int i = 0; i < CACHE_SHARDS; i++)
+    pthread_mutex_init(&tregex_cache[i].lock, NULL);
+}
+
+#define tregex_cache_lock(shard)    pthread_mutex_lock(&(shard)->lock)
+#define tregex_cache_unlock(shard)  pthread_mutex_unlock(&(shard)->lock)
+#else
+#define tregex_cache_lock(shard)    ((void)0)
+#define tregex_cache_unlock(shard)  ((void)0)
+#endif
+
+static void tregex_cache_free(tregex_cache_entry *entry) {
+  free(entry->compiled);
+  free(entry);
+}
+
+static void tregex_cache_lru_unlink(tregex_cache_shard *shard, tregex_cache_entry *entry) {
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else shard->lru_head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else shard->lru_tail = entry->lru_prev;
+}
+
+static void tregex_cache_lru_push(tregex_cache_shard *shard, tregex_cache_entry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = shard->lru_head;
+  if (shard->lru_head) shard->lru_head->lru_prev = entry;
+  else shard->lru_tail = entry;
+  shard->lru_head = entry;
+}
+
+/* Drops `entry` from the table; it is freed now or by its last release. */
+static void tregex_cache_evict(tregex_cache_shard *shard, tregex_cache_entry *entry) {
+  tregex_cache_entry **p = &shard->table[entry->hash & (shard->table_size - 1)];
+  while (*p != entry)
+    p = &(*p)->next;
+  *p = entry->next;
+  tregex_cache_lru_unlink(shard, entry);
+  shard->count--;
+  __atomic_sub_fetch(&tregex_cache_count, 1, __ATOMIC_RELAXED);
+  entry->cached = 0;
+  if (!entry->refs)
+    tregex_cache_free(entry);
+}
+
+static void tregex_cache_trim(tregex_cache_shard *shard, int limit) {
+  while (shard->count > limit)
+    tregex_cache_evict(shard, shard->lru_tail);
+}
+
+/* Evicts from `shard` until the whole cache holds at most `size` programs or the shard is empty. */
+static void tregex_cache_trim_total(tregex_cache_shard *shard, int size) {
+  while (shard->count && __atomic_load_n(&tregex_cache_count, __ATOMIC_RELAXED) > size)
+    tregex_cache_evict(shard, shard->lru_tail);
+}
+
+/*
+ * Brings the whole cache back to `size` programs, evicting the oldest of each
+ * shard in turn starting after shard `from`. Takes one shard lock at a time.
+ */
+static void tregex_cache_shrink(int from, int size) {
+  for (int i = 1; i <= CACHE_SHARDS && __atomic_load_n(&tregex_cache_count, __ATOMIC_RELAXED) > size; i++) {
+    tregex_cache_shard *shard = &tregex_cache[(from + i) % CACHE_SHARDS];
+    tregex_cache_lock(shard);
+    tregex_cache_trim_total(shard, size);
+    tregex_cache_unlock(shard);
+  }
+}
+
+/* Doubles the bucket array once chains would average more than one entry. */
+static int tregex_cache_grow(tregex_cache_shard *shard) {
+  size_t size = shard->table_size ? shard->table_size * 2 : 16;
+  tregex_cache_entry **table = calloc(size, sizeof(*table));
+  if (!table) return 0;
+  for (size_t i = 0; i < shard->table_size; i++)
+    for (tregex_cache_entry *e = shard->table[i], *next; e; e = next) {
+      next = e->next;
+      e->next = table[e->hash & (size - 1)];
+      table[e->hash & (size - 1)] = e;
+    }
+  free(shard->table);
+  shard->table = table;
+  shard->table_size = size;
+  return 1;
+}
+
+static tregex_cache_entry *tregex_cache_find(tregex_cache_shard *shard, uint32_t hash, const char *re) {
+  if (!shard->table_size)
+    return NULL;
+  for (tregex_cache_entry *e = shard->table[hash & (shard->table_size - 1)]; e; e = e->next)
+    if (e->hash == hash && !strcmp(e->re, re))
+      return e;
+  return NULL;
+}
+
+/*
+ * Returns the program for `re` from the process-wide cache, compiling it on a
+ * miss outside the shard lock. The entry is pinned until tregex_cache_release.
+ * NULL means out of memory.
+ */
+tregex_cache_entry *tregex_cache_acquire(const char *re) {
+  uint32_t hash = 2166136261u;
+  size_t len = 0;
+  for (; re[len]; len++)
+    hash = (hash ^ (uint8_t)re[len]) * 16777619u;
+  int index = (int)((hash >> 16) % CACHE_SHARDS), size = __atomic_load_n(&tregex_cache_size, __ATOMIC_RELAXED);
+  tregex_cache_shard *shard = &tregex_cache[index];
+  tregex_cache_entry *entry, *found;
+
+#ifdef TREGEX_THREADS
+  pthread_once(&tregex_cache_once, tregex_cache_init);
+#endif
+  tregex_cache_lock(shard);
+  if ((entry = tregex_cache_find(shard, hash, re))) {
+    entry->refs++;
+    tregex_cache_lru_unlink(shard, entry);
+    tregex_cache_lru_push(shard, entry);
+    tregex_cache_unlock(shard);
+    return entry;
+  }
+  tregex_cache_unlock(shard);
+
+  if (!(entry = malloc(sizeof(tregex_cache_entry) + len)))
+    return NULL;
+  if (!(entry->compiled = tregex_compile(re))) {
+    free(entry);
+    return NULL;
+  }
+  memcpy(entry->re, re, len + 1);
+  entry->hash = hash;
+  entry->refs = 1;
+  entry->cached = 0;
+  if (!size)
+    return entry;
+
+  tregex_cache_lock(shard);
+  if ((found = tregex_cache_find(shard, hash, re))) {
+    found->refs++;
+    tregex_cache_unlock(shard);
+    tregex_cache_free(entry);
+    return found;
+  }
+  if ((size_t)shard->count < shard->table_size || tregex_cache_grow(shard)) {
+    tregex_cache_trim_total(shard, size - 1);
+    size_t h = hash & (shard->table_size - 1);
+    entry->next = shard->table[h];
+    shard->table[h] = entry;
+    entry->cached = 1;
+    shard->count++;
+    __atomic_add_fetch(&tregex_cache_count, 1, __ATOMIC_RELAXED);
+    tregex_cache_lru_push(shard, entry);
+  }
+  tregex_cache_unlock(shard);
+  tregex_cache_shrink(index, size);
+  return entry;
+}
+
+void tregex_cache_release(tregex_cache_entry *entry) {
+  if (!entry) return;
+  tregex_cache_shard *shard = &tregex_cache[(entry->hash >> 16) % CACHE_SHARDS];
+  tregex_cache_lock(shard);
+  int dead = !--entry->refs && !entry->cached;
+  tregex_cache_unlock(shard);
+  if (dead)
+    tregex_cache_free(entry);
+}
+
+/* Sets how many programs the whole cache keeps, PATTERN_CACHE_SIZE by default; 0 disables it. */
+void tregex_cache_set_size(int size) {
+  size = size < 0 ? 0 : size;
+  __atomic_store_n(&tregex_cache_size, size, __ATOMIC_RELAXED);
+#ifdef TREGEX_THREADS
+  pthread_once(&tregex_cache_once, tregex_cache_init);
+#endif
+  tregex_cache_shrink(CACHE_SHARDS - 1, size);
+}
+
+/* Evicts every program; ones still acquired are freed on release. */
+void tregex_cache_clear(void) {
+#ifdef TREGEX_THREADS
+  pthread_once(&tregex_cache_once, tregex_cache_init);
+#endif
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    tregex_cache_lock(&tregex_cache[i]);
+    tregex_cache_trim(&tregex_cache[i], 0);
+    free(tregex_cache[i].table);
+    tregex_cache[i].table = NULL;
+    tregex_cache[i].table_size = 0;
+    tregex_cache_unlock(&tregex_cache[i]);
+  }
+}
+
+static void tregex_library_fill_header(tregex_library_header *header, int count, uint64_t size, uint64_t checksum) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, TREGEX_LIBRARY_MAGIC, sizeof(header->magic));
+  header->version = TREGEX_LIBRARY_VERSION;
+  header->byte_order = 0x01020304;
+  header->word_size = sizeof(size_t);
+  header->program_header = offsetof(tregex_byte_code_list, code);
+  header->opcodes = OP_NUM;
+  header->count = (uint32_t)count;
+  header->size = size;
+  header->checksum = checksum;
+}
+
+#define TREGEX_LIBRARY_HASH_INIT  14695981039346656037u
+
+/* Folds `n` bytes into a 64-bit FNV-1a hash. */
+static uint64_t tregex_library_hash(uint64_t hash, const void *data, size_t n) {
+  const uint8_t *p = data;
+  for (size_t i = 0; i < n; i++)
+    hash = (hash ^ p[i]) * 1099511628211u;
+  return hash;
+}
+
+static uint64_t tregex_library_align(uint64_t off) {
+  return (off + TREGEX_LIBRARY_ALIGN - 1) & ~(uint64_t)(TREGEX_LIBRARY_ALIGN - 1);
+}
+
+/*
+ * Writes `count` programs, and the patterns they came from when `res` is not
+ * NULL, as one library file for tregex_library_open. Returns 0 on success.
+ */
+int tregex_library_write(FILE *out, tregex_byte_code_list *const *programs, const char *const *res, int count) {
+  static const char zeros[TREGEX_LIBRARY_ALIGN];
+  tregex_library_entry *index = calloc(count ? count : 1, sizeof(tregex_library_entry));
+  tregex_library_header header;
+  uint64_t off = sizeof(header) + sizeof(tregex_library_entry) * (uint64_t)count, hash = TREGEX_LIBRARY_HASH_INIT;
+  int i, ok = index != NULL;
+
+  for (i = 0; ok && i < count; i++)
+    if (res && res[i]) {
+      index[i].pattern = off;
+      off += strlen(res[i]) + 1;
+    }
+  for (i = 0; ok && i < count; i++) {
+    off = tregex_library_align(off);
+    index[i].program = off;
+    index[i].size = TREGEX_PROGRAM_SIZE(programs[i]->len, programs[i]->literals);
+    off += index[i].size;
+  }
+  /* Hash the body in the order it is written below. */
+  if (ok) {
+    uint64_t at = sizeof(header) + sizeof(tregex_library_entry) * (uint64_t)count;
+    hash = tregex_library_hash(hash, index, sizeof(tregex_library_entry) * count);
+    for (i = 0; i < count; i++)
+      if (index[i].pattern) {
+        hash = tregex_library_hash(hash, res[i], strlen(res[i]) + 1);
+        at += strlen(res[i]) + 1;
+      }
+    for (i = 0; i < count; i++) {
+      hash = tregex_library_hash(hash, zeros, (size_t)(index[i].program - at));
+      hash = tregex_library_hash(hash, programs[i], index[i].size);
+      at = index[i].program + index[i].size;
+    }
+  }
+  tregex_library_fill_header(&header, count, off, hash);
+  ok = ok && fwrite(&header, sizeof(header), 1, out) == 1 &&
+       fwrite(index, sizeof(tregex_library_entry), count, out) == (size_t)count;
+  off = sizeof(header) + sizeof(tregex_library_entry) * (uint64_t)count;
+  for (i = 0; ok && i < count; i++)
+    if (index[i].pattern) {
+      size_t len = strlen(res[i]) + 1;
+      ok = fwrite(res[i], 1, len, out) == len;
+      off += len;
+    }
+  for (i = 0; ok && i < count; i++) {
+    size_t pad = (size_t)(index[i].program - off);
+    ok = fwrite(zeros, 1, pad, out) == pad && fwrite(programs[i], 1, index[i].size, out) == index[i].size;
+    off = index[i].program + index[i].size;
+  }
+  free(index);
+  return ok && !fflush(out) ? 0 : -1;
+}
+
+/* Whether the code at `pc + off` starts an instruction; `start` marks every instruction start. */
+static int tregex_check_target(const uint8_t *start, int len, int pc, int off) {
+  return (off >= 0 ? off < len - pc : -off <= pc) && start[pc + off];
+}
+
+/*
+ * Stores where the instruction at `pc` can go without consuming input and
+ * returns how many places. REPEAT's jump back and COUNT_NEXT's next iteration
+ * are left out: an iteration that made no progress leaves the loop there.
+ */
+static int tregex_still_targets(const tregex_byte_code *code, int pc, int *to) {
+  const tregex_byte_code *p = &code[pc];
+  switch (FETCH_OPCODE(p)) {
+  case SPLIT:
+    to[0] = pc + FETCH_OPARG_A(p);
+    to[1] = pc + FETCH_OPARG_B(p);
+    return 2;
+  case JMP:
+    to[0] = pc + FETCH_OPARG_A(p);
+    return 1;
+  case COUNT:
+    to[0] = pc + OP_COUNT_LEN;
+    to[1] = pc + FETCH_OPARG_B(p);
+    return 2;
+  case COUNT_NEXT:
+    pc += FETCH_OPARG_A(p);
+    to[0] = pc + FETCH_OPARG_B(&code[pc]);
+    return 1;
+  case REPEAT:
+  case PUSH:
+  case SAVE:
+  case BEGIN:
+  case END:
+    to[0] = pc + op_len[FETCH_OPCODE(p)];
+    return 1;
+  case LOOP:
+  case LOOP_SET:
+  case LOOP_CLASS:
+    to[0] = pc + op_len[FETCH_OPCODE(p)];
+    return !LOOP_MIN(p);
+  }
+  return 0;
+}
+
+/*
+ * Whether every cycle of the program consumes input or goes through a loop's
+ * progress check, by peeling off instructions nothing still reaches until
+ * none are left.
+ */
+static int tregex_progress_check(const tregex_byte_code *code, int len) {
+  int *in = calloc((size_t)len, sizeof(int)), *queue = malloc((size_t)len * sizeof(int));
+  int head = 0, tail = 0, left = 0, to[2], pc, i, n;
+  if (!in || !queue) {
+    free(in);
+    free(queue);
+    return 0;
+  }
+  for (pc = 0; pc < len; pc += op_len[FETCH_OPCODE(&code[pc])]) {
+    left++;
+    for (i = 0, n = tregex_still_targets(code, pc, to); i < n; i++)
+      in[to[i]]++;
+  }
+  for (pc = 0; pc < len; pc += op_len[FETCH_OPCODE(&code[pc])])
+    if (!in[pc])
+      queue[tail++] = pc;
+  while (head < tail) {
+    pc = queue[head++];
+    left--;
+    for (i = 0, n = tregex_still_targets(code, pc, to); i < n; i++)
+      if (!--in[to[i]])
+        queue[tail++] = to[i];
+  }
+  free(in);
+  free(queue);
+  return !left;
+}
+
+/*
+ * Checks a program read from outside the process: every opcode is known and
+ * fits, every jump lands on an instruction, every slot is inside the loops and
+ * groups it declares and no counter shares its slots, every cycle makes
+ * progress, and the memo table only holds keys and loops it has and COUNTs
+ * that come before.
+ */
+static int tregex_program_check(const tregex_byte_code_list *bcl) {
+  int len = (int)bcl->len, keys = 0, ok = 1, pc;
+  const tregex_byte_code *code = bcl->code, *memo = TREGEX_MEMO(bcl);
+  if (!bcl->len || bcl->len > INT_MAX || bcl->loops < 0 || bcl->loops > len ||
+      bcl->groups < 0 || bcl->groups > len || bcl->memo_keys < 0)
+    return 0;
+  /* `owner` marks the loop slots PUSH and REPEAT use with 1 and counters with 2. */
+  uint8_t *start = calloc((size_t)len + bcl->loops, 1), *owner = start + len;
+  if (!start) return 0;
+  for (pc = 0; pc < len; pc += op_len[FETCH_OPCODE(&code[pc])]) {
+    if (FETCH_OPCODE(&code[pc]) < 0 || FETCH_OPCODE(&code[pc]) >= OP_NUM || op_len[FETCH_OPCODE(&code[pc])] > len - pc) {
+      ok = 0;
+      break;
+    }
+    start[pc] = 1;
+  }
+  for (pc = 0; ok && pc < len; pc += op_len[FETCH_OPCODE(&code[pc])]) {
+    const tregex_byte_code *p = &code[pc];
+    switch (FETCH_OPCODE(p)) {
+    case PUSH:
+      ok = FETCH_OPARG_A(p) >= 0 && FETCH_OPARG_A(p) < bcl->loops && (owner[FETCH_OPARG_A(p)] |= 1) == 1;
+      break;
+    case REPEAT:
+      ok = tregex_check_target(start, len, pc, FETCH_OPARG_A(p)) && FETCH_OPARG_B(p) >= 0 && FETCH_OPARG_B(p) < bcl->loops &&
+           (owner[FETCH_OPARG_B(p)] |= 1) == 1;
+      break;
+    case SPLIT:
+      ok = tregex_check_target(start, len, pc, FETCH_OPARG_A(p)) && tregex_check_target(start, len, pc, FETCH_OPARG_B(p));
+      break;
+    case JMP:
+      ok = tregex_check_target(start, len, pc, FETCH_OPARG_A(p));
+      break;
+    case COUNT:
+      ok = FETCH_OPARG_A(p) >= 0 && FETCH_OPARG_A(p) < bcl->loops - 1 && FETCH_OPARG_B(p) > 0 &&
+           tregex_check_target(start, len, pc, FETCH_OPARG_B(p)) && !owner[FETCH_OPARG_A(p)] && !owner[FETCH_OPARG_A(p) + 1];
+      if (ok)
+        owner[FETCH_OPARG_A(p)] = owner[FETCH_OPARG_A(p) + 1] = 2;
+      break;
+    case COUNT_NEXT:
+      ok = FETCH_OPARG_A(p) < 0 && tregex_check_target(start, len, pc, FETCH_OPARG_A(p)) && FETCH_OPCODE(p + FETCH_OPARG_A(p)) == COUNT;
+      break;
+    case SAVE:
+      ok = FETCH_OPARG_A(p) >= 0 && FETCH_OPARG_A(p) < 2 * (bcl->groups + 1);
+      break;
+    case MATCH_STR:
+      ok = FETCH_OPARG_A(p) > 0 && FETCH_OPARG_A(p) <= (len - pc - OP_MATCH_STR_LEN) / OP_MATCH_LEN &&
+           FETCH_OPARG_B(p) >= 0 && (size_t)FETCH_OPARG_B(p) + FETCH_OPARG_A(p) <= bcl->literals;
+      for (int k = 0; ok && k < FETCH_OPARG_A(p); k++)
+        ok = FETCH_OPCODE(p + OP_MATCH_STR_LEN + k * OP_MATCH_LEN) == MATCH;
+      break;
+    }
+  }
+  /* The last instruction must not fall off the end of the code. */
+  if (ok) {
+    for (pc = len - 1; !start[pc]; pc--)
+      ;
+    ok = FETCH_OPCODE(&code[pc]) == ACCEPT || FETCH_OPCODE(&code[pc]) == HALT || FETCH_OPCODE(&code[pc]) == JMP;
+  }
+  ok = ok && tregex_progress_check(code, len);
+  for (pc = 0; ok && pc < len; pc++) {
+    int keyed = start[pc] && (FETCH_OPCODE(&code[pc]) == SPLIT || FETCH_OPCODE(&code[pc]) == REPEAT);
+    if (keyed) {
+      int n = 1;
+      ok = memo[pc + 2] == -1 || (memo[pc + 2] >= 0 && memo[pc + 2] < pc && start[memo[pc + 2]] && FETCH_OPCODE(&code[memo[pc + 2]]) == COUNT);
+      for (int c = memo[pc + 2]; ok && c >= 0; c = memo[c])
+        ok = tregex_count_keys(&code[c]) <= MAX_MEMO_COUNT / n && (n *= tregex_count_keys(&code[c]));
+      ok = ok && memo[pc] >= -1 && memo[pc] <= bcl->memo_keys - n && memo[pc + 1] >= -1 && memo[pc + 1] < bcl->loops;
+      keys += n;
+      pc += OP_SPLIT_LEN - 1;
+    }
+    else if (start[pc] && FETCH_OPCODE(&code[pc]) == COUNT)
+      ok = memo[pc] >= -1 && memo[pc] < pc && (memo[pc] < 0 || (start[memo[pc]] && FETCH_OPCODE(&code[memo[pc]]) == COUNT));
+    else
+      ok = memo[pc] == -1;
+  }
+  free(start);
+  return ok && bcl->memo_keys <= keys;
+}
+
+/* Checks the header, every index entry and every program, so neither lookups nor matching leave the buffer. */
+static int tregex_library_check(const char *base, size_t size) {
+  tregex_library_header header, expected;
+  if (size < sizeof(header) || ((uintptr_t)base & (TREGEX_LIBRARY_ALIGN - 1)))
+    return 0;
+  memcpy(&header, base, sizeof(header));
+  tregex_library_fill_header(&expected, (int)header.count, header.size, header.checksum);
+  if (memcmp(&header, &expected, sizeof(header)) || header.size > size || header.size < sizeof(header) ||
+      header.count > (header.size - sizeof(header)) / sizeof(tregex_library_entry) ||
+      tregex_library_hash(TREGEX_LIBRARY_HASH_INIT, base + sizeof(header), header.size - sizeof(header)) != header.checksum)
+    return 0;
+  const tregex_library_entry *index = (const tregex_library_entry *)(base + sizeof(header));
+  for (uint32_t i = 0; i < header.count; i++) {
+    const tregex_library_entry *e = &index[i];
+    if (e->pattern && (e->pattern >= header.size || !memchr(base + e->pattern, 0, header.size - e->pattern)))
+      return 0;
+    if ((e->program & (TREGEX_LIBRARY_ALIGN - 1)) || e->program > header.size ||
+        e->size > header.size - e->program || e->size < TREGEX_PROGRAM_SIZE(1, 0))
+      return 0;
+    const tregex_byte_code_list *bcl = (const tregex_byte_code_list *)(base + e->program);
+    if (bcl->len > e->size / (2 * sizeof(tregex_byte_code)) ||
+        TREGEX_PROGRAM_SIZE(bcl->len, bcl->literals) != e->size ||
+        bcl->prefix_len < 0 || bcl->prefix_len > MAX_PREFIX_SIZE ||
+        bcl->required_len < 0 || bcl->required_len > MAX_REQUIRED_SIZE ||
+        bcl->suffix_len < 0 || bcl->suffix_len > MAX_REQUIRED_SIZE ||
+        bcl->literals > e->size || !tregex_program_check(bcl))
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Uses a library image in place: `data` must be TREGEX_LIBRARY_ALIGN aligned
+ * and outlive the library. Returns NULL if it is not a library this build reads.
+ */
+tregex_library *tregex_library_load(const void *data, size_t size) {
+  if (!tregex_library_check(data, size))
+    return NULL;
+  tregex_library *lib = malloc(sizeof(tregex_library));
+  if (!lib) return NULL;
+  lib->base = data;
+  lib->size = size;
+  lib->count = (int)((const tregex_library_header *)data)->count;
+  lib->index = (const tregex_library_entry *)(lib->base + sizeof(tregex_library_header));
+  lib->owned = 0;
+  return lib;
+}
+
+/*
+ * Maps a library file read-only, so its pages are shared by every process
+ * that opens it. Where mmap is missing the file is read into memory instead.
+ */
+tregex_library *tregex_library_open(const char *path) {
+  tregex_library *lib = NULL;
+  void *data = NULL;
+  size_t size = 0;
+#ifdef TREGEX_MMAP
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (!fstat(fd, &st) && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX) {
+    size = (size_t)st.st_size;
+    if ((data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+      data = NULL;
+  }
+  close(fd);
+  if (data && !(lib = tregex_library_load(data, size)))
+    munmap(data, size);
+#else
+  FILE *in = fopen(path, "rb");
+  long end;
+  if (!in) return NULL;
+  if (!fseek(in, 0, SEEK_END) && (end = ftell(in)) > 0 && !fseek(in, 0, SEEK_SET) &&
+      (data = malloc((size_t)end)) && fread(data, 1, (size_t)end, in) == (size_t)end)
+    size = (size_t)end;
+  fclose(in);
+  if (!size || !(lib = tregex_library_load(data, size)))
+    free(data);
+#endif
+  if (lib)
+    lib->owned = 1;
+  return lib;
+}
+
+/* The returned program lives in the library and is read-only. */
+const tregex_byte_code_list *tregex_library_get(const tregex_library *lib, int i) {
+  if (i < 0 || i >= lib->count) return NULL;
+  return (const tregex_byte_code_list *)(lib->base + lib->index[i].program);
+}
+
+const char *tregex_library_pattern(const tregex_library *lib, int i) {
+  if (i < 0 || i >= lib->count || !lib->index[i].pattern) return NULL;
+  return lib->base + lib->index[i].pattern;
+}
+
+void tregex_library_close(tregex_library *lib) {
+  if (!lib) return;
+  if (lib->owned) {
+#ifdef TREGEX_MMAP
+    munmap((void *)lib->base, lib->size);
+#else
+    free((void *)lib->base);
+#endif
+  }
+  free(lib);
+}
+
+/* `mem` is accepted for compatibility; the backtracker no longer allocates per iteration. */
+int tregex_match(const char *re, const char *str, tregex_byte_code_list *compiled, tregex_pool_ctx *mem) {
+  return tregex_match_n(re, str, strlen(str), compiled, mem);
+}
+
+int tregex_match_n(const char *re, const char *str, size_t len, tregex_byte_code_list *compiled, tregex_pool_ctx *mem) {
+  tregex_match_ctx ctx;
+  tregex_cache_entry *entry = compiled ? NULL : tregex_cache_acquire(re);
+  tregex_byte_code_list *bcl = entry ? entry->compiled : compiled;
+  int match_end = TREGEX_ERROR_NOMEM;
+  (void)mem;
+
+  if (tregex_ctx_init(&ctx) && bcl)
+    match_end = tregex_match_ctx_run(&ctx, bcl, str, len);
+  tregex_ctx_free(&ctx);
+  tregex_cache_release(entry);
+
+  return match_end;
+}
+
+int tregex_search(const char *re, const char *str, tregex_byte_code_list *compiled, tregex_pool_ctx *mem, int *match_start) {
+  return tregex_search_n(re, str, strlen(str), compiled, mem, match_start);
+}
+
+int tregex_search_n(const char *re, const char *str, size_t len, tregex_byte_code_list *compiled, tregex_pool_ctx *mem, int *match_start) {
+  tregex_match_ctx ctx;
+  tregex_cache_entry *entry = compiled ? NULL : tregex_cache_acquire(re);
+  tregex_byte_code_list *bcl = entry ? entry->compiled : compiled;
+  int match_end = TREGEX_ERROR_NOMEM;
+  (void)mem;
+
+  if (tregex_ctx_init(&ctx) && bcl)
+    match_end = tregex_search_ctx_run(&ctx, bcl, str, len, match_start);
+  tregex_ctx_free(&ctx);
+  tregex_cache_release(entry);
+
+  return match_end;
+}
+
+tregex_matcher *tregex_matcher_create(void) {
+  tregex_matcher *matcher = malloc(sizeof(tregex_matcher));
+  if (!matcher) return NULL;
+  if (!tregex_ctx_init(&matcher->ctx)) {
+    tregex_matcher_destroy(matcher);
+    return NULL;
+  }
+  return matcher;
+}
+
+/* The thread stack, loop slots and undo log are kept between calls and only ever grow. */
+int tregex_matcher_match(tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len) {
+  return tregex_match_ctx_run(&matcher->ctx, compiled, str, len);
+}
+
+int tregex_matcher_search(tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len, int *match_start) {
+  return tregex_search_ctx_run(&matcher->ctx, compiled, str, len, match_start);
+}
+
+/*
+ * Fills groups[0, ngroups) with (start, end) offsets into `str`, {-1, -1}
+ * for groups that did not take part in the match. `compiled` should come
+ * from tregex_compile_groups; groups of other programs are never set.
+ */
+int tregex_matcher_match_groups(tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len, tregex_capture *groups, int ngroups) {
+  int match_end = tregex_match_ctx_run(&matcher->ctx, compiled, str, len);
+  if (match_end >= 0)
+    tregex_copy_groups(matcher->ctx.slots + compiled->loops, compiled->groups, 0, match_end, groups, ngroups);
+  return match_end;
+}
+
+int tregex_matcher_search_groups(tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len, tregex_capture *groups, int ngroups) {
+  int match_start = 0, match_end = tregex_search_ctx_run(&matcher->ctx, compiled, str, len, &match_start);
+  if (match_end >= 0)
+    tregex_copy_groups(matcher->ctx.slots + compiled->loops, compiled->groups, match_start, match_end, groups, ngroups);
+  return match_end;
+}
+
+void tregex_iter_init(tregex_iter *it, tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len) {
+  it->matcher = matcher;
+  it->code = compiled;
+  it->str = str;
+  it->len = len;
+  it->pos = 0;
+  it->warm = 0;
+}
+
+/*
+ * Stores the next match in `match` as a span of the subject and returns its
+ * end offset, or TREGEX_NOMATCH once there are no more. Anchors still see
+ * the whole subject. After an empty match the search resumes one byte later;
+ * after any other it resumes at the match end, where an empty match may
+ * follow. The memo table is reused across calls until another call on the
+ * matcher replaces it.
+ */
+int tregex_iter_next(tregex_iter *it, tregex_slice *match) {
+  tregex_match_ctx *ctx = &it->matcher->ctx;
+  int match_start = 0, match_end;
+  if (it->pos > it->len)
+    return TREGEX_NOMATCH;
+  match_end = tregex_search_ctx_from(ctx, it->code, it->str, it->len, (int)it->pos, &match_start, it->warm && ctx->memo_owner == it);
+  if (match_end < 0) {
+    it->pos = it->len + 1;
+    return match_end;
+  }
+  tregex_memo_forget(ctx, it->code, match_end);
+  ctx->memo_owner = it;
+  it->warm = 1;
+  match->str = it->str + match_start;
+  match->len = (size_t)(match_end - match_start);
+  it->pos = (size_t)match_end + (match_end == match_start);
+  return match_end;
+}
+
+/*
+ * Splits `str` around the matches of `compiled` into at most `max` fields,
+ * the last of which holds the rest of the subject unsplit. Returns the number
+ * of fields, or a negative error.
+ */
+int tregex_split(tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len, tregex_slice *fields, int max) {
+  tregex_iter it;
+  tregex_slice match;
+  size_t last = 0;
+  int n = 0, ret = TREGEX_NOMATCH;
+  if (max <= 0)
+    return 0;
+  tregex_iter_init(&it, matcher, compiled, str, len);
+  while (n + 1 < max && (ret = tregex_iter_next(&it, &match)) >= 0) {
+    fields[n].str = str + last;
+    fields[n++].len = (size_t)(match.str - str) - last;
+    last = (size_t)ret;
+  }
+  if (n + 1 < max && ret != TREGEX_NOMATCH)
+    return ret;
+  fields[n].str = str + last;
+  fields[n++].len = len - last;
+  return n;
+}
+
+/*
+ * Stores the first `max` matches of `compiled` in `tokens` and returns how
+ * many there are in all, or a negative error.
+ */
+int tregex_tokenize(tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len, tregex_slice *tokens, int max) {
+  tregex_iter it;
+  tregex_slice match;
+  int n = 0, ret;
+  tregex_iter_init(&it, matcher, compiled, str, len);
+  while ((ret = tregex_iter_next(&it, &match)) >= 0) {
+    if (n < max)
+      tokens[n] = match;
+    n++;
+  }
+  return ret == TREGEX_NOMATCH ? n : ret;
+}
+
+#ifdef TREGEX_STATS
+/* Every later call on `matcher` fills `stats`; NULL turns collection off. */
+void tregex_matcher_set_stats(tregex_matcher *matcher, tregex_stats *stats) {
+  matcher->ctx.stats = stats;
+}
+#endif
+
+/*
+ * Caps every later call on `matcher`: after `max_steps` backtracks it returns
+ * TREGEX_ERROR_BUDGET, after about `max_cycles` TSC cycles
+ * TREGEX_ERROR_TIMEOUT. Zero means no limit. Searches share one budget
+ * across all start positions.
+ */
+void tregex_matcher_set_budget(tregex_matcher *matcher, uint64_t max_steps, uint64_t max_cycles) {
+  matcher->ctx.max_steps = max_steps;
+  matcher->ctx.max_cycles = max_cycles;
+}
+
+void tregex_matcher_destroy(tregex_matcher *matcher) {
+  if (!matcher) return;
+  tregex_ctx_free(&matcher->ctx);
+  free(matcher);
+}
+
+static size_t tregex_pack_varint(uint8_t *out, size_t n, uint32_t v) {
+  for (; v >= 0x80; v >>= 7, n++)
+    if (out) out[n] = (uint8_t)(v | 0x80);
+  if (out) out[n] = (uint8_t)v;
+  return n + 1;
+}
+
+/*
+ * Encodes the instruction at `pc` into `out` at offset `n`, or only sizes it
+ * when `out` is NULL. `at` maps program pcs to packed offsets.
+ */
+static size_t tregex_pack_inst(const tregex_byte_code_list *bcl, int pc, const int *at, int threaded, uint8_t *out, size_t n) {
+  const tregex_byte_code *p = &bcl->code[pc], *memo = TREGEX_MEMO(bcl);
+  int op = FETCH_OPCODE(p);
+  if (out) {
+#ifdef USE_LABELS_AS_VALUES
+    if (threaded) {
+      out[n] = (uint8_t)tregex_packed_labels[op];
+      out[n + 1] = (uint8_t)((uint16_t)tregex_packed_labels[op] >> 8);
+    }
+    else
+#endif
+    out[n] = (uint8_t)op;
+  }
+  n += 1 + threaded;
+
+  switch (op) {
+  case PUSH:
+    return tregex_pack_varint(out, n, FETCH_OPARG_A(p));
+  case SAVE:
+    return tregex_pack_varint(out, n, bcl->loops + FETCH_OPARG_A(p));
+  case JMP:
+  case COUNT_NEXT:
+    return tregex_pack_varint(out, n, at[pc + FETCH_OPARG_A(p)]);
+  case SPLIT:
+  case REPEAT:
+    n = tregex_pack_varint(out, n, at[pc + FETCH_OPARG_A(p)]);
+    n = tregex_pack_varint(out, n, op == SPLIT ? at[pc + FETCH_OPARG_B(p)] : FETCH_OPARG_B(p));
+    n = tregex_pack_varint(out, n, memo[pc] + 1);
+    n = tregex_pack_varint(out, n, memo[pc + 1] + 1);
+    int counters = 0;
+    for (int c = memo[pc + 2]; c >= 0; c = memo[c])
+      counters++;
+    n = tregex_pack_varint(out, n, counters);
+    for (int c = memo[pc + 2]; c >= 0; c = memo[c]) {
+      n = tregex_pack_varint(out, n, FETCH_OPARG_A(&bcl->code[c]));
+      n = tregex_pack_varint(out, n, tregex_count_keys(&bcl->code[c]));
+    }
+    return n;
+  case COUNT:
+    n = tregex_pack_varint(out, n, FETCH_OPARG_A(p));
+    n = tregex_pack_varint(out, n, at[pc + FETCH_OPARG_B(p)]);
+    n = tregex_pack_varint(out, n, FETCH_OPARG_C(p));
+    return tregex_pack_varint(out, n, FETCH_OPARG_D(p) + 1);
+  case MATCH_STR:
+    n = tregex_pack_varint(out, n, FETCH_OPARG_A(p));
+    n = tregex_pack_varint(out, n, at[pc + OP_MATCH_STR_LEN + FETCH_OPARG_A(p) * OP_MATCH_LEN]);
+    if (out) memcpy(out + n, TREGEX_LITERALS(bcl) + FETCH_OPARG_B(p), FETCH_OPARG_A(p));
+    return n + FETCH_OPARG_A(p);
+  case MATCH:
+    if (out) out[n] = (uint8_t)FETCH_OPARG_A(p);
+    return n + 1;
+  case MATCH_SET:
+    if (out) out[n] = (uint8_t)FETCH_OPARG_A(p), out[n + 1] = (uint8_t)FETCH_OPARG_B(p);
+    return n + 2;
+  case MATCH_CLASS:
+    if (out) memcpy(out + n, FETCH_CLASS(p), CLASS_SIZE);
+    return n + CLASS_SIZE;
+  case LOOP:
+  case LOOP_SET:
+  case LOOP_CLASS:
+    if (op == LOOP_CLASS) {
+      if (out) memcpy(out + n, FETCH_CLASS(p), CLASS_SIZE);
+      n += CLASS_SIZE;
+    }
+    else {
+      if (out) out[n] = (uint8_t)FETCH_OPARG_A(p);
+      n++;
+      if (op == LOOP_SET) {
+        if (out) out[n] = (uint8_t)FETCH_OPARG_B(p);
+        n++;
+      }
+    }
+    n = tregex_pack_varint(out, n, LOOP_MIN(p));
+    return tregex_pack_varint(out, n, LOOP_MAX(p) + 1);
+  }
+  return n;
+}
+
+/*
+ * Re-encodes `compiled` for tregex_packed_match_n and tregex_packed_search_n:
+ * one-byte opcodes and literals and varint operands, and MATCH runs behind a
+ * MATCH_STR dropped when nothing jumps into them, which makes the program
+ * about four times smaller. `threaded` also replaces every opcode with the
+ * offset of its handler so dispatch skips the table lookup; it is ignored
+ * without USE_LABELS_AS_VALUES. `compiled` must outlive the result, which is
+ * read-only and released with free().
+ */
+tregex_packed *tregex_pack(const tregex_byte_code_list *compiled, int threaded) {
+  int len = (int)compiled->len, pc, changed = 1;
+  int *at = calloc((size_t)len + 1, sizeof(int));
+  uint8_t *target = calloc((size_t)len + 1, 1), *dropped = calloc((size_t)len + 1, 1);
+  tregex_packed *packed = NULL;
+  size_t n = 0;
+#ifdef USE_LABELS_AS_VALUES
+  threaded = threaded && tregex_packed_threadable;
+#else
+  threaded = 0;
+#endif
+  if (!at || !target || !dropped)
+    goto done;
+
+  for (pc = 0; pc < len; pc += op_len[FETCH_OPCODE(&compiled->code[pc])]) {
+    const tregex_byte_code *p = &compiled->code[pc];
+    switch (FETCH_OPCODE(p)) {
+    case SPLIT:
+      target[pc + FETCH_OPARG_B(p)] = 1;
+    case JMP:
+    case COUNT_NEXT:
+      target[pc + FETCH_OPARG_A(p)] = 1;
+      break;
+    case REPEAT:
+      target[pc + FETCH_OPARG_A(p)] = 1;
+      target[pc + OP_REPEAT_LEN] = 1;
+      break;
+    case COUNT:
+      target[pc + FETCH_OPARG_B(p)] = 1;
+      break;
+    }
+  }
+  for (pc = 0; pc < len; pc += op_len[FETCH_OPCODE(&compiled->code[pc])]) {
+    if (FETCH_OPCODE(&compiled->code[pc]) != MATCH_STR)
+      continue;
+    int first = pc + OP_MATCH_STR_LEN, end = first + FETCH_OPARG_A(&compiled->code[pc]) * OP_MATCH_LEN, m;
+    for (m = first; m < end && !target[m]; m += OP_MATCH_LEN)
+      ;
+    if (m == end)
+      memset(dropped + first, 1, end - first);
+  }
+
+  while (changed) {
+    changed = 0;
+    n = 0;
+    for (pc = 0; pc < len; pc += op_len[FETCH_OPCODE(&compiled->code[pc])]) {
+      if (at[pc] != (int)n)
+        at[pc] = (int)n, changed = 1;
+      if (!dropped[pc])
+        n = tregex_pack_inst(compiled, pc, at, threaded, NULL, n);
+    }
+    at[len] = (int)n;
+  }
+
+  if (!(packed = malloc(offsetof(tregex_packed, bytes) + n)))
+    goto done;
+  packed->code = compiled;
+  packed->len = n;
+  packed->threaded = threaded;
+  n = 0;
+  for (pc = 0; pc < len; pc += op_len[FETCH_OPCODE(&compiled->code[pc])])
+    if (!dropped[pc])
+      n = tregex_pack_inst(compiled, pc, at, threaded, packed->bytes, n);
+
+done:
+  free(at);
+  free(target);
+  free(dropped);
+  return packed;
+}
+
+int tregex_packed_match_n(tregex_matcher *matcher, const tregex_packed *packed, const char *str, size_t len) {
+  matcher->ctx.packed = packed;
+  int match_end = tregex_match_ctx_run(&matcher->ctx, packed->code, str, len);
+  matcher->ctx.packed = NULL;
+  return match_end;
+}
+
+int tregex_packed_search_n(tregex_matcher *matcher, const tregex_packed *packed, const char *str, size_t len, int *match_start) {
+  matcher->ctx.packed = packed;
+  int match_end = tregex_search_ctx_run(&matcher->ctx, packed->code, str, len, match_start);
+  matcher->ctx.packed = NULL;
+  return match_end;
+}
+
+#ifdef TREGEX_JIT
+/*
+ * x86-64 (System V) code generator for the backtracker. Registers:
+ *   rbx = str, r12 = len, r13 = idx, r14 = ctx
+ * Threads, loop slots and the undo log are the interpreter's own, so both
+ * engines share tregex_extend_stack/tregex_set_slot/tregex_rollback. A thread
+ * stores a bytecode pc; failing pops it and jumps through a pc -> address table.
+ */
+#define JIT_CTX(field)            ((int32_t)offsetof(tregex_match_ctx, field))
+
+static void jit_emit(tregex_jit_asm *a, const void *p, size_t n) {
+  if (a->len + n > a->cap) {
+    size_t cap = a->cap ? a->cap * 2 : 4096;
+    while (cap < a->len + n) cap *= 2;
+    uint8_t *buf = realloc(a->buf, cap);
+    if (!buf) {
+      a->ok = 0;
+      return;
+    }
+    a->buf = buf;
+    a->cap = cap;
+  }
+  memcpy(a->buf + a->len, p, n);
+  a->len += n;
+}
+
+#define JIT_BYTES(a, ...)         do { static const uint8_t b_[] = { __VA_ARGS__ }; jit_emit(a, b_, sizeof(b_)); } while (0)
+
+static void jit_u8(tregex_jit_asm *a, uint8_t v) { jit_emit(a, &v, 1); }
+static void jit_u16(tregex_jit_asm *a, uint16_t v) { jit_emit(a, &v, 2); }
+static void jit_u32(tregex_jit_asm *a, uint32_t v) { jit_emit(a, &v, 4); }
+static void jit_u64(tregex_jit_asm *a, uint64_t v) { jit_emit(a, &v, 8); }
+
+/* Appends a rel32 to native offset `target`, already emitted. */
+static void jit_rel_to(tregex_jit_asm *a, int target) {
+  jit_u32(a, (uint32_t)(target - (int)(a->len + 4)));
+}
+
+/* Appends a rel32 to bytecode `pc`, patched once every label is known. */
+static void jit_rel_pc(tregex_jit_asm *a, int pc) {
+  if (a->nfixups == a->fixups_size) {
+    int size = a->fixups_size ? a->fixups_size * 2 : 64;
+    int *fixup = realloc(a->fixup, 2 * size * sizeof(int));
+    if (!fixup) {
+      a->ok = 0;
+      return;
+    }
+    a->fixup = fixup;
+    a->fixups_size = size;
+  }
+  a->fixup[2 * a->nfixups] = (int)a->len;
+  a->fixup[2 * a->nfixups++ + 1] = pc;
+  jit_u32(a, 0);
+}
+
+/* Points the rel8 of the short jump ending at `from` to the current position. */
+static void jit_patch8(tregex_jit_asm *a, int from) {
+  if (a->ok)
+    a->buf[from - 1] = (uint8_t)(a->len - from);
+}
+
+/* Points the rel32 ending at `from` to the current position. */
+static void jit_patch32(tregex_jit_asm *a, int from) {
+  if (a->ok) {
+    int32_t rel = (int32_t)(a->len - from);
+    memcpy(a->buf + from - 4, &rel, 4);
+  }
+}
+
+static void jit_call(tregex_jit_asm *a, const void *fn) {
+  JIT_BYTES(a, 0x48, 0xb8);                       /* mov rax, imm64 */
+  jit_u64(a, (uint64_t)(uintptr_t)fn);
+  JIT_BYTES(a, 0xff, 0xd0);                       /* call rax */
+}
+
+/* jcc rel32 with condition `cc` (0x84 je, 0x85 jne, ...). */
+static void jit_jcc_to(tregex_jit_asm *a, uint8_t cc, int target) {
+  jit_u8(a, 0x0f);
+  jit_u8(a, cc);
+  jit_rel_to(a, target);
+}
+
+static void jit_jmp_pc(tregex_jit_asm *a, int pc) {
+  jit_u8(a, 0xe9);
+  jit_rel_pc(a, pc);
+}
+
+/* Pushes a backtrack thread resuming at `pc`. */
+static void jit_push_thread(tregex_jit_asm *a, int stub, int nomem, int pc) {
+  jit_u8(a, 0xbf);                                /* mov edi, pc */
+  jit_u32(a, (uint32_t)pc);
+  jit_u8(a, 0xe8);                                /* call push stub */
+  jit_rel_to(a, stub);
+  JIT_BYTES(a, 0x85, 0xc0);                       /* test eax, eax */
+  jit_jcc_to(a, 0x84, nomem);
+}
+
+static void jit_set_slot(tregex_jit_asm *a, int nomem, int slot) {
+  JIT_BYTES(a, 0x4c, 0x89, 0xf7);                 /* mov rdi, r14 */
+  jit_u8(a, 0xbe);                                /* mov esi, slot */
+  jit_u32(a, (uint32_t)slot);
+  JIT_BYTES(a, 0x44, 0x89, 0xea);                 /* mov edx, r13d */
+  jit_call(a, (const void *)tregex_set_slot);
+  JIT_BYTES(a, 0x85, 0xc0);                       /* test eax, eax */
+  jit_jcc_to(a, 0x84, nomem);
+}
+
+/* Calls a span kernel for the LOOP at `inst` and fails unless it took at least its minimum. */
+static void jit_span(tregex_jit_asm *a, int fail, const void *fn, const tregex_byte_code *inst) {
+  JIT_BYTES(a, 0x48, 0x89, 0xdf);                 /* mov rdi, rbx */
+  JIT_BYTES(a, 0x44, 0x89, 0xee);                 /* mov esi, r13d */
+  if (LOOP_MAX(inst) < 0) {
+    JIT_BYTES(a, 0x44, 0x89, 0xe2);               /* mov edx, r12d */
+  } else {
+    JIT_BYTES(a, 0x49, 0x8d, 0x95);               /* lea rdx, [r13 + max] */
+    jit_u32(a, (uint32_t)LOOP_MAX(inst));
+    JIT_BYTES(a, 0x4c, 0x39, 0xe2);               /* cmp rdx, r12 */
+    JIT_BYTES(a, 0x49, 0x0f, 0x4f, 0xd4);         /* cmovg rdx, r12 */
+  }
+  jit_call(a, fn);
+  JIT_BYTES(a, 0x48, 0x63, 0xc0);                 /* movsxd rax, eax */
+  if (LOOP_MIN(inst) == 1) {
+    JIT_BYTES(a, 0x4c, 0x39, 0xe8);               /* cmp rax, r13 */
+    jit_jcc_to(a, 0x84, fail);
+  } else if (LOOP_MIN(inst) > 1) {
+    JIT_BYTES(a, 0x48, 0x89, 0xc2);               /* mov rdx, rax */
+    JIT_BYTES(a, 0x4c, 0x29, 0xea);               /* sub rdx, r13 */
+    JIT_BYTES(a, 0x48, 0x81, 0xfa);               /* cmp rdx, min */
+    jit_u32(a, (uint32_t)LOOP_MIN(inst));
+    jit_jcc_to(a, 0x8c, fail);                    /* jl fail */
+  }
+  JIT_BYTES(a, 0x49, 0x89, 0xc5);                 /* mov r13, rax */
+}
+
+/*
+ * The visited-bitmap test of tregex_memo_seen for the SPLIT/REPEAT at `pc`,
+ * failing when its state was already explored. Counted loops need their
+ * counters, so those states go through tregex_memo_seen itself.
+ */
+static void jit_memo(tregex_jit_asm *a, int fail, const tregex_byte_code_list *bcl, int pc) {
+  const tregex_byte_code *memo = TREGEX_MEMO(bcl);
+  if (memo[pc] < 0)
+    return;
+  JIT_BYTES(a, 0x41, 0x83, 0xbe);                 /* cmp dword [r14 + memo], 0 */
+  jit_u32(a, JIT_CTX(memo));
+  jit_u8(a, 0);
+  JIT_BYTES(a, 0x74, 0x00);                       /* je done */
+  int off = (int)a->len, loop = -1;
+  if (memo[pc + 2] >= 0) {
+    JIT_BYTES(a, 0x4c, 0x89, 0xf7);               /* mov rdi, r14 */
+    JIT_BYTES(a, 0x48, 0xbe);                     /* mov rsi, memo */
+    jit_u64(a, (uint64_t)(uintptr_t)memo);
+    jit_u8(a, 0xba);                              /* mov edx, pc */
+    jit_u32(a, (uint32_t)pc);
+    JIT_BYTES(a, 0x44, 0x89, 0xe9);               /* mov ecx, r13d */
+    jit_call(a, (const void *)tregex_memo_seen);
+    JIT_BYTES(a, 0x85, 0xc0);                     /* test eax, eax */
+    jit_jcc_to(a, 0x85, fail);
+    jit_patch8(a, off);
+    return;
+  }
+  if (memo[pc + 1] >= 0) {
+    JIT_BYTES(a, 0x49, 0x8b, 0x86);               /* mov rax, [r14 + slots] */
+    jit_u32(a, JIT_CTX(slots));
+    JIT_BYTES(a, 0x44, 0x39, 0xa8);               /* cmp [rax + loop * 4], r13d */
+    jit_u32(a, (uint32_t)(memo[pc + 1] * sizeof(int)));
+    JIT_BYTES(a, 0x74, 0x00);                     /* je done */
+    loop = (int)a->len;
+  }
+  JIT_BYTES(a, 0x49, 0x8d, 0x44, 0x24, 0x01);     /* lea rax, [r12 + 1] */
+  JIT_BYTES(a, 0x48, 0x69, 0xc0);                 /* imul rax, rax, key */
+  jit_u32(a, (uint32_t)memo[pc]);
+  JIT_BYTES(a, 0x4c, 0x01, 0xe8,                  /* add rax, r13 */
+    0x48, 0x89, 0xc2,                             /* mov rdx, rax */
+    0x48, 0xc1, 0xea, 0x05,                       /* shr rdx, 5 */
+    0x83, 0xe0, 0x1f);                            /* and eax, 31 */
+  JIT_BYTES(a, 0x49, 0x8b, 0x8e);                 /* mov rcx, [r14 + visited] */
+  jit_u32(a, JIT_CTX(visited));
+  JIT_BYTES(a, 0x0f, 0xab, 0x04, 0x91);           /* bts [rcx + rdx * 4], eax */
+  jit_jcc_to(a, 0x82, fail);                      /* jc fail */
+  jit_patch8(a, off);
+  if (loop >= 0)
+    jit_patch8(a, loop);
+}
+
+static void jit_check_avail(tregex_jit_asm *a, int fail) {
+  JIT_BYTES(a, 0x4d, 0x39, 0xe5);                 /* cmp r13, r12 */
+  jit_jcc_to(a, 0x8d, fail);                      /* jge fail */
+}
+
+/* Compares `n` bytes at str + idx with the literal `lit`, 8 bytes at a time. */
+static void jit_match_str(tregex_jit_asm *a, int fail, const char *lit, int n) {
+  int off = 0;
+  JIT_BYTES(a, 0x4c, 0x89, 0xe0);                 /* mov rax, r12 */
+  JIT_BYTES(a, 0x4c, 0x29, 0xe8);                 /* sub rax, r13 */
+  JIT_BYTES(a, 0x48, 0x3d);                       /* cmp rax, n */
+  jit_u32(a, (uint32_t)n);
+  jit_jcc_to(a, 0x8c, fail);                      /* jl fail */
+  JIT_BYTES(a, 0x4a, 0x8d, 0x14, 0x2b);           /* lea rdx, [rbx + r13] */
+  for (; n - off >= 8; off += 8) {
+    uint64_t v;
+    memcpy(&v, lit + off, 8);
+    JIT_BYTES(a, 0x48, 0xb8);                     /* mov rax, imm64 */
+    jit_u64(a, v);
+    JIT_BYTES(a, 0x48, 0x39, 0x82);               /* cmp [rdx + off], rax */
+    jit_u32(a, (uint32_t)off);
+    jit_jcc_to(a, 0x85, fail);
+  }
+  if (n - off >= 4) {
+    uint32_t v;
+    memcpy(&v, lit + off, 4);
+    JIT_BYTES(a, 0x81, 0xba);                     /* cmp dword [rdx + off], imm32 */
+    jit_u32(a, (uint32_t)off);
+    jit_u32(a, v);
+    jit_jcc_to(a, 0x85, fail);
+    off += 4;
+  }
+  if (n - off >= 2) {
+    uint16_t v;
+    memcpy(&v, lit + off, 2);
+    JIT_BYTES(a, 0x66, 0x81, 0xba);               /* cmp word [rdx + off], imm16 */
+    jit_u32(a, (uint32_t)off);
+    jit_u16(a, v);
+    jit_jcc_to(a, 0x85, fail);
+    off += 2;
+  }
+  if (n - off) {
+    JIT_BYTES(a, 0x80, 0xba);                     /* cmp byte [rdx + off], imm8 */
+    jit_u32(a, (uint32_t)off);
+    jit_u8(a, (uint8_t)lit[off]);
+    jit_jcc_to(a, 0x85, fail);
+  }
+  JIT_BYTES(a, 0x49, 0x81, 0xc5);                 /* add r13, n */
+  jit_u32(a, (uint32_t)n);
+}
+
+static void jit_epilogue(tregex_jit_asm *a) {
+  JIT_BYTES(a,
+    0x48, 0x83, 0xc4, 0x08,                       /* add rsp, 8 */
+    0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b,
+    0xc3);
+}
+
+/* Emits the whole program; class tables are appended to `classes` (256 bytes each). */
+static void jit_program(tregex_jit_asm *a, const tregex_byte_code_list *bcl, int *class_at) {
+  const tregex_byte_code *pcode = bcl->code;
+  const char *literals = TREGEX_LITERALS(bcl);
+  int len = (int)bcl->len, nclasses = 0;
+
+  /* int fn(tregex_match_ctx *ctx, int start) */
+  JIT_BYTES(a,
+    0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,
+    0x48, 0x83, 0xec, 0x08,                       /* sub rsp, 8 */
+    0x49, 0x89, 0xfe,                             /* mov r14, rdi */
+    0x4c, 0x63, 0xee);                            /* movsxd r13, esi */
+  JIT_BYTES(a, 0x49, 0x8b, 0x9e);                 /* mov rbx, [r14 + str] */
+  jit_u32(a, JIT_CTX(str));
+  JIT_BYTES(a, 0x4d, 0x63, 0xa6);                 /* movsxd r12, [r14 + len] */
+  jit_u32(a, JIT_CTX(len));
+  JIT_BYTES(a, 0x41, 0xc7, 0x86);                 /* mov dword [r14 + undo_len], 0 */
+  jit_u32(a, JIT_CTX(undo_len));
+  jit_u32(a, 0);
+  jit_jmp_pc(a, 0);
+
+  int nomatch = (int)a->len;
+  jit_u8(a, 0xb8);                                /* mov eax, TREGEX_NOMATCH */
+  jit_u32(a, (uint32_t)TREGEX_NOMATCH);
+  jit_epilogue(a);
+  int nomem = (int)a->len;
+  jit_u8(a, 0xb8);                                /* mov eax, TREGEX_ERROR_NOMEM */
+  jit_u32(a, (uint32_t)TREGEX_ERROR_NOMEM);
+  jit_epilogue(a);
+
+  int budget = (int)a->len;                       /* eax = tregex_budget_check(ctx) */
+  JIT_BYTES(a, 0x4c, 0x89, 0xf7);                 /* mov rdi, r14 */
+  jit_call(a, (const void *)tregex_budget_check);
+  JIT_BYTES(a, 0x85, 0xc0,                        /* test eax, eax */
+    0x0f, 0x84);                                  /* jz budget_ok */
+  jit_u32(a, 0);
+  int budget_ok = (int)a->len;
+  jit_epilogue(a);
+
+  int fail = (int)a->len;
+  JIT_BYTES(a, 0x49, 0x83, 0xae);                 /* sub qword [r14 + steps], 1 */
+  jit_u32(a, JIT_CTX(steps));
+  jit_u8(a, 1);
+  jit_jcc_to(a, 0x82, budget);                    /* jb budget */
+  jit_patch32(a, budget_ok);
+  JIT_BYTES(a, 0x49, 0x8b, 0x86);                 /* mov rax, [r14 + top] */
+  jit_u32(a, JIT_CTX(top));
+  JIT_BYTES(a, 0x49, 0x3b, 0x86);                 /* cmp rax, [r14 + stack] */
+  jit_u32(a, JIT_CTX(stack));
+  jit_jcc_to(a, 0x84, nomatch);
+  JIT_BYTES(a, 0x48, 0x83, 0xe8, (uint8_t)sizeof(tregex_match_thread)); /* sub rax, sizeof thread */
+  JIT_BYTES(a, 0x49, 0x89, 0x86);                 /* mov [r14 + top], rax */
+  jit_u32(a, JIT_CTX(top));
+  JIT_BYTES(a, 0x4c, 0x63, 0x68, (uint8_t)offsetof(tregex_match_thread, idx)); /* movsxd r13, [rax + idx] */
+  JIT_BYTES(a, 0x8b, 0x70, (uint8_t)offsetof(tregex_match_thread, undo));      /* mov esi, [rax + undo] */
+  JIT_BYTES(a, 0x41, 0x3b, 0xb6);                 /* cmp esi, [r14 + undo_len] */
+  jit_u32(a, JIT_CTX(undo_len));
+  JIT_BYTES(a, 0x7d, 0x00);                       /* jge no_rollback */
+  int no_rollback = (int)a->len;
+  JIT_BYTES(a, 0x4c, 0x89, 0xf7);                 /* mov rdi, r14 */
+  jit_call(a, (const void *)tregex_rollback);
+  JIT_BYTES(a, 0x49, 0x8b, 0x86);                 /* mov rax, [r14 + top] */
+  jit_u32(a, JIT_CTX(top));
+  jit_patch8(a, no_rollback);
+  JIT_BYTES(a, 0x48, 0x63, 0x00);                 /* movsxd rax, [rax + pc] */
+  int dispatch = (int)a->len;                     /* jumps to pc rax */
+  JIT_BYTES(a, 0x48, 0xb9);                       /* mov rcx, dispatch table (patched) */
+  int table_imm = (int)a->len;
+  jit_u64(a, 0);
+  JIT_BYTES(a, 0xff, 0x24, 0xc1);                 /* jmp [rcx + rax * 8] */
+
+  /* Push stub: edi = pc. Returns eax = 0 when the stack cannot grow. */
+  int stub = (int)a->len;
+  JIT_BYTES(a, 0x49, 0x8b, 0x86);                 /* mov rax, [r14 + top] */
+  jit_u32(a, JIT_CTX(top));
+  JIT_BYTES(a, 0x49, 0x63, 0x96);                 /* movsxd rdx, [r14 + stack_size] */
+  jit_u32(a, JIT_CTX(stack_size));
+  JIT_BYTES(a, 0x48, 0x83, 0xea, 0x01,            /* sub rdx, 1 */
+    0x48, 0x6b, 0xd2, (uint8_t)sizeof(tregex_match_thread)); /* imul rdx, rdx, sizeof thread */
+  JIT_BYTES(a, 0x49, 0x03, 0x96);                 /* add rdx, [r14 + stack] */
+  jit_u32(a, JIT_CTX(stack));
+  JIT_BYTES(a, 0x48, 0x39, 0xd0,                  /* cmp rax, rdx */
+    0x72, 0x00);                                  /* jb room */
+  int room = (int)a->len;
+  JIT_BYTES(a, 0x57,                              /* push rdi */
+    0x4c, 0x89, 0xf7);                            /* mov rdi, r14 */
+  jit_call(a, (const void *)tregex_extend_stack);
+  JIT_BYTES(a, 0x5f,                              /* pop rdi */
+    0x85, 0xc0,                                   /* test eax, eax */
+    0x75, 0x01, 0xc3);                            /* jnz +1; ret */
+  jit_patch8(a, room);
+  JIT_BYTES(a, 0x49, 0x8b, 0x86);                 /* mov rax, [r14 + top] */
+  jit_u32(a, JIT_CTX(top));
+  JIT_BYTES(a, 0x89, 0x38);                       /* mov [rax + pc], edi */
+  JIT_BYTES(a, 0x44, 0x89, 0x68, (uint8_t)offsetof(tregex_match_thread, idx)); /* mov [rax + idx], r13d */
+  JIT_BYTES(a, 0x41, 0x8b, 0x8e);                 /* mov ecx, [r14 + undo_len] */
+  jit_u32(a, JIT_CTX(undo_len));
+  JIT_BYTES(a, 0x89, 0x48, (uint8_t)offsetof(tregex_match_thread, undo));      /* mov [rax + undo], ecx */
+  JIT_BYTES(a, 0x48, 0x83, 0xc0, (uint8_t)sizeof(tregex_match_thread)); /* add rax, sizeof thread */
+  JIT_BYTES(a, 0x49, 0x89, 0x86);                 /* mov [r14 + top], rax */
+  jit_u32(a, JIT_CTX(top));
+  JIT_BYTES(a, 0xb8, 0x01, 0x00, 0x00, 0x00, 0xc3); /* mov eax, 1; ret */
+
+  for (int pc = 0; pc < len; pc += op_len[FETCH_OPCODE(&pcode[pc])]) {
+    const tregex_byte_code *p = &pcode[pc];
+    a->label[pc] = (int)a->len;
+    switch (FETCH_OPCODE(p)) {
+    case HALT:
+      jit_u8(a, 0xe9);
+      jit_rel_to(a, nomatch);
+      break;
+    case PUSH:
+      jit_set_slot(a, nomem, FETCH_OPARG_A(p));
+      break;
+    case SAVE:
+      jit_set_slot(a, nomem, bcl->loops + FETCH_OPARG_A(p));
+      break;
+    case COUNT:
+    case COUNT_NEXT:
+      JIT_BYTES(a, 0x4c, 0x89, 0xf7);             /* mov rdi, r14 */
+      jit_u8(a, 0xbe);                            /* mov esi, pc */
+      jit_u32(a, (uint32_t)pc);
+      JIT_BYTES(a, 0x44, 0x89, 0xea);             /* mov edx, r13d */
+      jit_call(a, (const void *)tregex_count);
+      JIT_BYTES(a, 0x85, 0xc0);                   /* test eax, eax */
+      jit_jcc_to(a, 0x88, nomem);                 /* js nomem */
+      JIT_BYTES(a, 0x48, 0x98);                   /* cdqe */
+      jit_u8(a, 0xe9);                            /* jmp dispatch */
+      jit_rel_to(a, dispatch);
+      break;
+    case REPEAT:
+      jit_memo(a, fail, bcl, pc);
+      JIT_BYTES(a, 0x49, 0x8b, 0x86);             /* mov rax, [r14 + slots] */
+      jit_u32(a, JIT_CTX(slots));
+      JIT_BYTES(a, 0x44, 0x39, 0xa8);             /* cmp [rax + slot * 4], r13d */
+      jit_u32(a, (uint32_t)(FETCH_OPARG_B(p) * sizeof(int)));
+      JIT_BYTES(a, 0x0f, 0x84);                   /* je exit */
+      jit_rel_pc(a, pc + OP_REPEAT_LEN);
+      jit_push_thread(a, stub, nomem, pc + OP_REPEAT_LEN);
+      jit_set_slot(a, nomem, FETCH_OPARG_B(p));
+      jit_jmp_pc(a, pc + FETCH_OPARG_A(p));
+      break;
+    case LOOP:
+      jit_u8(a, 0xb9);                            /* mov ecx, c */
+      jit_u32(a, (uint32_t)(int)(char)FETCH_OPARG_A(p));
+      jit_span(a, fail, (const void *)tregex_span.span_char, p);
+      break;
+    case LOOP_SET:
+      jit_u8(a, 0xb9);                            /* mov ecx, left */
+      jit_u32(a, (uint32_t)(int)(char)FETCH_OPARG_A(p));
+      JIT_BYTES(a, 0x41, 0xb8);                   /* mov r8d, right */
+      jit_u32(a, (uint32_t)(int)(char)FETCH_OPARG_B(p));
+      jit_span(a, fail, (const void *)tregex_span.span_range, p);
+      break;
+    case LOOP_CLASS:
+      JIT_BYTES(a, 0x48, 0xb9);                   /* mov rcx, class */
+      jit_u64(a, (uint64_t)(uintptr_t)FETCH_CLASS(p));
+      jit_span(a, fail, (const void *)tregex_span.span_class, p);
+      break;
+    case MATCH:
+      jit_check_avail(a, fail);
+      JIT_BYTES(a, 0x42, 0x80, 0x3c, 0x2b);       /* cmp byte [rbx + r13], c */
+      jit_u8(a, (uint8_t)FETCH_OPARG_A(p));
+      jit_jcc_to(a, 0x85, fail);
+      JIT_BYTES(a, 0x49, 0xff, 0xc5);             /* inc r13 */
+      break;
+    case MATCH_SET:
+      jit_check_avail(a, fail);
+      JIT_BYTES(a, 0x42, 0x0f, 0xbe, 0x04, 0x2b); /* movsx eax, byte [rbx + r13] */
+      jit_u8(a, 0x3d);                            /* cmp eax, left */
+      jit_u32(a, (uint32_t)(int)(char)FETCH_OPARG_A(p));
+      jit_jcc_to(a, 0x8c, fail);                  /* jl fail */
+      jit_u8(a, 0x3d);                            /* cmp eax, right */
+      jit_u32(a, (uint32_t)(int)(char)FETCH_OPARG_B(p));
+      jit_jcc_to(a, 0x8f, fail);                  /* jg fail */
+      JIT_BYTES(a, 0x49, 0xff, 0xc5);             /* inc r13 */
+      break;
+    case MATCH_CLASS:
+      jit_check_avail(a, fail);
+      JIT_BYTES(a, 0x42, 0x0f, 0xb6, 0x04, 0x2b); /* movzx eax, byte [rbx + r13] */
+      JIT_BYTES(a, 0x48, 0xb9);                   /* mov rcx, table (patched) */
+      class_at[nclasses++] = (int)a->len;
+      jit_u64(a, 0);
+      JIT_BYTES(a, 0x80, 0x3c, 0x01, 0x00);       /* cmp byte [rcx + rax], 0 */
+      jit_jcc_to(a, 0x84, fail);
+      JIT_BYTES(a, 0x49, 0xff, 0xc5);             /* inc r13 */
+      break;
+    case MATCH_STR:
+      jit_match_str(a, fail, literals + FETCH_OPARG_B(p), FETCH_OPARG_A(p));
+      jit_jmp_pc(a, pc + OP_MATCH_STR_LEN + FETCH_OPARG_A(p) * OP_MATCH_LEN);
+      break;
+    case ANY:
+      jit_check_avail(a, fail);
+      JIT_BYTES(a, 0x49, 0xff, 0xc5);             /* inc r13 */
+      break;
+    case BEGIN:
+      JIT_BYTES(a, 0x4d, 0x85, 0xed);             /* test r13, r13 */
+      jit_jcc_to(a, 0x85, fail);
+      break;
+    case END:
+      JIT_BYTES(a, 0x4d, 0x39, 0xe5);             /* cmp r13, r12 */
+      jit_jcc_to(a, 0x85, fail);
+      break;
+    case SPLIT:
+      jit_memo(a, fail, bcl, pc);
+      jit_push_thread(a, stub, nomem, pc + FETCH_OPARG_B(p));
+      jit_jmp_pc(a, pc + FETCH_OPARG_A(p));
+      break;
+    case JMP:
+      jit_jmp_pc(a, pc + FETCH_OPARG_A(p));
+      break;
+    case ACCEPT:
+      JIT_BYTES(a, 0x44, 0x89, 0xe8);             /* mov eax, r13d */
+      jit_epilogue(a);
+      break;
+    }
+  }
+  class_at[nclasses] = table_imm;
+}
+
+static int tregex_jit_compile(tregex_jit *jit) {
+  const tregex_byte_code_list *bcl = jit->code;
+  tregex_jit_asm a = { 0 };
+  int nclasses = 0, ok = 0;
+  for (size_t pc = 0; pc < bcl->len; pc += op_len[FETCH_OPCODE(&bcl->code[pc])])
+    nclasses += FETCH_OPCODE(&bcl->code[pc]) == MATCH_CLASS;
+  int *class_at = malloc((nclasses + 1) * sizeof(int));
+  a.label = malloc(bcl->len * sizeof(int));
+  a.ok = class_at && a.label;
+  if (a.ok)
+    jit_program(&a, bcl, class_at);
+  if (!a.ok)
+    goto done;
+
+  /* Layout: code, dispatch table, one 256-byte membership table per class. */
+  size_t table = (a.len + 7) & ~(size_t)7, tables = table + bcl->len * sizeof(void *);
+  size_t page = 4096, size = (tables + (size_t)nclasses * 256 + page - 1) & ~(page - 1);
+  uint8_t *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    goto done;
+  memcpy(mem, a.buf, a.len);
+  for (int i = 0; i < a.nfixups; i++) {
+    int at = a.fixup[2 * i], target = a.label[a.fixup[2 * i + 1]];
+    int32_t rel = target - (at + 4);
+    memcpy(mem + at, &rel, 4);
+  }
+  void **dispatch = (void **)(mem + table);
+  for (size_t pc = 0; pc < bcl->len; pc += op_len[FETCH_OPCODE(&bcl->code[pc])])
+    dispatch[pc] = mem + a.label[pc];
+  memcpy(mem + class_at[nclasses], &dispatch, sizeof(dispatch));
+  int i = 0;
+  for (size_t pc = 0; pc < bcl->len; pc += op_len[FETCH_OPCODE(&bcl->code[pc])]) {
+    if (FETCH_OPCODE(&bcl->code[pc]) != MATCH_CLASS)
+      continue;
+    uint8_t *member = mem + tables + (size_t)i * 256;
+    for (int c = 0; c < 256; c++)
+      member[c] = (uint8_t)CLASS_HAS(FETCH_CLASS(&bcl->code[pc]), c);
+    memcpy(mem + class_at[i++], &member, sizeof(member));
+  }
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC)) {
+    munmap(mem, size);
+    goto done;
+  }
+  jit->mem = mem;
+  jit->mem_size = size;
+  jit->ctx.native = (int (*)(tregex_match_ctx *, int))(void *)mem;
+  ok = 1;
+
+done:
+  free(a.buf);
+  free(a.label);
+  free(a.fixup);
+  free(class_at);
+  return ok;
+}
+#endif
+
+/*
+ * Compiles `compiled` to native code where the JIT is available and otherwise
+ * keeps using the interpreter. `compiled` must outlive the returned object.
+ */
+tregex_jit *tregex_jit_create(const tregex_byte_code_list *compiled) {
+  tregex_jit *jit = calloc(1, sizeof(tregex_jit));
+  if (!jit) return NULL;
+  jit->code = compiled;
+  if (!tregex_ctx_init(&jit->ctx) || !tregex_reserve(&jit->ctx, compiled)) {
+    tregex_jit_destroy(jit);
+    return NULL;
+  }
+#ifdef TREGEX_JIT
+  tregex_jit_compile(jit);
+#endif
+  return jit;
+}
+
+int tregex_jit_match(tregex_jit *jit, const char *str) {
+  return tregex_jit_match_n(jit, str, strlen(str));
+}
+
+int tregex_jit_match_n(tregex_jit *jit, const char *str, size_t len) {
+  return tregex_match_ctx_run(&jit->ctx, jit->code, str, len);
+}
+
+int tregex_jit_search_n(tregex_jit *jit, const char *str, size_t len, int *match_start) {
+  return tregex_search_ctx_run(&jit->ctx, jit->code, str, len, match_start);
+}
+
+int tregex_jit_native(const tregex_jit *jit) {
+  return jit->ctx.native != NULL;
+}
+
+/* Same limits as tregex_matcher_set_budget, checked by the native code too. */
+void tregex_jit_set_budget(tregex_jit *jit, uint64_t max_steps, uint64_t max_cycles) {
+  jit->ctx.max_steps = max_steps;
+  jit->ctx.max_cycles = max_cycles;
+}
+
+void tregex_jit_destroy(tregex_jit *jit) {
+  if (!jit) return;
+#ifdef TREGEX_JIT
+  if (jit->mem)
+    munmap(jit->mem, jit->mem_size);
+#endif
+  tregex_ctx_free(&jit->ctx);
+  free(jit);
+}
+
+static int tregex_needs_unroll(const tregex_byte_code_list *bcl) {
+  for (size_t pc = 0; pc < bcl->len; pc += op_len[FETCH_OPCODE(&bcl->code[pc])]) {
+    const tregex_byte_code *p = &bcl->code[pc];
+    if (FETCH_OPCODE(p) == COUNT || (tregex_is_loop(FETCH_OPCODE(p)) && (LOOP_MIN(p) != 1 || LOOP_MAX(p) >= 0)))
+      return 1;
+  }
+  return 0;
+}
+
+/* Writes one byte of the LOOP at `p` as the MATCH it repeats. */
+static int tregex_unroll_single(const tregex_byte_code *p, tregex_byte_code *out, int n) {
+  int op = FETCH_OPCODE(p) == LOOP ? MATCH : FETCH_OPCODE(p) == LOOP_SET ? MATCH_SET : MATCH_CLASS;
+  if (out) {
+    memcpy(&out[n], p, op_len[op] * sizeof(*p));
+    SET_OPCODE(&out[n], op);
+  }
+  return n + op_len[op];
+}
+
+/*
+ * Appends [pc, end) of `code` at out[n] with every counted loop and bounded
+ * LOOP written out in full: `x{n,m}` becomes n copies of x and m - n nested
+ * optional ones, `x{n,}` n copies and a star. Returns the new length, -1 past
+ * MAX_UNROLL_SIZE; with `out` NULL it only measures. `map` holds where each
+ * pc of the current copy went, so copied jumps can be relocated.
+ */
+static int tregex_unroll_range(const tregex_byte_code *code, int pc, int end, tregex_byte_code *out, int n, int *map) {
+  int start = pc;
+  while (pc < end) {
+    const tregex_byte_code *p = &code[pc];
+    int op = FETCH_OPCODE(p), i;
+    if (n > MAX_UNROLL_SIZE)
+      return -1;
+    map[pc] = n;
+    if (op == COUNT) {
+      int body = pc + OP_COUNT_LEN, tail = pc + FETCH_OPARG_B(p) - OP_COUNT_NEXT_LEN;
+      int min = FETCH_OPARG_C(p), max = FETCH_OPARG_D(p), size = tregex_unroll_range(code, body, tail, NULL, 0, map);
+      if (size < 0 || (size_t)n + (size_t)(max < 0 ? min + 1 : max) * (size + OP_PUSH_LEN + OP_SPLIT_LEN + OP_REPEAT_LEN) > MAX_UNROLL_SIZE)
+        return -1;
+      for (i = 0; i < min; i++)
+        n = tregex_unroll_range(code, body, tail, out, n, map);
+      if (max < 0) {
+        if (out) {
+          SET_OP_A(&out[n], PUSH, FETCH_OPARG_A(p));
+          SET_OP_AB(&out[n + OP_PUSH_LEN], SPLIT, OP_SPLIT_LEN, OP_SPLIT_LEN + size + OP_REPEAT_LEN);
+        }
+        int split = n + OP_PUSH_LEN;
+        n = tregex_unroll_range(code, body, tail, out, split + OP_SPLIT_LEN, map);
+        if (out)
+          SET_OP_AB(&out[n], REPEAT, split - n, FETCH_OPARG_A(p));
+        n += OP_REPEAT_LEN;
+      } else {
+        int stop = n + (max - min) * (OP_SPLIT_LEN + size);
+        for (i = min; i < max; i++) {
+          if (out)
+            SET_OP_AB(&out[n], SPLIT, OP_SPLIT_LEN, stop - n);
+          n = tregex_unroll_range(code, body, tail, out, n + OP_SPLIT_LEN, map);
+        }
+      }
+      pc += FETCH_OPARG_B(p);
+      continue;
+    }
+    if (tregex_is_loop(op) && (LOOP_MIN(p) != 1 || LOOP_MAX(p) >= 0)) {
+      int min = LOOP_MIN(p), max = LOOP_MAX(p), l = op_len[op];
+      if ((size_t)n + (size_t)(max < 0 ? min + 1 : max) * (OP_SPLIT_LEN + l) > MAX_UNROLL_SIZE)
+        return -1;
+      for (i = max < 0 && min ? 1 : 0; i < min; i++)
+        n = tregex_unroll_single(p, out, n);
+      if (max < 0) {
+        if (!min) {
+          if (out)
+            SET_OP_AB(&out[n], SPLIT, OP_SPLIT_LEN, OP_SPLIT_LEN + l);
+          n += OP_SPLIT_LEN;
+        }
+        if (out) {
+          memcpy(&out[n], p, l * sizeof(*p));
+          LOOP_MIN(&out[n]) = 1;
+        }
+        n += l;
+      } else {
+        int stop = n + (max - min) * (OP_SPLIT_LEN + l - 2);
+        for (i = min; i < max; i++) {
+          if (out)
+            SET_OP_AB(&out[n], SPLIT, OP_SPLIT_LEN, stop - n);
+          n = tregex_unroll_single(p, out, n + OP_SPLIT_LEN);
+        }
+      }
+      pc += l;
+      continue;
+    }
+    if (out)
+      memcpy(&out[n], p, op_len[op] * sizeof(*p));
+    n += op_len[op];
+    pc += op_len[op];
+  }
+  map[end] = n;
+
+  for (pc = start; out && pc < end; pc += FETCH_OPCODE(&code[pc]) == COUNT ? FETCH_OPARG_B(&code[pc]) : op_len[FETCH_OPCODE(&code[pc])]) {
+    const tregex_byte_code *p = &code[pc];
+    tregex_byte_code *q = &out[map[pc]];
+    switch (FETCH_OPCODE(p)) {
+    case SPLIT:
+      SET_OPARG_B(q, map[pc + FETCH_OPARG_B(p)] - map[pc]);
+    case JMP:
+    case REPEAT:
+      SET_OPARG_A(q, map[pc + FETCH_OPARG_A(p)] - map[pc]);
+    }
+  }
+  return n;
+}
+
+/* Returns a copy of `bcl` without counters for the engines that run threads in lockstep. */
+static tregex_byte_code_list *tregex_unroll(const tregex_byte_code_list *bcl) {
+  int *map = malloc((bcl->len + 1) * sizeof(int)), len;
+  tregex_byte_code_list *unrolled = NULL;
+  if (map && (len = tregex_unroll_range(bcl->code, 0, (int)bcl->len, NULL, 0, map)) >= 0 &&
+      (unrolled = tregex_alloc_program((size_t)len, bcl->literals))) {
+    tregex_unroll_range(bcl->code, 0, (int)bcl->len, unrolled->code, 0, map);
+    memcpy(TREGEX_LITERALS(unrolled), TREGEX_LITERALS(bcl), bcl->literals);
+    unrolled->loops = bcl->loops;
+    unrolled->groups = bcl->groups;
+    unrolled->required_len = bcl->required_len;
+    unrolled->suffix_len = bcl->suffix_len;
+    memcpy(unrolled->required, bcl->required, sizeof(bcl->required));
+    memcpy(unrolled->suffix, bcl->suffix, sizeof(bcl->suffix));
+    tregex_build_memo(unrolled);
+  }
+  free(map);
+  return unrolled;
+}
+
+#define PIKE_LOOP_CONT(pc)        (~(pc))
+#define PIKE_IS_LOOP_CONT(t)      ((t) < 0)
+#define PIKE_THREAD_PC(t)         ((t) < 0 ? ~(t) : (t))
+#define PIKE_THREAD_SLOT(t)       ((t) < 0 ? ~(t) + 1 : (t))
+#define PIKE_PUSH(target, dd) \
+  (sp[0] = (target), sp[1] = (dd) < pike->depth[target] + 1 ? (dd) : pike->depth[target] + 1, sp += 2)
+
+static int tregex_pike_init(tregex_pike_ctx *pike, const tregex_byte_code_list *bcl) {
+  pike->unrolled = NULL;
+  if (tregex_needs_unroll(bcl) && !(bcl = pike->unrolled = tregex_unroll(bcl)))
+    return 0;
+  int len = (int)bcl->len, *depth = calloc(3 * ((size_t)len + 2), sizeof(int)), *base = depth + len + 2;
+  if (!depth) {
+    free(pike->unrolled);
+    return 0;
+  }
+  for (int pc = 0; pc < len; pc += op_len[FETCH_OPCODE(&bcl->code[pc])])
+    if (FETCH_OPCODE(&bcl->code[pc]) == REPEAT) {
+      depth[pc + FETCH_OPARG_A(&bcl->code[pc])]++;
+      depth[pc + OP_REPEAT_LEN]--;
+    }
+  for (int pc = 0; pc <= len; pc++) {
+    if (pc) depth[pc] += depth[pc - 1];
+    base[pc + 1] = base[pc] + depth[pc] + 1;
+  }
+
+  size_t slots = (size_t)base[len + 1];
+  int *buf = malloc((2 * (size_t)len + 2 * slots + 4 * slots + 2) * sizeof(int));
+  if (!buf) {
+    free(depth);
+    free(pike->unrolled);
+    return 0;
+  }
+  pike->code = bcl;
+  pike->depth = depth;
+  pike->base = base;
+  pike->mark = base + len + 2;
+  pike->gen = 0;
+  pike->list[0].threads = buf;
+  pike->list[1].threads = buf + len;
+  pike->list[0].mark = buf + 2 * len;
+  pike->list[1].mark = buf + 2 * len + slots;
+  pike->list[0].gen = pike->list[1].gen = 0;
+  pike->stack = buf + 2 * len + 2 * slots;
+  memset(pike->list[0].mark, 0, 2 * slots * sizeof(int));
+  return 1;
+}
+
+static void tregex_pike_free(tregex_pike_ctx *pike) {
+  free(pike->list[0].threads);
+  free(pike->depth);
+  free(pike->unrolled);
+}
+
+/*
+ * Loop progress is tracked per closure: `d` is the outermost loop depth whose
+ * current iteration started at this input position, depth[pc] + 1 if none did.
+ * A REPEAT reached with d <= its own depth closes an empty iteration and exits
+ * the loop, as the backtracking engine does. `c` is the lookahead byte, -1 at
+ * the end of input.
+ */
+static void tregex_pike_add_thread(tregex_pike_ctx *pike, tregex_pike_list *list, int t, int c, int at_begin) {
+  const tregex_byte_code *pcode = pike->code->code;
+  int *sp = pike->stack, pc, d;
+  sp[0] = t, sp[1] = pike->depth[PIKE_THREAD_PC(t)] + 1, sp += 2;
+  while (sp > pike->stack) {
+    sp -= 2;
+    t = sp[0], d = sp[1];
+    if (PIKE_IS_LOOP_CONT(t)) {
+      pc = PIKE_THREAD_PC(t);
+      if (list->mark[pike->base[pc + 1]] == list->gen)
+        continue;
+      list->mark[pike->base[pc + 1]] = list->gen;
+      if (c >= 0 && tregex_inst_match(&pcode[pc], c)) {
+        list->threads[list->count++] = t;
+        continue;
+      }
+      pc += op_len[FETCH_OPCODE(&pcode[pc])];
+      sp[0] = pc, sp[1] = pike->depth[pc] + 1, sp += 2;
+      continue;
+    }
+    pc = t;
+    int op = FETCH_OPCODE(&pcode[pc]), depth = pike->depth[pc];
+    if (op != PUSH && op != REPEAT && op != SPLIT && op != JMP && op != BEGIN && op != END && op != MATCH_STR && op != SAVE)
+      d = depth + 1;
+    if (list->mark[pike->base[pc] + d - 1] == list->gen)
+      continue;
+    list->mark[pike->base[pc] + d - 1] = list->gen;
+    switch (op) {
+    case HALT:
+      break;
+    case PUSH:
+      PIKE_PUSH(pc + OP_PUSH_LEN, d);
+      break;
+    case REPEAT:
+      if (d <= depth) {
+        PIKE_PUSH(pc + OP_REPEAT_LEN, d);
+        break;
+      }
+      PIKE_PUSH(pc + OP_REPEAT_LEN, d);
+      PIKE_PUSH(pc + FETCH_OPARG_A(&pcode[pc]), depth);
+      break;
+    case BEGIN:
+      if (at_begin)
+        PIKE_PUSH(pc + OP_BEGIN_LEN, d);
+      break;
+    case END:
+      if (c < 0)
+        PIKE_PUSH(pc + OP_END_LEN, d);
+      break;
+    case SPLIT:
+      PIKE_PUSH(pc + FETCH_OPARG_B(&pcode[pc]), d);
+      PIKE_PUSH(pc + FETCH_OPARG_A(&pcode[pc]), d);
+      break;
+    case JMP:
+      PIKE_PUSH(pc + FETCH_OPARG_A(&pcode[pc]), d);
+      break;
+    case MATCH_STR:
+      PIKE_PUSH(pc + OP_MATCH_STR_LEN, d);
+      break;
+    case SAVE:
+      PIKE_PUSH(pc + OP_SAVE_LEN, d);
+      break;
+    default:
+      list->threads[list->count++] = t;
+      break;
+    }
+  }
+}
+
+/* Steps thread `t` over byte `c`; returns 0 if it dies. */
+static int tregex_pike_consume(const tregex_byte_code *pcode, int t, int c, int *next) {
+  int pc = PIKE_THREAD_PC(t);
+  if (PIKE_IS_LOOP_CONT(t)) {
+    *next = t;
+    return 1;
+  }
+  switch (FETCH_OPCODE(&pcode[pc])) {
+  case LOOP:
+  case LOOP_SET:
+  case LOOP_CLASS:
+    *next = PIKE_LOOP_CONT(pc);
+    return tregex_inst_match(&pcode[pc], c);
+  case MATCH:
+  case MATCH_SET:
+  case MATCH_CLASS:
+  case ANY:
+    *next = pc + op_len[FETCH_OPCODE(&pcode[pc])];
+    return tregex_inst_match(&pcode[pc], c);
+  }
+  return 0;
+}
+
+static void tregex_pike_closure(tregex_pike_ctx *pike, const int *threads, int count, int c, int at_begin) {
+  tregex_pike_list *list = &pike->list[0];
+  list->count = 0;
+  list->gen++;
+  for (int i = 0; i < count; i++)
+    tregex_pike_add_thread(pike, list, threads[i], c, at_begin);
+}
+
+static int tregex_pike_accepting(const tregex_pike_ctx *pike) {
+  const tregex_byte_code *pcode = pike->code->code;
+  for (int i = 0; i < pike->list[0].count; i++)
+    if (FETCH_OPCODE(&pcode[PIKE_THREAD_PC(pike->list[0].threads[i])]) == ACCEPT && !PIKE_IS_LOOP_CONT(pike->list[0].threads[i]))
+      return 1;
+  return 0;
+}
+
+/*
+ * Consumes `c` from the closure in list[0] into `kernel` and returns its size.
+ * Threads behind the first ACCEPT are cut unless `accept` collects the ids of
+ * every ACCEPT reached; `*accepts` counts the ACCEPTs seen either way.
+ */
+static int tregex_pike_step(tregex_pike_ctx *pike, int c, int *kernel, int *accept, int *accepts) {
+  const tregex_byte_code *pcode = pike->code->code;
+  tregex_pike_list *list = &pike->list[0];
+  int count = 0, *mark = pike->mark;
+
+  *accepts = 0;
+  pike->gen++;
+  for (int i = 0; i < list->count; i++) {
+    int t = list->threads[i], next;
+    if (FETCH_OPCODE(&pcode[PIKE_THREAD_PC(t)]) == ACCEPT && !PIKE_IS_LOOP_CONT(t)) {
+      if (!accept) {
+        *accepts = 1;
+        break;
+      }
+      accept[(*accepts)++] = FETCH_OPARG_A(&pcode[PIKE_THREAD_PC(t)]);
+      continue;
+    }
+    if (tregex_pike_consume(pcode, t, c, &next) && mark[PIKE_THREAD_SLOT(next)] != pike->gen) {
+      mark[PIKE_THREAD_SLOT(next)] = pike->gen;
+      kernel[count++] = next;
+    }
+  }
+  return count;
+}
+
+static int tregex_pike_execute(tregex_pike_ctx *pike) {
+  const tregex_byte_code *pcode = pike->code->code;
+  tregex_pike_list *clist = &pike->list[0], *nlist = &pike->list[1], *tmp;
+  int match_end = -1;
+
+  clist->count = 0;
+  clist->gen++;
+  tregex_pike_add_thread(pike, clist, 0, pike->len > 0 ? (unsigned char)pike->str[0] : -1, 1);
+
+  for (int idx = 0; clist->count; idx++) {
+    int c = idx + 1 < pike->len ? (unsigned char)pike->str[idx + 1] : -1;
+    nlist->count = 0;
+    nlist->gen++;
+    for (int i = 0; i < clist->count; i++) {
+      int t = clist->threads[i], next;
+      if (FETCH_OPCODE(&pcode[PIKE_THREAD_PC(t)]) == ACCEPT && !PIKE_IS_LOOP_CONT(t)) {
+        match_end = idx;
+        break;
+      }
+      if (idx < pike->len && tregex_pike_consume(pcode, t, (unsigned char)pike->str[idx], &next))
+        tregex_pike_add_thread(pike, nlist, next, c, 0);
+    }
+    if (idx >= pike->len)
+      break;
+    tmp = clist, clist = nlist, nlist = tmp;
+  }
+
+  return match_end;
+}
+
+/* Like tregex_pike_execute, but runs every thread to the end and records each ACCEPT id reached. */
+static int tregex_pike_execute_set(tregex_pike_ctx *pike, uint64_t *matched) {
+  const tregex_byte_code *pcode = pike->code->code;
+  tregex_pike_list *clist = &pike->list[0], *nlist = &pike->list[1], *tmp;
+  int n = 0;
+
+  clist->count = 0;
+  clist->gen++;
+  tregex_pike_add_thread(pike, clist, 0, pike->len > 0 ? (unsigned char)pike->str[0] : -1, 1);
+
+  for (int idx = 0; clist->count; idx++) {
+    int c = idx + 1 < pike->len ? (unsigned char)pike->str[idx + 1] : -1;
+    nlist->count = 0;
+    nlist->gen++;
+    for (int i = 0; i < clist->count; i++) {
+      int t = clist->threads[i], next;
+      if (FETCH_OPCODE(&pcode[PIKE_THREAD_PC(t)]) == ACCEPT && !PIKE_IS_LOOP_CONT(t)) {
+        int id = FETCH_OPARG_A(&pcode[PIKE_THREAD_PC(t)]);
+        if (!(matched[id >> 6] & (1ull << (id & 63))))
+          matched[id >> 6] |= 1ull << (id & 63), n++;
+        continue;
+      }
+      if (idx < pike->len && tregex_pike_consume(pcode, t, (unsigned char)pike->str[idx], &next))
+        tregex_pike_add_thread(pike, nlist, next, c, 0);
+    }
+    if (idx >= pike->len)
+      break;
+    tmp = clist, clist = nlist, nlist = tmp;
+  }
+
+  return n;
+}
+
+int tregex_pike_match(const char *re, const char *str, tregex_byte_code_list *compiled) {
+  return tregex_pike_match_n(re, str, strlen(str), compiled);
+}
+
+int tregex_pike_match_n(const char *re, const char *str, size_t len, tregex_byte_code_list *compiled) {
+  if (len > INT_MAX)
+    return TREGEX_ERROR_TOOLONG;
+  tregex_pike_ctx pike = { 0 };
+  tregex_cache_entry *entry = compiled ? NULL : tregex_cache_acquire(re);
+  tregex_byte_code_list *bcl = entry ? entry->compiled : compiled;
+
+  if (!bcl) return TREGEX_ERROR_NOMEM;
+  if (!tregex_required_found(bcl, str, len)) {
+    tregex_cache_release(entry);
+    return TREGEX_NOMATCH;
+  }
+  if (!tregex_pike_init(&pike, bcl)) {
+    tregex_cache_release(entry);
+    return TREGEX_ERROR_NOMEM;
+  }
+
+  pike.str = str;
+  pike.len = (int)len;
+  int match_end = tregex_pike_execute(&pike);
+  tregex_pike_free(&pike);
+  tregex_cache_release(entry);
+
+  return match_end;
+}
+
+static void tregex_dfa_flush(tregex_dfa *dfa) {
+  memset(dfa->table, 0, dfa->table_size * sizeof(*dfa->table));
+  dfa->used = 0;
+  dfa->nstates = 0;
+  dfa->flushes++;
+  dfa->start = NULL;
+}
+
+static tregex_dfa_state *tregex_dfa_lookup(tregex_dfa *dfa, int flags, const int *threads, int count, const int *accept, int accepts) {
+  uint32_t hash = 2166136261u ^ (uint32_t)flags;
+  for (int i = 0; i < count; i++)
+    hash = (hash ^ (uint32_t)threads[i]) * 16777619u;
+  for (int i = 0; i < accepts; i++)
+    hash = (hash ^ (uint32_t)~accept[i]) * 16777619u;
+
+  size_t mask = dfa->table_size - 1, h = hash & mask;
+  for (tregex_dfa_state *s; (s = dfa->table[h]); h = (h + 1) & mask)
+    if (s->flags == flags && s->count == count && s->accepts == accepts &&
+      !memcmp(s->threads, threads, count * sizeof(int)) &&
+      !memcmp(s->threads + count, accept, accepts * sizeof(int)))
+      return s;
+
+  size_t size = sizeof(tregex_dfa_state) + dfa->nclasses * sizeof(tregex_dfa_state *) + ((size_t)count + accepts) * sizeof(int);
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if (dfa->used + size > DFA_CACHE_SIZE || 2 * (dfa->nstates + 1) > dfa->table_size) {
+    tregex_dfa_flush(dfa);
+    h = hash & mask;
+  }
+
+  tregex_dfa_state *s = (tregex_dfa_state *)(dfa->arena + dfa->used);
+  dfa->used += size;
+  dfa->nstates++;
+  memset(s, 0, size);
+  s->flags = flags;
+  s->eof = -1;
+  s->count = count;
+  s->accepts = accepts;
+  s->threads = (int *)&s->next[dfa->nclasses];
+  memcpy(s->threads, threads, count * sizeof(int));
+  memcpy(s->threads + count, accept, accepts * sizeof(int));
+  dfa->table[h] = s;
+  return s;
+}
+
+static tregex_dfa_state *tregex_dfa_start(tregex_dfa *dfa) {
+  if (!dfa->start) {
+    int start = 0;
+    dfa->start = tregex_dfa_lookup(dfa, DFA_BEGIN, &start, 1, NULL, 0);
+  }
+  return dfa->start;
+}
+
+static void tregex_dfa_closure(tregex_dfa *dfa, const tregex_dfa_state *s, int c) {
+  tregex_pike_closure(&dfa->pike, s->threads, s->count, c, s->flags & DFA_BEGIN);
+}
+
+static tregex_dfa_state *tregex_dfa_transition(tregex_dfa *dfa, tregex_dfa_state *s, int c) {
+  int *kernel = dfa->pike.list[1].threads, count, accepts, flags;
+
+  tregex_dfa_closure(dfa, s, c);
+  count = tregex_pike_step(&dfa->pike, c, kernel, dfa->set ? dfa->accept : NULL, &accepts);
+  flags = (accepts ? DFA_MATCH : 0) | (count ? 0 : DFA_DEAD);
+
+  size_t flushes = dfa->flushes;
+  tregex_dfa_state *ns = tregex_dfa_lookup(dfa, flags, kernel, count, dfa->accept, dfa->set ? accepts : 0);
+  if (dfa->flushes == flushes)
+    s->next[dfa->bytemap[c]] = ns;
+  return ns;
+}
+
+static int tregex_dfa_eof(tregex_dfa *dfa, tregex_dfa_state *s) {
+  if (s->eof < 0) {
+    tregex_dfa_closure(dfa, s, -1);
+    s->eof = tregex_pike_accepting(&dfa->pike);
+  }
+  return s->eof;
+}
+
+static void tregex_dfa_set_class(unsigned char *bytemap, int *nclasses, const uint8_t *member) {
+  int remap[512];
+  memset(remap, -1, sizeof(remap));
+  int n = 0;
+  for (int c = 0; c < 256; c++) {
+    int key = bytemap[c] * 2 + member[c];
+    if (remap[key] < 0)
+      remap[key] = n++;
+    bytemap[c] = (unsigned char)remap[key];
+  }
+  *nclasses = n;
+}
+
+tregex_dfa *tregex_dfa_create(const tregex_byte_code_list *compiled) {
+  tregex_dfa *dfa = calloc(1, sizeof(tregex_dfa));
+  if (!dfa) return NULL;
+  if (!tregex_pike_init(&dfa->pike, compiled)) {
+    free(dfa);
+    return NULL;
+  }
+  dfa->code = compiled = dfa->pike.code;
+  dfa->nclasses = 1;
+
+  const tregex_byte_code *pcode = compiled->code;
+  for (int pc = 0; pc < (int)compiled->len; pc += op_len[FETCH_OPCODE(&pcode[pc])]) {
+    uint8_t member[256];
+    int op = FETCH_OPCODE(&pcode[pc]), next;
+    if (op != LOOP && op != LOOP_SET && op != LOOP_CLASS && op != MATCH && op != MATCH_SET && op != MATCH_CLASS)
+      continue;
+    for (int c = 0; c < 256; c++)
+      member[c] = (uint8_t)tregex_pike_consume(pcode, pc, c, &next);
+    tregex_dfa_set_class(dfa->bytemap, &dfa->nclasses, member);
+  }
+
+  size_t max_state = sizeof(tregex_dfa_state) + dfa->nclasses * sizeof(tregex_dfa_state *) + 2 * compiled->len * sizeof(int);
+  if (max_state * 16 > DFA_CACHE_SIZE) {
+    tregex_dfa_destroy(dfa);
+    return NULL;
+  }
+  dfa->table_size = 2;
+  while (dfa->table_size < 2 * DFA_CACHE_SIZE / (sizeof(tregex_dfa_state) + dfa->nclasses * sizeof(tregex_dfa_state *)))
+    dfa->table_size *= 2;
+  dfa->table = calloc(dfa->table_size, sizeof(*dfa->table));
+  dfa->arena = malloc(DFA_CACHE_SIZE);
+  dfa->accept = malloc(compiled->len * sizeof(int));
+  if (!dfa->table || !dfa->arena || !dfa->accept) {
+    tregex_dfa_destroy(dfa);
+    return NULL;
+  }
+  return dfa;
+}
+
+void tregex_dfa_destroy(tregex_dfa *dfa) {
+  if (!dfa) return;
+  tregex_pike_free(&dfa->pike);
+  free(dfa->table);
+  free(dfa->arena);
+  free(dfa->accept);
+  free(dfa);
+}
+
+int tregex_dfa_match(tregex_dfa *dfa, const char *str) {
+  return tregex_dfa_match_n(dfa, str, strlen(str));
+}
+
+int tregex_dfa_match_n(tregex_dfa *dfa, const char *str, size_t len) {
+  const unsigned char *p = (const unsigned char *)str;
+  tregex_dfa_state *s, *ns;
+  int match_end = -1, idx = 0;
+
+  if (len > INT_MAX)
+    return TREGEX_ERROR_TOOLONG;
+  if (!tregex_required_found(dfa->code, str, len))
+    return TREGEX_NOMATCH;
+  s = tregex_dfa_start(dfa);
+
+  for (; idx < (int)len; idx++) {
+    if (!(ns = s->next[dfa->bytemap[p[idx]]]))
+      ns = tregex_dfa_transition(dfa, s, p[idx]);
+    s = ns;
+    if (s->flags & (DFA_MATCH | DFA_DEAD)) {
+      if (s->flags & DFA_MATCH)
+        match_end = idx;
+      if (s->flags & DFA_DEAD)
+        return match_end;
+    }
+  }
+  if (tregex_dfa_eof(dfa, s))
+    match_end = idx;
+
+  return match_end;
+}
+
+static int tregex_dfa_set_add(const tregex_dfa_state *s, uint64_t *matched) {
+  int n = 0;
+  for (int i = 0; i < s->accepts; i++) {
+    int id = s->threads[s->count + i];
+    if (!(matched[id >> 6] & (1ull << (id & 63))))
+      matched[id >> 6] |= 1ull << (id & 63), n++;
+  }
+  return n;
+}
+
+static int tregex_dfa_match_set(tregex_dfa *dfa, const char *str, size_t len, uint64_t *matched) {
+  const unsigned char *p = (const unsigned char *)str, *end = p + len;
+  tregex_dfa_state *s = tregex_dfa_start(dfa), *ns;
+  int n = 0;
+
+  for (; p < end; p++) {
+    if (!(ns = s->next[dfa->bytemap[*p]]))
+      ns = tregex_dfa_transition(dfa, s, *p);
+    s = ns;
+    if (s->flags & (DFA_MATCH | DFA_DEAD)) {
+      if (s->flags & DFA_MATCH)
+        n += tregex_dfa_set_add(s, matched);
+      if (s->flags & DFA_DEAD)
+        return n;
+    }
+  }
+  if (tregex_dfa_eof(dfa, s)) {
+    const tregex_byte_code *pcode = dfa->code->code;
+    tregex_pike_list *list = &dfa->pike.list[0];
+    tregex_dfa_closure(dfa, s, -1);
+    for (int i = 0; i < list->count; i++) {
+      int t = list->threads[i];
+      if (FETCH_OPCODE(&pcode[PIKE_THREAD_PC(t)]) == ACCEPT && !PIKE_IS_LOOP_CONT(t)) {
+        int id = FETCH_OPARG_A(&pcode[PIKE_THREAD_PC(t)]);
+        if (!(matched[id >> 6] & (1ull << (id & 63))))
+          matched[id >> 6] |= 1ull << (id & 63), n++;
+      }
+    }
+  }
+
+  return n;
+}
+
+/*
+ * Walks the program from `pc` in backtracking priority order with lookahead
+ * `c` (-1 at the end of input). The first consumer taking `c` gives the
+ * transition; an ACCEPT before it ends the match and one after it is kept as
+ * the fallback should the thread die later. Since visiting a pc again at the
+ * same position can only fail again, each pc is walked once. A second
+ * consumer taking `c` would need backtracking, so the program is rejected.
+ */
+static int tregex_onepass_fill(const tregex_byte_code_list *bcl, const int *root_of, int pc, int begin, int c,
+                               int *stack, uint64_t *masks, uint8_t *visited, tregex_onepass_action *act) {
+  int sp = 0, consumed = 0;
+  memset(visited, 0, bcl->len);
+  memset(act, 0, sizeof(*act));
+  act->next = ONEPASS_FAIL;
+  stack[sp] = pc;
+  masks[sp++] = 0;
+  while (sp > 0) {
+    uint64_t mask = masks[--sp];
+    const tregex_byte_code *p = &bcl->code[pc = stack[sp]];
+    if (visited[pc]) continue;
+    visited[pc] = 1;
+    switch (FETCH_OPCODE(p)) {
+    case HALT:
+      break;
+    case ACCEPT:
+      if (consumed) {
+        act->fallback = 1;
+        act->fallback_save = mask;
+      } else {
+        act->next = ONEPASS_ACCEPT;
+        act->save = mask;
+      }
+      return 1;
+    case SAVE:
+      stack[sp] = pc + OP_SAVE_LEN;
+      masks[sp++] = mask | (uint64_t)1 << FETCH_OPARG_A(p);
+      break;
+    case BEGIN:
+      if (!begin) break;
+      stack[sp] = pc + OP_BEGIN_LEN;
+      masks[sp++] = mask;
+      break;
+    case END:
+      if (c >= 0) break;
+      stack[sp] = pc + OP_END_LEN;
+      masks[sp++] = mask;
+      break;
+    case MATCH_STR:
+      stack[sp] = pc + OP_MATCH_STR_LEN;
+      masks[sp++] = mask;
+      break;
+    case SPLIT:
+      stack[sp] = pc + FETCH_OPARG_B(p);
+      masks[sp++] = mask;
+    case JMP:
+      stack[sp] = pc + FETCH_OPARG_A(p);
+      masks[sp++] = mask;
+      break;
+    default:
+      if (c < 0 || !tregex_inst_match(p, c))
+        break;
+      if (consumed++)
+        return 0;
+      act->next = root_of[2 * pc + tregex_is_loop(FETCH_OPCODE(p))];
+      act->save = mask;
+      break;
+    }
+  }
+  return 1;
+}
+
+/*
+ * A one-pass program never has two live threads: at every position and byte
+ * at most one consumer can go on, so matching is a single table walk. Roots
+ * are where the thread can stand between bytes: the start, after each single
+ * byte consumer, and inside each possessive LOOP. Each row holds, per byte
+ * class and for the end of input, where to go and which captures to set.
+ * Returns NULL when the program is not one-pass or has loops with progress
+ * checks.
+ */
+tregex_onepass *tregex_onepass_create(const tregex_byte_code_list *compiled) {
+  tregex_onepass *onepass = calloc(1, sizeof(tregex_onepass));
+  if (!onepass || (tregex_needs_unroll(compiled) && !(compiled = onepass->unrolled = tregex_unroll(compiled)))) {
+    free(onepass);
+    return NULL;
+  }
+  const tregex_byte_code *code = compiled->code;
+  int len = (int)compiled->len, ok = compiled->groups <= MAX_ONEPASS_GROUPS, pc, rep[256];
+  int *root_of = malloc(2 * len * sizeof(int)), *keys = malloc((2 * len + 1) * sizeof(int));
+  int *stack = malloc((2 * len + 1) * sizeof(int));
+  uint64_t *masks = malloc((2 * len + 1) * sizeof(uint64_t));
+  uint8_t *visited = malloc(len);
+  if (!root_of || !keys || !stack || !masks || !visited)
+    ok = 0;
+
+  if (ok) {
+    onepass->code = compiled;
+    onepass->nclasses = 1;
+    onepass->nroots = 1;
+    keys[0] = -1;
+  }
+  for (pc = 0; ok && pc < len; pc += op_len[FETCH_OPCODE(&code[pc])]) {
+    int op = FETCH_OPCODE(&code[pc]);
+    uint8_t member[256];
+    if (op == PUSH || op == REPEAT)
+      ok = 0;
+    if (op != MATCH && op != MATCH_SET && op != MATCH_CLASS && op != ANY && !tregex_is_loop(op))
+      continue;
+    for (int c = 0; c < 256; c++)
+      member[c] = (uint8_t)tregex_inst_match(&code[pc], c);
+    tregex_dfa_set_class(onepass->bytemap, &onepass->nclasses, member);
+    root_of[2 * pc + tregex_is_loop(op)] = onepass->nroots;
+    keys[onepass->nroots++] = 2 * pc + tregex_is_loop(op);
+  }
+  for (int c = 255; c >= 0; c--)
+    rep[onepass->bytemap[c]] = c;
+
+  int cols = onepass->nclasses + 1;
+  if (ok && !(onepass->table = malloc((size_t)onepass->nroots * cols * sizeof(tregex_onepass_action))))
+    ok = 0;
+  for (int r = 0; ok && r < onepass->nroots; r++) {
+    const tregex_byte_code *p = keys[r] < 0 ? NULL : &code[keys[r] >> 1];
+    int loop = p && (keys[r] & 1), start = p ? (keys[r] >> 1) + op_len[FETCH_OPCODE(p)] : 0;
+    for (int k = 0; ok && k < cols; k++) {
+      tregex_onepass_action *act = &onepass->table[r * cols + k];
+      int c = k < onepass->nclasses ? rep[k] : -1;
+      if (loop && c >= 0 && tregex_inst_match(p, c)) {
+        memset(act, 0, sizeof(*act));
+        act->next = r;
+      } else {
+        ok = tregex_onepass_fill(compiled, root_of, start, keys[r] < 0, c, stack, masks, visited, act);
+      }
+    }
+  }
+
+  free(root_of);
+  free(keys);
+  free(stack);
+  free(masks);
+  free(visited);
+  if (!ok) {
+    tregex_onepass_destroy(onepass);
+    return NULL;
+  }
+  return onepass;
+}
+
+static void tregex_onepass_save(int *caps, int ncaps, uint64_t mask, int idx) {
+  for (int i = 2; mask && i < ncaps; i++)
+    if (mask >> i & 1)
+      caps[i] = idx;
+}
+
+/* Matches at the start of `str` like tregex_match_n and fills `groups` like tregex_matcher_match_groups. */
+int tregex_onepass_match_n(const tregex_onepass *onepass, const char *str, size_t len, tregex_capture *groups, int ngroups) {
+  const unsigned char *p = (const unsigned char *)str;
+  int caps[2 * (MAX_ONEPASS_GROUPS + 1)], best[2 * (MAX_ONEPASS_GROUPS + 1)];
+  int ncaps = 2 * (onepass->code->groups + 1), cols = onepass->nclasses + 1, root = 0, match_end = TREGEX_NOMATCH;
+  for (int i = 0; i < ncaps; i++)
+    caps[i] = -1;
+  if (len > INT_MAX)
+    return TREGEX_ERROR_TOOLONG;
+
+  for (int idx = 0;; idx++) {
+    const tregex_onepass_action *act = &onepass->table[root * cols + (idx < (int)len ? onepass->bytemap[p[idx]] : onepass->nclasses)];
+    if (act->fallback) {
+      memcpy(best, caps, ncaps * sizeof(int));
+      tregex_onepass_save(best, ncaps, act->fallback_save, idx);
+      match_end = idx;
+    }
+    tregex_onepass_save(caps, ncaps, act->save, idx);
+    if (act->next == ONEPASS_ACCEPT) {
+      memcpy(best, caps, ncaps * sizeof(int));
+      match_end = idx;
+    }
+    if (act->next < 0)
+      break;
+    root = act->next;
+  }
+  if (match_end >= 0)
+    tregex_copy_groups(best, onepass->code->groups, 0, match_end, groups, ngroups);
+  return match_end;
+}
+
+void tregex_onepass_destroy(tregex_onepass *onepass) {
+  if (!onepass) return;
+  free(onepass->table);
+  free(onepass->unrolled);
+  free(onepass);
+}
+
+/*
+ * All patterns share one program: a chain of SPLITs tries each pattern in
+ * turn and every pattern ends in an ACCEPT carrying its index.
+ */
+tregex_set *tregex_set_compile(const char *const *res, int count) {
+  if (count <= 0) return NULL;
+  tregex_set *set = calloc(1, sizeof(tregex_set));
+  tregex_byte_code_list **parts = calloc(count, sizeof(*parts));
+  size_t len = 0, literals = 0;
+  if (!set || !parts)
+    goto fail;
+  for (int i = 0; i < count; i++) {
+    if (!(parts[i] = tregex_compile(res[i])))
+      goto fail;
+    len += parts[i]->len + (i + 1 < count ? OP_SPLIT_LEN : 0);
+    literals += parts[i]->literals;
+  }
+
+  set->count = count;
+  if (!(set->code = tregex_alloc_program(len, literals)))
+    goto fail;
+  tregex_byte_code *cur = set->code->code;
+  char *lit = TREGEX_LITERALS(set->code);
+  for (int i = 0; i < count; i++) {
+    int lit_base = (int)(lit - TREGEX_LITERALS(set->code)), loop_base = set->code->loops;
+    if (i + 1 < count) {
+      SET_OP_AB(cur, SPLIT, OP_SPLIT_LEN, OP_SPLIT_LEN + (int)parts[i]->len);
+      STEP_OP_AB(cur);
+    }
+    memcpy(cur, parts[i]->code, parts[i]->len * sizeof(tregex_byte_code));
+    memcpy(lit, TREGEX_LITERALS(parts[i]), parts[i]->literals);
+    for (size_t pc = 0; pc < parts[i]->len; pc += op_len[FETCH_OPCODE(&cur[pc])]) {
+      tregex_byte_code *p = &cur[pc];
+      switch (FETCH_OPCODE(p)) {
+      case ACCEPT:
+        SET_OPARG_A(p, i);
+        break;
+      case MATCH_STR:
+        SET_OPARG_B(p, FETCH_OPARG_B(p) + lit_base);
+        break;
+      case PUSH:
+      case COUNT:
+        SET_OPARG_A(p, FETCH_OPARG_A(p) + loop_base);
+        break;
+      case REPEAT:
+        SET_OPARG_B(p, FETCH_OPARG_B(p) + loop_base);
+        break;
+      }
+    }
+    cur += parts[i]->len;
+    lit += parts[i]->literals;
+    set->code->loops += parts[i]->loops;
+  }
+  tregex_build_memo(set->code);
+
+  if ((set->dfa = tregex_dfa_create(set->code)))
+    set->dfa->set = 1;
+  else if (!tregex_pike_init(&set->pike, set->code))
+    goto fail;
+
+  for (int i = 0; i < count; i++)
+    free(parts[i]);
+  free(parts);
+  return set;
+
+fail:
+  for (int i = 0; parts && i < count; i++)
+    free(parts[i]);
+  free(parts);
+  tregex_set_destroy(set);
+  return NULL;
+}
+
+int tregex_set_match(tregex_set *set, const char *str, uint64_t *matched) {
+  return tregex_set_match_n(set, str, strlen(str), matched);
+}
+
+int tregex_set_match_n(tregex_set *set, const char *str, size_t len, uint64_t *matched) {
+  memset(matched, 0, ((size_t)set->count + 63) / 64 * sizeof(uint64_t));
+  if (len > INT_MAX)
+    return TREGEX_ERROR_TOOLONG;
+  if (set->dfa)
+    return tregex_dfa_match_set(set->dfa, str, len, matched);
+  set->pike.str = str;
+  set->pike.len = (int)len;
+  return tregex_pike_execute_set(&set->pike, matched);
+}
+
+void tregex_set_destroy(tregex_set *set) {
+  if (!set) return;
+  if (set->dfa)
+    tregex_dfa_destroy(set->dfa);
+  else if (set->pike.code)
+    tregex_pike_free(&set->pike);
+  free(set->code);
+  free(set);
+}
+
+/*
+ * A stream keeps the current DFA state (or, when the program is too large for
+ * the DFA cache, the current Pike kernel) between chunks, so the match is
+ * anchored at the first byte ever fed and may span any number of buffers.
+ */
+tregex_stream *tregex_stream_create(const tregex_byte_code_list *compiled) {
+  tregex_stream *stream = calloc(1, sizeof(tregex_stream));
+  if (!stream) return NULL;
+  stream->code = compiled;
+  if (!(stream->dfa = tregex_dfa_create(compiled))) {
+    if (!tregex_pike_init(&stream->pike, compiled)) {
+      free(stream);
+      return NULL;
+    }
+    stream->code = stream->pike.code;
+    if (!(stream->kernel = malloc(2 * stream->code->len * sizeof(int)))) {
+      tregex_pike_free(&stream->pike);
+      free(stream);
+      return NULL;
+    }
+  }
+  tregex_stream_reset(stream);
+  return stream;
+}
+
+void tregex_stream_reset(tregex_stream *stream) {
+  stream->pos = 0;
+  stream->match_end = -1;
+  stream->done = 0;
+  stream->state = NULL;
+  stream->flip = 0;
+  if (!stream->dfa) {
+    stream->kernel[0] = 0;
+    stream->count = 1;
+  }
+}
+
+int tregex_stream_feed(tregex_stream *stream, const char *buf, size_t len) {
+  const unsigned char *p = (const unsigned char *)buf, *end = p + len;
+  if (stream->done)
+    return 0;
+
+  if (stream->dfa) {
+    tregex_dfa *dfa = stream->dfa;
+    tregex_dfa_state *s = stream->state ? stream->state : tregex_dfa_start(dfa), *ns;
+    for (; p < end; p++) {
+      if (!(ns = s->next[dfa->bytemap[*p]]))
+        ns = tregex_dfa_transition(dfa, s, *p);
+      s = ns;
+      if (s->flags & (DFA_MATCH | DFA_DEAD)) {
+        if (s->flags & DFA_MATCH)
+          stream->match_end = stream->pos + (p - (const unsigned char *)buf);
+        if (s->flags & DFA_DEAD) {
+          stream->done = 1;
+          break;
+        }
+      }
+    }
+    stream->state = s;
+  }
+  else {
+    int *cur = stream->kernel + (stream->flip ? stream->code->len : 0);
+    for (; p < end; p++) {
+      int *next = stream->kernel + (stream->flip ? 0 : stream->code->len), accepts;
+      tregex_pike_closure(&stream->pike, cur, stream->count, *p, !stream->pos && p == (const unsigned char *)buf);
+      stream->count = tregex_pike_step(&stream->pike, *p, next, NULL, &accepts);
+      stream->flip ^= 1;
+      cur = next;
+      if (accepts)
+        stream->match_end = stream->pos + (p - (const unsigned char *)buf);
+      if (!stream->count) {
+        stream->done = 1;
+        break;
+      }
+    }
+  }
+  stream->pos += len;
+  return !stream->done;
+}
+
+int64_t tregex_stream_finish(tregex_stream *stream) {
+  if (stream->done)
+    return stream->match_end;
+  stream->done = 1;
+  if (stream->dfa) {
+    tregex_dfa_state *s = stream->state ? stream->state : tregex_dfa_start(stream->dfa);
+    if (tregex_dfa_eof(stream->dfa, s))
+      stream->match_end = stream->pos;
+  }
+  else {
+    tregex_pike_closure(&stream->pike, stream->kernel + (stream->flip ? stream->code->len : 0), stream->count, -1, !stream->pos);
+    if (tregex_pike_accepting(&stream->pike))
+      stream->match_end = stream->pos;
+  }
+  return stream->match_end;
+}
+
+void tregex_stream_destroy(tregex_stream *stream) {
+  if (!stream) return;
+  if (stream->dfa)
+    tregex_dfa_destroy(stream->dfa);
+  else {
+    tregex_pike_free(&stream->pike);
+    free(stream->kernel);
+  }
+  free(stream);
+}
+
+static int tregex_batch_one(tregex_batch_worker *w, int i) {
+  const tregex_slice *span = &w->batch->spans[i];
+  int match_end;
+  if (w->dfa && w->dfa->flushes < BATCH_MAX_FLUSHES)
+    match_end = tregex_dfa_match_n(w->dfa, span->str, span->len);
+  else
+    match_end = tregex_match_ctx_run(&w->ctx, w->batch->code, span->str, span->len);
+  w->batch->results[i] = match_end;
+  return match_end >= 0;
+}
+
+/* Subjects too long for int offsets go through tregex_batch_one, which rejects them. */
+static int tregex_batch_skip(tregex_batch_worker *w, int first, int last) {
+  while (first < last && w->batch->spans[first].len > INT_MAX)
+    w->matched += tregex_batch_one(w, first++);
+  return first;
+}
+
+static void tregex_batch_lane_init(tregex_batch_lane *l, const tregex_slice *spans, int i, int last, tregex_dfa_state *start) {
+#ifdef __GNUC__
+  if (i + BATCH_LANES < last)
+    __builtin_prefetch(spans[i + BATCH_LANES].str);
+#endif
+  l->p = (const unsigned char *)spans[i].str;
+  l->s = start;
+  l->i = i;
+  l->idx = 0;
+  l->len = (int)spans[i].len;
+  l->match_end = -1;
+}
+
+/* Steps a full set of lanes together until one needs a new state or dies. */
+static void tregex_batch_burst(const tregex_dfa *dfa, tregex_batch_lane *lane) {
+  const unsigned char *p[BATCH_LANES];
+  tregex_dfa_state *s[BATCH_LANES], *ns[BATCH_LANES];
+  int idx[BATCH_LANES], match_end[BATCH_LANES], n = lane[0].len - lane[0].idx, flags = 0;
+
+  for (int k = 0; k < BATCH_LANES; k++) {
+    p[k] = lane[k].p;
+    s[k] = lane[k].s;
+    idx[k] = lane[k].idx;
+    match_end[k] = lane[k].match_end;
+    flags |= s[k]->flags;
+    if (lane[k].len - idx[k] < n)
+      n = lane[k].len - idx[k];
+  }
+  if (flags & DFA_DEAD)
+    return;
+  for (; n > 0; n--) {
+    int miss = 0;
+    for (int k = 0; k < BATCH_LANES; k++)
+      miss |= !(ns[k] = s[k]->next[dfa->bytemap[p[k][idx[k]]]]);
+    if (miss)
+      break;
+    for (int k = 0; k < BATCH_LANES; k++) {
+      match_end[k] = ns[k]->flags & DFA_MATCH ? idx[k] : match_end[k];
+      flags |= ns[k]->flags;
+      s[k] = ns[k];
+      idx[k]++;
+    }
+    if (flags & DFA_DEAD)
+      break;
+  }
+  for (int k = 0; k < BATCH_LANES; k++) {
+    lane[k].s = s[k];
+    lane[k].idx = idx[k];
+    lane[k].match_end = match_end[k];
+  }
+}
+
+/*
+ * Matches subjects [first, last) with up to BATCH_LANES of them stepping
+ * through the DFA in turn, so the table loads of one lane overlap those of
+ * the others. A cache flush frees the states the other lanes hold, so they
+ * restart; once the cache thrashes the rest go through tregex_batch_one.
+ */
+static void tregex_batch_run(tregex_batch_worker *w, int first, int last) {
+  tregex_dfa *dfa = w->dfa;
+  const tregex_slice *spans = w->batch->spans;
+  tregex_batch_lane lane[BATCH_LANES];
+  int active = 0, restart = 0;
+
+  while (dfa && (first < last || active)) {
+    size_t flushes = dfa->flushes;
+    if (flushes >= BATCH_MAX_FLUSHES)
+      break;
+    tregex_dfa_state *start = tregex_dfa_start(dfa);
+    for (int k = 0; restart && k < active; k++)
+      tregex_batch_lane_init(&lane[k], spans, lane[k].i, last, start);
+    for (restart = 0; active < BATCH_LANES && (first = tregex_batch_skip(w, first, last)) < last; active++)
+      tregex_batch_lane_init(&lane[active], spans, first++, last, start);
+    if (active == BATCH_LANES)
+      tregex_batch_burst(dfa, lane);
+
+    for (int k = 0; k < active;) {
+      tregex_batch_lane *l = &lane[k];
+      tregex_dfa_state *s = l->s;
+      if (l->idx < l->len && !(s->flags & DFA_DEAD)) {
+        if (!(s = s->next[dfa->bytemap[l->p[l->idx]]])) {
+          s = tregex_dfa_transition(dfa, l->s, l->p[l->idx]);
+          if (dfa->flushes != flushes) {
+            restart = 1;
+            break;
+          }
+        }
+        if (s->flags & DFA_MATCH)
+          l->match_end = l->idx;
+        l->s = s;
+        l->idx++;
+        k++;
+        continue;
+      }
+      if (!(s->flags & DFA_DEAD) && tregex_dfa_eof(dfa, s))
+        l->match_end = l->len;
+      w->batch->results[l->i] = l->match_end;
+      w->matched += l->match_end >= 0;
+      if ((first = tregex_batch_skip(w, first, last)) < last)
+        tregex_batch_lane_init(l, spans, first++, last, start);
+      else
+        *l = lane[--active];
+    }
+  }
+
+  for (int k = 0; k < active; k++)
+    w->matched += tregex_batch_one(w, lane[k].i);
+  for (; first < last; first++)
+    w->matched += tregex_batch_one(w, first);
+}
+
+#ifdef TREGEX_THREADS
+/* Takes up to BATCH_CHUNK subjects from the front of the worker's range. */
+static int tregex_batch_take(tregex_batch_worker *w, int *first, int *last) {
+  uint64_t old = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE), range;
+  do {
+    uint32_t next = (uint32_t)old, end = (uint32_t)(old >> 32);
+    if (next >= end)
+      return 0;
+    *first = (int)next;
+    *last = (int)(end - next > BATCH_CHUNK ? next + BATCH_CHUNK : end);
+    range = (old & ~0xffffffffull) | (uint32_t)*last;
+  } while (!__atomic_compare_exchange_n(&w->range, &old, range, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  return 1;
+}
+
+/* Moves the back half of another worker's range into an idle worker's own. */
+static int tregex_batch_steal(tregex_batch_worker *w) {
+  tregex_batch *batch = w->batch;
+  for (int k = 1; k < batch->nworkers; k++) {
+    tregex_batch_worker *victim = &batch->workers[(w - batch->workers + k) % batch->nworkers];
+    uint64_t old = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE), range;
+    uint32_t next, end, mid;
+    do {
+      next = (uint32_t)old, end = (uint32_t)(old >> 32);
+      if (next >= end)
+        break;
+      mid = end - (end - next + 1) / 2;
+      range = ((uint64_t)mid << 32) | next;
+    } while (!__atomic_compare_exchange_n(&victim->range, &old, range, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    if (next < end) {
+      __atomic_store_n(&w->range, ((uint64_t)end << 32) | mid, __ATOMIC_RELEASE);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *tregex_batch_thread(void *arg) {
+  tregex_batch_worker *w = arg;
+  int first, last;
+  while (tregex_batch_take(w, &first, &last) || (tregex_batch_steal(w) && tregex_batch_take(w, &first, &last)))
+    tregex_batch_run(w, first, last);
+  return NULL;
+}
+#endif
+
+/*
+ * Matches every span against `compiled` as tregex_match_n would, storing the
+ * match ends in results[0, n). Returns how many matched, or
+ * TREGEX_ERROR_NOMEM if the workers could not be set up.
+ */
+int tregex_match_batch(const tregex_byte_code_list *compiled, const tregex_slice *spans, int n, int *results) {
+  return tregex_match_batch_threads(compiled, spans, n, results, 1);
+}
+
+/*
+ * Same as tregex_match_batch, spread over up to `nthreads` threads including
+ * the caller. Each starts with an equal share and steals half of a busy
+ * worker's remaining subjects when it runs out.
+ */
+int tregex_match_batch_threads(const tregex_byte_code_list *compiled, const tregex_slice *spans, int n, int *results, int nthreads) {
+  tregex_batch batch = { compiled, spans, results, NULL, 0 };
+  int matched = TREGEX_ERROR_NOMEM;
+
+#ifndef TREGEX_THREADS
+  nthreads = 1;
+#endif
+  if (nthreads > MAX_BATCH_THREADS)
+    nthreads = MAX_BATCH_THREADS;
+  if (nthreads > (n + BATCH_CHUNK - 1) / BATCH_CHUNK)
+    nthreads = (n + BATCH_CHUNK - 1) / BATCH_CHUNK;
+  if (nthreads < 1)
+    nthreads = 1;
+  if (!(batch.workers = calloc(nthreads, sizeof(tregex_batch_worker))))
+    return TREGEX_ERROR_NOMEM;
+  for (; batch.nworkers < nthreads; batch.nworkers++) {
+    tregex_batch_worker *w = &batch.workers[batch.nworkers];
+    uint32_t first = (uint32_t)((int64_t)n * batch.nworkers / nthreads);
+    uint32_t last = (uint32_t)((int64_t)n * (batch.nworkers + 1) / nthreads);
+    w->batch = &batch;
+    w->range = ((uint64_t)last << 32) | first;
+    if (!tregex_ctx_init(&w->ctx))
+      goto out;
+    /* A DFA only pays for itself over enough subjects; NULL falls back to backtracking. */
+    if (last - first >= BATCH_CHUNK)
+      w->dfa = tregex_dfa_create(compiled);
+  }
+
+  if (nthreads == 1)
+    tregex_batch_run(&batch.workers[0], 0, n);
+#ifdef TREGEX_THREADS
+  else {
+    /* Workers that fail to start leave their share to be stolen. */
+    pthread_t threads[MAX_BATCH_THREADS];
+    int started[MAX_BATCH_THREADS] = { 0 };
+    for (int i = 1; i < nthreads; i++)
+      started[i] = !pthread_create(&threads[i], NULL, tregex_batch_thread, &batch.workers[i]);
+    tregex_batch_thread(&batch.workers[0]);
+    for (int i = 1; i < nthreads; i++)
+      if (started[i])
+        pthread_join(threads[i], NULL);
+  }
+#endif
+  matched = 0;
+  for (int i = 0; i < nthreads; i++)
+    matched += batch.workers[i].matched;
+
+out:
+  for (int i = 0; i < batch.nworkers; i++) {
+    tregex_ctx_free(&batch.workers[i].ctx);
+    tregex_dfa_destroy(batch.workers[i].dfa);
+  }
+  free(batch.workers);
+  return matched;
+}
+
+static int tregex_dfa_state_id(tregex_dfa_state *const *order, int n, const tregex_dfa_state *s) {
+  int lo = 0, hi = n - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (order[mid] < s) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Builds every state of `dfa` reachable from the start state and its eof
+ * flag. Returns how many there are, in discovery order in *order, or -1 if
+ * they outgrow DFA_CACHE_SIZE or `max_states`.
+ */
+static int tregex_dfa_expand(tregex_dfa *dfa, tregex_dfa_state ***order, int max_states) {
+  /* States are allocated in discovery order, so their addresses are sorted. */
+  size_t flushes = dfa->flushes, size = 64;
+  int n = 0;
+  if (!(*order = malloc(size * sizeof(**order))))
+    return -1;
+  (*order)[n++] = tregex_dfa_start(dfa);
+  for (int i = 0; i < n; i++) {
+    for (int k = 0; k < dfa->nclasses; k++) {
+      int c = 0;
+      while (dfa->bytemap[c] != k) c++;
+      size_t nstates = dfa->nstates;
+      tregex_dfa_state *ns = tregex_dfa_transition(dfa, (*order)[i], c);
+      if (dfa->flushes != flushes)
+        return -1;
+      if (dfa->nstates == nstates)
+        continue;
+      if (n == max_states)
+        return -1;
+      if ((size_t)n == size) {
+        void *p = realloc(*order, 2 * size * sizeof(**order));
+        if (!p) return -1;
+        *order = p;
+        size *= 2;
+      }
+      (*order)[n++] = ns;
+    }
+    tregex_dfa_eof(dfa, (*order)[i]);
+  }
+  return n;
+}
+
+/*
+ * Writes `int name(const char *str, size_t len)` to `out`: the fully expanded
+ * DFA of `compiled` as labels and switches, returning what tregex_match_n
+ * would. Fails with TREGEX_ERROR_NOMEM if the DFA outgrows DFA_CACHE_SIZE.
+ */
+int tregex_codegen(const tregex_byte_code_list *compiled, const char *name, FILE *out) {
+  tregex_dfa *dfa = tregex_dfa_create(compiled);
+  tregex_dfa_state **order = NULL;
+  uint8_t *target = NULL;
+  int n = 0, ret = TREGEX_ERROR_NOMEM;
+  if (!dfa || (n = tregex_dfa_expand(dfa, &order, INT32_MAX)) < 0)
+    goto done;
+
+  int reads_match_end = 0;
+  if (!(target = calloc(n, 1)))
+    goto done;
+  for (int i = 0; i < n; i++) {
+    reads_match_end |= (order[i]->flags & DFA_DEAD) || !order[i]->eof;
+    for (int k = 0; !(order[i]->flags & DFA_DEAD) && k < dfa->nclasses; k++)
+      target[tregex_dfa_state_id(order, n, order[i]->next[k])] = 1;
+  }
+
+  fprintf(out, "int %s(const char *str, size_t len) {\n", name);
+  fprintf(out, "  const unsigned char *base = (const unsigned char *)str, *p = base, *end = base + len;\n");
+  fprintf(out, "  if (len > %d)\n    return %d;\n", INT_MAX, TREGEX_ERROR_TOOLONG);
+  if (reads_match_end)
+    fprintf(out, "  int match_end = -1;\n");
+  for (int i = 0; i < n; i++) {
+    tregex_dfa_state *s = order[i];
+    int next[256], common = -1, best = 0;
+    if (target[i])
+      fprintf(out, "s%d:\n", i);
+    if ((s->flags & DFA_MATCH) && reads_match_end)
+      fprintf(out, "  match_end = (int)(p - base) - 1;\n");
+    if (s->flags & DFA_DEAD) {
+      fprintf(out, "  return match_end;\n");
+      continue;
+    }
+    fprintf(out, "  if (p == end)\n    return %s;\n", s->eof ? "(int)(p - base)" : "match_end");
+
+    /* The most frequent successor becomes the default label. */
+    for (int c = 0; c < 256; c++)
+      next[c] = tregex_dfa_state_id(order, n, s->next[dfa->bytemap[c]]);
+    for (int c = 0; c < 256; c++) {
+      int count = 0;
+      for (int d = c; d < 256; d++)
+        count += next[d] == next[c];
+      if (count > best)
+        best = count, common = next[c];
+    }
+    fprintf(out, "  switch (*p++) {\n");
+    for (int c = 0; c < 256; c++) {
+      int t = next[c], first = 1;
+      if (t == common)
+        continue;
+      for (int d = 0; d < c && first; d++)
+        first = next[d] != t;
+      if (!first)
+        continue;
+      for (int d = c, labels = 0; d < 256; d++) {
+        if (next[d] != t)
+          continue;
+        fprintf(out, labels++ % 8 ? " " : labels > 1 ? "\n  " : "  ");
+        fprintf(out, isalnum(d) ? "case '%c':" : "case %d:", d);
+      }
+      fprintf(out, "\n    goto s%d;\n", t);
+    }
+    fprintf(out, "  default:\n    goto s%d;\n  }\n", common);
+  }
+  fprintf(out, "}\n");
+  ret = 0;
+
+done:
+  free(order);
+  free(target);
+  tregex_dfa_destroy(dfa);
+  return ret;
+}
+
+/*
+ * Steps a chunk through the dense DFA. Every PARALLEL_MERGE_BYTES lanes in
+ * the same state merge and dead lanes drop out, folding their last matches
+ * into the entries they carry; once a single lane is left it runs to the end
+ * on its own. States are kept premultiplied by nclasses.
+ */
+static void *tregex_parallel_run(void *arg) {
+  tregex_parallel_chunk *chunk = arg;
+  const tregex_parallel *par = chunk->par;
+  const unsigned char *p = chunk->p, *bytemap = par->bytemap;
+  const uint8_t *flags = par->flags;
+  const int *next = par->next;
+  int *lane = chunk->lane, *map = chunk->map, *remap = chunk->remap, *slot = chunk->slot;
+  int64_t *lane_end = chunk->lane_end, *match_end = chunk->match_end;
+  int n = chunk->entries, active = n, nclasses = par->nclasses;
+  size_t pos = 0;
+
+  for (int j = 0; j < n; j++) {
+    lane[j] = n == 1 ? chunk->start : j * nclasses;
+    lane_end[j] = -1;
+    map[j] = j;
+    match_end[j] = -1;
+  }
+  while (active > 1 && pos < chunk->len) {
+    size_t stop = chunk->len - pos > PARALLEL_MERGE_BYTES ? pos + PARALLEL_MERGE_BYTES : chunk->len;
+    for (; pos < stop; pos++) {
+      int c = bytemap[p[pos]];
+      for (int j = 0; j < active; j++) {
+        int s = lane[j] = next[lane[j] + c];
+        if (flags[s] & DFA_MATCH)
+          lane_end[j] = chunk->base + (int64_t)pos;
+      }
+    }
+
+    /* A dead lane is remapped to -1 - state, which its entries keep. */
+    int k = 0;
+    for (int j = 0; j < active; j++) {
+      int s = lane[j];
+      if (flags[s] & DFA_DEAD)
+        remap[j] = -1 - s;
+      else {
+        if (slot[s / nclasses] < 0)
+          slot[s / nclasses] = k++;
+        remap[j] = slot[s / nclasses];
+      }
+    }
+    for (int j = 0; j < active; j++)
+      slot[lane[j] / nclasses] = -1;
+    if (k < active) {
+      for (int i = 0; i < n; i++) {
+        if (map[i] < 0)
+          continue;
+        if (lane_end[map[i]] > match_end[i])
+          match_end[i] = lane_end[map[i]];
+        map[i] = remap[map[i]];
+      }
+      for (int j = 0; j < active; j++) {
+        if (remap[j] < 0)
+          continue;
+        lane[remap[j]] = lane[j];
+        lane_end[remap[j]] = -1;
+      }
+      active = k;
+    }
+    /* Lanes that have not settled would cost more than running serially. */
+    if (pos >= PARALLEL_SETTLE_BYTES && active > PARALLEL_MAX_LANES) {
+      chunk->entries = 0;
+      return NULL;
+    }
+  }
+
+  if (active == 1) {
+    size_t s = (size_t)lane[0];
+    int64_t end = lane_end[0];
+    for (; pos < chunk->len && !(flags[s] & DFA_DEAD); pos++) {
+      s = (size_t)next[s + bytemap[p[pos]]];
+      if (flags[s] & DFA_MATCH)
+        end = chunk->base + (int64_t)pos;
+    }
+    lane[0] = (int)s;
+    lane_end[0] = end;
+  }
+  for (int i = 0; i < n; i++) {
+    int j = map[i];
+    if (j < 0) {
+      map[i] = -1 - j;
+      continue;
+    }
+    if (lane_end[j] >= 0)
+      match_end[i] = lane_end[j];
+    map[i] = lane[j];
+  }
+  return NULL;
+}
+
+static int64_t tregex_match_serial(const tregex_byte_code_list *compiled, const char *str, size_t len) {
+  tregex_stream *stream = tregex_stream_create(compiled);
+  if (!stream) return TREGEX_ERROR_NOMEM;
+  tregex_stream_feed(stream, str, len);
+  int64_t match_end = tregex_stream_finish(stream);
+  tregex_stream_destroy(stream);
+  return match_end;
+}
+
+/*
+ * Returns what tregex_match_n would for `str`, with offsets past INT_MAX, by
+ * splitting it into up to `nthreads` chunks that run at the same time. The
+ * DFA is expanded up front so that every chunk but the first can start from
+ * all of its states; the per-chunk state maps are then joined in order.
+ * Programs whose DFA has more than PARALLEL_MAX_STATES states, and subjects
+ * too short to split, are matched on the calling thread.
+ */
+int64_t tregex_match_parallel(const tregex_byte_code_list *compiled, const char *str, size_t len, int nthreads) {
+  tregex_parallel par = { 0 };
+  tregex_parallel_chunk *chunks = NULL;
+  tregex_dfa_state **order = NULL;
+  tregex_dfa *dfa = NULL;
+  int *scratch = NULL, nchunks = 0;
+  int64_t match_end = TREGEX_ERROR_NOMEM;
+
+#ifndef TREGEX_THREADS
+  nthreads = 1;
+#endif
+  if (nthreads > MAX_BATCH_THREADS)
+    nthreads = MAX_BATCH_THREADS;
+  if ((size_t)nthreads > len / PARALLEL_MIN_CHUNK)
+    nthreads = (int)(len / PARALLEL_MIN_CHUNK);
+  if (nthreads < 2 || !(dfa = tregex_dfa_create(compiled)) ||
+    (par.nstates = tregex_dfa_expand(dfa, &order, PARALLEL_MAX_STATES)) < 0) {
+    free(order);
+    tregex_dfa_destroy(dfa);
+    return tregex_match_serial(compiled, str, len);
+  }
+
+  int n = par.nstates;
+  par.bytemap = dfa->bytemap;
+  par.nclasses = dfa->nclasses;
+  par.next = malloc((size_t)n * par.nclasses * sizeof(int));
+  par.flags = malloc((size_t)n * par.nclasses);
+  chunks = calloc(nthreads, sizeof(tregex_parallel_chunk));
+  /* Per chunk: map, lane, remap and slot as ints, match_end and lane_end as int64s. */
+  size_t stride = (size_t)n * (4 * sizeof(int) + 2 * sizeof(int64_t));
+  scratch = malloc(nthreads * stride);
+  if (!par.next || !par.flags || !chunks || !scratch)
+    goto out;
+  for (int i = 0; i < n; i++) {
+    par.flags[i * par.nclasses] = (uint8_t)((order[i]->flags & (DFA_MATCH | DFA_DEAD)) | (order[i]->eof ? DFA_EOF : 0));
+    for (int k = 0; k < par.nclasses; k++)
+      par.next[i * par.nclasses + k] = tregex_dfa_state_id(order, n, order[i]->next[k]) * par.nclasses;
+  }
+
+  for (; nchunks < nthreads; nchunks++) {
+    tregex_parallel_chunk *chunk = &chunks[nchunks];
+    char *mem = (char *)scratch + nchunks * stride;
+    size_t first = len / nthreads * nchunks, last = nchunks + 1 < nthreads ? first + len / nthreads : len;
+    chunk->par = &par;
+    chunk->p = (const unsigned char *)str + first;
+    chunk->len = last - first;
+    chunk->base = (int64_t)first;
+    chunk->entries = nchunks ? n : 1;
+    chunk->match_end = (int64_t *)mem;
+    chunk->lane_end = (int64_t *)mem + n;
+    chunk->map = (int *)((int64_t *)mem + 2 * n);
+    chunk->lane = chunk->map + n;
+    chunk->remap = chunk->lane + n;
+    chunk->slot = chunk->remap + n;
+    memset(chunk->slot, -1, n * sizeof(int));
+  }
+
+#ifdef TREGEX_THREADS
+  {
+    /* Chunks whose thread fails to start run on the caller afterwards. */
+    pthread_t threads[MAX_BATCH_THREADS];
+    int started[MAX_BATCH_THREADS] = { 0 };
+    for (int i = 1; i < nchunks; i++)
+      started[i] = !pthread_create(&threads[i], NULL, tregex_parallel_run, &chunks[i]);
+    tregex_parallel_run(&chunks[0]);
+    for (int i = 1; i < nchunks; i++) {
+      if (started[i])
+        pthread_join(threads[i], NULL);
+      else
+        tregex_parallel_run(&chunks[i]);
+    }
+  }
+#endif
+
+  int s = 0;
+  match_end = TREGEX_NOMATCH;
+  for (int i = 0; i < nchunks; i++) {
+    tregex_parallel_chunk *chunk = &chunks[i];
+    int entry = chunk->entries == n ? s / par.nclasses : 0;
+    if (!chunk->entries) {
+      chunk->entries = 1;
+      chunk->start = s;
+      tregex_parallel_run(chunk);
+    }
+    if (chunk->match_end[entry] >= 0)
+      match_end = chunk->match_end[entry];
+    s = chunk->map[entry];
+    if (par.flags[s] & DFA_DEAD)
+      goto out;
+  }
+  if (par.flags[s] & DFA_EOF)
+    match_end = (int64_t)len;
+
+out:
+  free(scratch);
+  free(chunks);
+  free(par.next);
+  free(par.flags);
+  free(order);
+  tregex_dfa_destroy(dfa);
+  return match_end;
+}
+
+void tregex_dump(const tregex_byte_code_list *byte_code) {
+  tregex_dump_hits(byte_code, NULL);
+}
+
+/* Like tregex_dump, with each instruction prefixed by hits[pc] when `hits` is set. */
+void tregex_dump_hits(const tregex_byte_code_list *byte_code, const uint64_t *hits) {
+  const tregex_byte_code *p = byte_code->code, *q = p;
+  static const char *byte_code_name[] = {
+#undef OP_DEFINE_IMPL
+#define OP_DEFINE_IMPL(op) #op,
+  ALL_OP_DEFINE
+  };
+  for (size_t i = 0; i < byte_code->len;) {
+    p = &byte_code->code[i];
+    int op = FETCH_OPCODE(p);
+    if (hits)
+      printf("%12llu  ", (unsigned long long)hits[p - q]);
+    printf("%d\t ", (int)(p - q));
+    if (op >= OP_NUM) break;
+    printf("%s ", byte_code_name[op]);
+    switch (op) {
+    case LOOP:
+    case MATCH:
+      printf("\t\t%c(\\%d)",
+        (char)FETCH_OPARG_A(p), (int)(char)FETCH_OPARG_A(p));
+      break;
+    case LOOP_SET:
+    case MATCH_SET:
+      printf("\t%c(\\%d), %c(\\%d)",
+        (char)FETCH_OPARG_A(p), (int)(char)FETCH_OPARG_A(p),
+        (char)FETCH_OPARG_B(p), (int)(char)FETCH_OPARG_B(p));
+      break;
+    case LOOP_CLASS:
+    case MATCH_CLASS:
+      printf("\t[");
+      for (int c = 0; c < 256; c++) {
+        if (!CLASS_HAS(FETCH_CLASS(p), c) || (c && CLASS_HAS(FETCH_CLASS(p), c - 1)))
+          continue;
+        int e = c;
+        while (e < 255 && CLASS_HAS(FETCH_CLASS(p), e + 1))
+          e++;
+        printf(isgraph(c) ? "%c" : "\\x%02x", c);
+        if (e > c)
+          printf(isgraph(e) ? "-%c" : "-\\x%02x", e);
+      }
+      printf("]");
+      break;
+    case COUNT:
+      printf("\t#%d, %d", FETCH_OPARG_A(p), FETCH_OPARG_B(p) + (int)(p - q));
+      break;
+    case COUNT_NEXT:
+      printf("\t%d\n", FETCH_OPARG_A(p) + (int)(p - q));
+      STEP_OP_A(i);
+      continue;
+    case PUSH:
+      printf("\t\t#%d\n", FETCH_OPARG_A(p));
+      STEP_OP_A(i);
+      continue;
+    case HALT:
+    case ANY:
+    case BEGIN:
+    case END:
+      printf("\n");
+      STEP_OP_Z(i);
+      continue;
+    case ACCEPT:
+      printf("\t%d\n", FETCH_OPARG_A(p));
+      STEP_OP_A(i);
+      continue;
+    case SAVE:
+      printf("\t\t$%d\n", FETCH_OPARG_A(p));
+      STEP_OP_A(i);
+      continue;
+    case MATCH_STR:
+      printf("\t\"%.*s\"\n", FETCH_OPARG_A(p), TREGEX_LITERALS(byte_code) + FETCH_OPARG_B(p));
+      STEP_OP_AB(i);
+      continue;
+    case SPLIT:
+      printf("\t\t%d, %d\n",
+        FETCH_OPARG_A(p) + (int)(p - q), FETCH_OPARG_B(p) + (int)(p - q));
+      STEP_OP_AB(i);
+      continue;
+    case REPEAT:
+      printf("\t%d, #%d\n",
+        FETCH_OPARG_A(p) + (int)(p - q), FETCH_OPARG_B(p));
+      STEP_OP_AB(i);
       continue;
     case JMP:
       printf("\t\t%d\n",
-        (char)FETCH_OPARG_A(p) + (int)(p - q));
+        FETCH_OPARG_A(p) + (int)(p - q));
       STEP_OP_A(i);
       continue;
     }
+    if (op == COUNT)
+      printf(FETCH_OPARG_D(p) < 0 ? " {%d,}" : " {%d,%d}", FETCH_OPARG_C(p), FETCH_OPARG_D(p));
+    else if (tregex_is_loop(op))
+      printf(LOOP_MAX(p) < 0 ? " {%d,}" : " {%d,%d}", LOOP_MIN(p), LOOP_MAX(p));
+    printf("\n");
+    i += op_len[op];
   }
   printf("\n%d instructions were dumped\n", (int)(p - q) + 1);
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #ifndef TREGEX_HEADER
 #define TREGEX_HEADER
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 
@@ -15,15 +17,61 @@ static inline int __builtin_ctzll(unsigned long long x) {
 #include <x86intrin.h>
 #endif
 
+#if defined(__GNUC__) && (defined(__unix__) || defined(__APPLE__)) && !defined(TREGEX_NO_THREADS)
+#define TREGEX_THREADS
+#include <pthread.h>
+#endif
+
 typedef int32_t tregex_byte_code;
 
+#ifdef __GNUC__
+#define TREGEX_DEPRECATED __attribute__((deprecated))
+#else
+#define TREGEX_DEPRECATED
+#endif
+
 #define INITIAL_STACK_SIZE    256 
 #define MAX_STACK_SIZE        1024*1024 
-#define MAX_BYTE_CODE_SIZE    1024
-#define POOL_BLOCK_SIZE       32
+#define MAX_PREFIX_SIZE       32
+#define MAX_REQUIRED_SIZE     32
+#define MIN_MATCH_STR_SIZE    4
+#define DFA_CACHE_SIZE        (1 << 20)
+#ifndef MAX_BITSTATE_SIZE
+#define MAX_BITSTATE_SIZE     (256 * 1024)
+#endif
+#define MAX_MEMO_COUNT        64
+#define MAX_REPEAT            65535
+#define MAX_UNROLL_SIZE       (1 << 20)
+#define BUDGET_CHECK_INTERVAL 4096
+#define PATTERN_CACHE_SIZE    256
+#define CACHE_SHARDS          16
+#define BATCH_LANES           4
+#define BATCH_CHUNK           64
+#define BATCH_MAX_FLUSHES     16
+#define MAX_BATCH_THREADS     64
+#define PARALLEL_MIN_CHUNK    (256 * 1024)
+#define PARALLEL_MAX_STATES   4096
+#define PARALLEL_MAX_LANES    16
+#define PARALLEL_MERGE_BYTES  64
+#define PARALLEL_SETTLE_BYTES 4096
+
+#define TREGEX_NOMATCH            -1
+#define TREGEX_ERROR_NOMEM        -2
+#define TREGEX_ERROR_BUDGET       -3
+#define TREGEX_ERROR_TIMEOUT      -4
+#define TREGEX_ERROR_TOOLONG      -5
+
+#define DFA_BEGIN                 1
+#define DFA_MATCH                 2
+#define DFA_DEAD                  4
+#define DFA_EOF                   8
+
+#define ONEPASS_ACCEPT            -1
+#define ONEPASS_FAIL              -2
+#define MAX_ONEPASS_GROUPS        31
 
 #define OP_DEFINE(op) OP_DEFINE_IMPL(op)
-#define OP_NUM 13
+#define OP_NUM 19
 #define ALL_OP_DEFINE \
   OP_DEFINE(HALT)     \
   OP_DEFINE(PUSH)     \
@@ -37,13 +85,19 @@ typedef int32_t tregex_byte_code;
   OP_DEFINE(END)      \
   OP_DEFINE(SPLIT)    \
   OP_DEFINE(JMP)      \
-  OP_DEFINE(ACCEPT)
+  OP_DEFINE(ACCEPT)   \
+  OP_DEFINE(LOOP_CLASS) \
+  OP_DEFINE(MATCH_CLASS) \
+  OP_DEFINE(MATCH_STR) \
+  OP_DEFINE(SAVE) \
+  OP_DEFINE(COUNT) \
+  OP_DEFINE(COUNT_NEXT)
 
 #define OP_HALT_LEN               1
-#define OP_PUSH_LEN               1
-#define OP_REPEAT_LEN             2
-#define OP_LOOP_LEN               2
-#define OP_LOOP_SET_LEN           3
+#define OP_PUSH_LEN               2
+#define OP_REPEAT_LEN             3
+#define OP_LOOP_LEN               4
+#define OP_LOOP_SET_LEN           5
 #define OP_MATCH_LEN              2
 #define OP_MATCH_SET_LEN          3
 #define OP_ANY_LEN                1
@@ -51,29 +105,82 @@ typedef int32_t tregex_byte_code;
 #define OP_END_LEN                1
 #define OP_SPLIT_LEN              3
 #define OP_JMP_LEN                2
-#define OP_ACCEPT_LEN             1
+#define OP_ACCEPT_LEN             2
+#define OP_LOOP_CLASS_LEN         (3 + CLASS_SIZE / sizeof(tregex_byte_code))
+#define OP_MATCH_CLASS_LEN        (1 + CLASS_SIZE / sizeof(tregex_byte_code))
+#define OP_MATCH_STR_LEN          3
+#define OP_SAVE_LEN               2
+#define OP_COUNT_LEN              5
+#define OP_COUNT_NEXT_LEN         2
 #define FETCH_OPCODE(inst)        ((inst)[0])
 #define FETCH_OPARG_A(inst)       ((inst)[1]) 
 #define FETCH_OPARG_B(inst)       ((inst)[2])
+#define FETCH_OPARG_C(inst)       ((inst)[3])
+#define FETCH_OPARG_D(inst)       ((inst)[4])
 #define SET_OPCODE(buf, op)       ((buf)[0] = (op))
 #define SET_OPARG_A(buf, a)       ((buf)[1] = (a))
 #define SET_OPARG_B(buf, b)       ((buf)[2] = (b))
 #define SET_OP_A(buf, op, ax)     ((buf)[0] = (op), (buf)[1] = (ax))
 #define SET_OP_AB(buf, op, a, b)  ((buf)[0] = (op), (buf)[1] = (a), (buf)[2] = (b))
+#define SET_OP_ABCD(buf, op, a, b, c, d) \
+  ((buf)[0] = (op), (buf)[1] = (a), (buf)[2] = (b), (buf)[3] = (c), (buf)[4] = (d))
 #define SET_OP_Z(buf, op)         ((buf)[0] = (op))
 #define STEP_OP_A(p)              ((p) += 2)
 #define STEP_OP_AB(p)             ((p) += 3)
 #define STEP_OP_Z(p)              ((p) += 1)
 
+/*
+ * A class is a 256-bit byte bitmap laid out for pshufb lookups: byte c lives in
+ * row ((c >> 7) << 4 | (c & 15)) at bit ((c >> 4) & 7).
+ */
+#define CLASS_SIZE                32
+#define CLASS_ROW(c)              ((((c) >> 7) << 4) | ((c) & 15))
+#define CLASS_BIT(c)              (((c) >> 4) & 7)
+#define CLASS_HAS(cls, c)         (((cls)[CLASS_ROW(c)] >> CLASS_BIT(c)) & 1)
+#define SET_CLASS(cls, c)         ((cls)[CLASS_ROW(c)] |= (uint8_t)(1 << CLASS_BIT(c)))
+#define FETCH_CLASS(inst)         ((const uint8_t *)&(inst)[1])
+
+/* Loop slots come first, then a start/end pair per capture group, group 0 included. */
+#define TREGEX_SLOTS(bcl)         ((bcl)->loops + 2 * ((bcl)->groups + 1))
+
+/*
+ * The code is followed by a side table with one unit per code unit: at every
+ * SPLIT/REPEAT pc, the visited-bitmap key, (at pc + 1) the innermost loop
+ * around it and (at pc + 2) the pc of the innermost counted loop it is in; at
+ * a COUNT, the pc of the counted loop around it; -1 elsewhere. MATCH_STR bytes
+ * come last, at offset B of the pool.
+ */
+#define TREGEX_MEMO(bcl)          (&(bcl)->code[(bcl)->len])
+#define TREGEX_LITERALS(bcl)      ((char *)&(bcl)->code[2 * (bcl)->len])
+#define TREGEX_PROGRAM_SIZE(len, literals) \
+  (offsetof(tregex_byte_code_list, code) + sizeof(tregex_byte_code) * 2 * (size_t)(len) + (size_t)(literals))
+
+/*
+ * A library file is a header, `count` index entries and then the patterns and
+ * programs they point at, stored exactly as in memory. Offsets are from the
+ * start of the file and programs are TREGEX_LIBRARY_ALIGN aligned, so a mapped
+ * file is used in place. `checksum` is a 64-bit FNV-1a of everything after
+ * the header. Bump the version whenever the program layout changes.
+ */
+#define TREGEX_LIBRARY_MAGIC      "TREGEXLB"
+#define TREGEX_LIBRARY_VERSION    4
+#define TREGEX_LIBRARY_ALIGN      16
+
 #define ctzll(v)  __builtin_ctzll(v)
 #define rdtsc()   __rdtsc()
 
+#ifdef TREGEX_STATS
+#define vmprofile(pc)     (ctx->stats ? tregex_stats_op(ctx->stats, pcode, pc) : (void)0)
+#else
+#define vmprofile(pc)     ((void)0)
+#endif
+
 #ifdef USE_LABELS_AS_VALUES
-#define vmdispatch(x)     goto *disptab[x];
+#define vmdispatch(x)     goto *(vmprofile(pc), disptab[x]);
 #define vmcase(label)     L_##label:
-#define vmnext            goto *disptab[FETCH_OPCODE(&pcode[pc])]
+#define vmnext            goto *(vmprofile(pc), disptab[FETCH_OPCODE(&pcode[pc])])
 #else
-#define vmdispatch(op)    switch(op)
+#define vmdispatch(op)    switch((vmprofile(pc), op))
 #define vmcase(label)     case label:
 #define vmnext            goto next_loop
 #endif
@@ -86,41 +193,102 @@ enum {
 
 typedef struct _tregex_byte_code_list tregex_byte_code_list;
 typedef struct _tregex_match_thread tregex_match_thread;
-typedef struct _tregex_internal_stack_node tregex_internal_stack_node;
-typedef struct _tregex_internal_stack tregex_internal_stack;
+typedef struct _tregex_match_undo tregex_match_undo;
 typedef struct _tregex_match_ctx tregex_match_ctx;
+typedef struct _tregex_packed tregex_packed;
 typedef struct _tregex_parse_ctx tregex_parse_ctx;
+typedef struct _tregex_opt_ctx tregex_opt_ctx;
 typedef struct _tregex_pool_ctx tregex_pool_ctx;
+typedef struct _tregex_pike_list tregex_pike_list;
+typedef struct _tregex_pike_ctx tregex_pike_ctx;
+typedef struct _tregex_dfa_state tregex_dfa_state;
+typedef struct _tregex_dfa tregex_dfa;
+typedef struct _tregex_onepass_action tregex_onepass_action;
+typedef struct _tregex_onepass tregex_onepass;
+typedef struct _tregex_set tregex_set;
+typedef struct _tregex_stream tregex_stream;
+typedef struct _tregex_matcher tregex_matcher;
+typedef struct _tregex_jit tregex_jit;
+typedef struct _tregex_capture tregex_capture;
+typedef struct _tregex_jit_asm tregex_jit_asm;
+typedef struct _tregex_slice tregex_slice;
+typedef struct _tregex_iter tregex_iter;
+typedef struct _tregex_stats tregex_stats;
+typedef struct _tregex_cache_entry tregex_cache_entry;
+typedef struct _tregex_library_header tregex_library_header;
+typedef struct _tregex_library_entry tregex_library_entry;
+typedef struct _tregex_library tregex_library;
+typedef struct _tregex_cache_shard tregex_cache_shard;
+typedef struct _tregex_batch_lane tregex_batch_lane;
+typedef struct _tregex_batch_worker tregex_batch_worker;
+typedef struct _tregex_batch tregex_batch;
+typedef struct _tregex_parallel tregex_parallel;
+typedef struct _tregex_parallel_chunk tregex_parallel_chunk;
 
 struct _tregex_byte_code_list {
   size_t len;
+  size_t literals;
+  int loops;
+  int groups;
+  int memo_keys;
+  int prefix_len;
+  char prefix[MAX_PREFIX_SIZE];
+  int required_len;
+  int suffix_len;
+  char required[MAX_REQUIRED_SIZE];
+  char suffix[MAX_REQUIRED_SIZE];
   tregex_byte_code code[1];
 };
 
 struct _tregex_match_thread {
   int pc;
   int idx;
-  tregex_internal_stack *stack;
+  int undo;
 };
 
-struct _tregex_internal_stack_node {
-  tregex_internal_stack_node *parent, *left, *right;
+struct _tregex_match_undo {
+  int slot;
   int idx;
-  int count;
 };
 
-struct _tregex_internal_stack {
-  tregex_internal_stack_node *root, *top;
+/*
+ * A program re-encoded by tregex_pack for the backtracker. With `threaded`,
+ * opcodes are two bytes: the handler's offset in tregex_packed_execute.
+ */
+struct _tregex_packed {
+  const tregex_byte_code_list *code;
+  size_t len;
+  int threaded;
+  uint8_t bytes[1];
 };
 
 struct _tregex_match_ctx {
   const char *str;
   int len;
   int pc;
-  tregex_byte_code_list *code;
+  const tregex_byte_code_list *code;
   tregex_match_thread *top;
   tregex_match_thread *stack;
   int stack_size;
+  int *slots;
+  int slots_size;
+  tregex_match_undo *undo;
+  int undo_len;
+  int undo_size;
+  int (*native)(tregex_match_ctx *ctx, int start);
+  const tregex_packed *packed;
+  uint32_t *visited;
+  size_t visited_size;
+  int memo;
+  const void *memo_owner;
+  uint64_t steps;
+  uint64_t steps_left;
+  uint64_t deadline;
+  uint64_t max_steps;
+  uint64_t max_cycles;
+#ifdef TREGEX_STATS
+  tregex_stats *stats;
+#endif
 };
 
 struct _tregex_parse_ctx {
@@ -129,20 +297,360 @@ struct _tregex_parse_ctx {
   size_t idx;
   tregex_byte_code *code;
   tregex_byte_code *cur;
+  int loops;
+  int groups;
+  int capture;
 };
 
+struct _tregex_opt_ctx {
+  uint8_t *removed;
+  uint8_t *visited;
+  int *stack;
+  int *map;
+};
+
+/* Deprecated: kept so callers that pass a pool still build; matching ignores it. */
 struct _tregex_pool_ctx {
-  uint64_t bitmap[16];
-  void *raw;
+  int unused;
+};
+
+/*
+ * Per-thread matching state. A compiled program is read-only while matching
+ * and may be shared by any number of threads, each using its own matcher.
+ */
+struct _tregex_matcher {
+  tregex_match_ctx ctx;
+};
+
+#ifdef TREGEX_STATS
+/*
+ * Execution counters of one match or search call, reset at its start.
+ * `hits`, if not NULL, must have room for compiled->len counters and gets
+ * how often each pc was dispatched, for tregex_dump_hits.
+ */
+struct _tregex_stats {
+  uint64_t ops[OP_NUM];
+  uint64_t pushes;
+  uint64_t backtracks;
+  uint64_t starts;
+  int stack_peak;
+  int undo_peak;
+  int stack_grows;
+  uint64_t *hits;
+};
+#endif
+
+/*
+ * A program shared through the pattern cache. `compiled` is read-only and
+ * stays valid until the entry is released, even if it is evicted meanwhile.
+ */
+struct _tregex_cache_entry {
+  tregex_byte_code_list *compiled;
+  tregex_cache_entry *next;
+  tregex_cache_entry *lru_prev;
+  tregex_cache_entry *lru_next;
+  uint32_t hash;
+  int refs;
+  int cached;
+  char re[1];
+};
+
+/* The cache is split by hash into CACHE_SHARDS, each with its own lock and LRU list. */
+struct _tregex_cache_shard {
+#ifdef TREGEX_THREADS
+  pthread_mutex_t lock;
+#endif
+  tregex_cache_entry **table;
+  size_t table_size;
+  tregex_cache_entry *lru_head;
+  tregex_cache_entry *lru_tail;
+  int count;
+};
+
+struct _tregex_library_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t word_size;
+  uint32_t program_header;
+  uint32_t opcodes;
+  uint32_t count;
+  uint64_t size;
+  uint64_t checksum;
+};
+
+struct _tregex_library_entry {
+  uint64_t program;
+  uint64_t size;
+  uint64_t pattern;
+};
+
+struct _tregex_library {
+  const char *base;
+  size_t size;
+  int count;
+  int owned;
+  const tregex_library_entry *index;
+};
+
+struct _tregex_capture {
+  int start;
+  int end;
+};
+
+struct _tregex_slice {
+  const char *str;
+  size_t len;
+};
+
+/*
+ * Successive non-overlapping matches of one program in one subject. `pos` is
+ * where the next search starts, one past an empty match so it is not found
+ * again; past `len` the iteration is over. `warm` is set once the matcher's
+ * memo table holds this iteration's progress.
+ */
+struct _tregex_iter {
+  tregex_matcher *matcher;
+  const tregex_byte_code_list *code;
+  const char *str;
+  size_t len;
+  size_t pos;
+  int warm;
+};
+
+/* A subject walking the DFA alongside the others of its batch worker. */
+struct _tregex_batch_lane {
+  const unsigned char *p;
+  tregex_dfa_state *s;
+  int i;
+  int idx;
+  int len;
+  int match_end;
+};
+
+/*
+ * Batch workers share the read-only program; each has its own stack and DFA.
+ * `range` holds the next subject in the low half and the end in the high half
+ * so that the owner and thieves can both update it with one CAS.
+ */
+struct _tregex_batch_worker {
+  tregex_batch *batch;
+  tregex_match_ctx ctx;
+  tregex_dfa *dfa;
+  uint64_t range;
+  int matched;
+};
+
+struct _tregex_batch {
+  const tregex_byte_code_list *code;
+  const tregex_slice *spans;
+  int *results;
+  tregex_batch_worker *workers;
+  int nworkers;
+};
+
+/*
+ * The fully expanded DFA of a parallel match as dense tables. A state is its
+ * id times nclasses, so next[s + bytemap[c]] is the next state and flags[s]
+ * its DFA_* flags; the start state is 0.
+ */
+struct _tregex_parallel {
+  const unsigned char *bytemap;
+  int *next;
+  uint8_t *flags;
+  int nstates;
+  int nclasses;
+};
+
+/*
+ * A slice of the subject run from `entries` states at once: every state when
+ * entries is nstates, or just `start` when it is 1. Entries that reach the
+ * same state share a lane from then on. Afterwards map[i] and match_end[i]
+ * hold the state entry i ends in and its last match; entries is 0 if the
+ * lanes did not settle and the chunk has to be rerun from its real entry.
+ */
+struct _tregex_parallel_chunk {
+  const tregex_parallel *par;
+  const unsigned char *p;
+  size_t len;
+  int64_t base;
+  int entries;
+  int start;
+  int *map;
+  int64_t *match_end;
+  int *lane;
+  int *remap;
+  int64_t *lane_end;
+  int *slot;
+};
+
+struct _tregex_jit {
+  const tregex_byte_code_list *code;
+  tregex_match_ctx ctx;
+  void *mem;
+  size_t mem_size;
+};
+
+struct _tregex_jit_asm {
+  uint8_t *buf;
+  size_t len;
+  size_t cap;
+  int *label;
+  int *fixup;
+  int nfixups;
+  int fixups_size;
+  int ok;
+};
+
+struct _tregex_pike_list {
+  int *threads;
+  int *mark;
+  int count;
+  int gen;
+};
+
+struct _tregex_pike_ctx {
+  const char *str;
+  int len;
+  const tregex_byte_code_list *code;
+  tregex_byte_code_list *unrolled;
+  int *depth;
+  int *base;
+  int *mark;
+  int gen;
+  int *stack;
+  tregex_pike_list list[2];
+};
+
+struct _tregex_dfa_state {
+  int flags;
+  int eof;
+  int count;
+  int accepts;
+  int *threads;
+  tregex_dfa_state *next[1];
+};
+
+struct _tregex_dfa {
+  const tregex_byte_code_list *code;
+  tregex_pike_ctx pike;
+  unsigned char bytemap[256];
+  int nclasses;
+  int set;
+  int *accept;
+  tregex_dfa_state *start;
+  tregex_dfa_state **table;
+  size_t table_size;
+  size_t nstates;
+  size_t flushes;
+  char *arena;
+  size_t used;
+};
+
+struct _tregex_onepass_action {
+  int next;
+  int fallback;
+  uint64_t save;
+  uint64_t fallback_save;
+};
+
+struct _tregex_onepass {
+  const tregex_byte_code_list *code;
+  tregex_byte_code_list *unrolled;
+  unsigned char bytemap[256];
+  int nclasses;
+  int nroots;
+  tregex_onepass_action *table;
+};
+
+struct _tregex_set {
+  int count;
+  tregex_byte_code_list *code;
+  tregex_dfa *dfa;
+  tregex_pike_ctx pike;
+};
+
+struct _tregex_stream {
+  const tregex_byte_code_list *code;
+  tregex_dfa *dfa;
+  tregex_dfa_state *state;
+  tregex_pike_ctx pike;
+  int *kernel;
+  int count;
+  int flip;
+  int done;
+  int64_t pos;
+  int64_t match_end;
 };
 
 tregex_byte_code_list *tregex_compile(const char *re);
+tregex_byte_code_list *tregex_compile_groups(const char *re);
+tregex_cache_entry *tregex_cache_acquire(const char *re);
+void tregex_cache_release(tregex_cache_entry *entry);
+void tregex_cache_set_size(int size);
+void tregex_cache_clear(void);
+int tregex_library_write(FILE *out, tregex_byte_code_list *const *programs, const char *const *res, int count);
+tregex_library *tregex_library_load(const void *data, size_t size);
+tregex_library *tregex_library_open(const char *path);
+const tregex_byte_code_list *tregex_library_get(const tregex_library *lib, int i);
+const char *tregex_library_pattern(const tregex_library *lib, int i);
+void tregex_library_close(tregex_library *lib);
 int tregex_match(const char *re, const char *str, tregex_byte_code_list *compiled, tregex_pool_ctx *mem);
+int tregex_match_n(const char *re, const char *str, size_t len, tregex_byte_code_list *compiled, tregex_pool_ctx *mem);
+int tregex_search(const char *re, const char *str, tregex_byte_code_list *compiled, tregex_pool_ctx *mem, int *match_start);
+int tregex_search_n(const char *re, const char *str, size_t len, tregex_byte_code_list *compiled, tregex_pool_ctx *mem, int *match_start);
+int tregex_pike_match(const char *re, const char *str, tregex_byte_code_list *compiled);
+int tregex_pike_match_n(const char *re, const char *str, size_t len, tregex_byte_code_list *compiled);
+tregex_matcher *tregex_matcher_create(void);
+int tregex_matcher_match(tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len);
+int tregex_matcher_search(tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len, int *match_start);
+int tregex_matcher_match_groups(tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len, tregex_capture *groups, int ngroups);
+int tregex_matcher_search_groups(tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len, tregex_capture *groups, int ngroups);
+void tregex_iter_init(tregex_iter *it, tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len);
+int tregex_iter_next(tregex_iter *it, tregex_slice *match);
+int tregex_split(tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len, tregex_slice *fields, int max);
+int tregex_tokenize(tregex_matcher *matcher, const tregex_byte_code_list *compiled, const char *str, size_t len, tregex_slice *tokens, int max);
+void tregex_matcher_set_budget(tregex_matcher *matcher, uint64_t max_steps, uint64_t max_cycles);
+void tregex_matcher_destroy(tregex_matcher *matcher);
+tregex_packed *tregex_pack(const tregex_byte_code_list *compiled, int threaded);
+int tregex_packed_match_n(tregex_matcher *matcher, const tregex_packed *packed, const char *str, size_t len);
+int tregex_packed_search_n(tregex_matcher *matcher, const tregex_packed *packed, const char *str, size_t len, int *match_start);
+#ifdef TREGEX_STATS
+void tregex_matcher_set_stats(tregex_matcher *matcher, tregex_stats *stats);
+#endif
+tregex_jit *tregex_jit_create(const tregex_byte_code_list *compiled);
+int tregex_jit_match(tregex_jit *jit, const char *str);
+int tregex_jit_match_n(tregex_jit *jit, const char *str, size_t len);
+int tregex_jit_search_n(tregex_jit *jit, const char *str, size_t len, int *match_start);
+int tregex_jit_native(const tregex_jit *jit);
+void tregex_jit_set_budget(tregex_jit *jit, uint64_t max_steps, uint64_t max_cycles);
+void tregex_jit_destroy(tregex_jit *jit);
+tregex_dfa *tregex_dfa_create(const tregex_byte_code_list *compiled);
+int tregex_dfa_match(tregex_dfa *dfa, const char *str);
+int tregex_dfa_match_n(tregex_dfa *dfa, const char *str, size_t len);
+void tregex_dfa_destroy(tregex_dfa *dfa);
+tregex_onepass *tregex_onepass_create(const tregex_byte_code_list *compiled);
+int tregex_onepass_match_n(const tregex_onepass *onepass, const char *str, size_t len, tregex_capture *groups, int ngroups);
+void tregex_onepass_destroy(tregex_onepass *onepass);
+tregex_set *tregex_set_compile(const char *const *res, int count);
+int tregex_set_match(tregex_set *set, const char *str, uint64_t *matched);
+int tregex_set_match_n(tregex_set *set, const char *str, size_t len, uint64_t *matched);
+void tregex_set_destroy(tregex_set *set);
+tregex_stream *tregex_stream_create(const tregex_byte_code_list *compiled);
+int tregex_stream_feed(tregex_stream *stream, const char *buf, size_t len);
+int64_t tregex_stream_finish(tregex_stream *stream);
+void tregex_stream_reset(tregex_stream *stream);
+void tregex_stream_destroy(tregex_stream *stream);
+int tregex_match_batch(const tregex_byte_code_list *compiled, const tregex_slice *spans, int n, int *results);
+int tregex_match_batch_threads(const tregex_byte_code_list *compiled, const tregex_slice *spans, int n, int *results, int nthreads);
+int64_t tregex_match_parallel(const tregex_byte_code_list *compiled, const char *str, size_t len, int nthreads);
+int tregex_codegen(const tregex_byte_code_list *compiled, const char *name, FILE *out);
 void tregex_dump(const tregex_byte_code_list *byte_code);
-tregex_pool_ctx *tregex_pool_create();
-void tregex_pool_clean(tregex_pool_ctx *pool);
-void tregex_pool_destroy(tregex_pool_ctx *pool);
-void *tregex_pool_alloc(tregex_pool_ctx *pool);
-void tregex_pool_free(tregex_pool_ctx *pool, void *p);
+void tregex_dump_hits(const tregex_byte_code_list *byte_code, const uint64_t *hits);
+TREGEX_DEPRECATED tregex_pool_ctx *tregex_pool_create();
+TREGEX_DEPRECATED void tregex_pool_clean(tregex_pool_ctx *pool);
+TREGEX_DEPRECATED void tregex_pool_destroy(tregex_pool_ctx *pool);
+TREGEX_DEPRECATED void *tregex_pool_alloc(tregex_pool_ctx *pool);
+TREGEX_DEPRECATED void tregex_pool_free(tregex_pool_ctx *pool, void *p);
 
 #endif // !TREGEX_HEADER